@@ -14,7 +14,7 @@
  * limitations under the License.
  */
 
-// We draw a pattern on the screen, encoding information in the colors that can be read by the server in screenshots. We can encode three bytes per pixel, ignoring the alpha channel. The pattern starts with a "magic" identification number, then encodes information about the state of the page.
+// We draw a pattern on the screen, encoding information in the colors that can be read by the server in screenshots. We can encode three bytes per pixel, ignoring the alpha channel. The pattern starts with a "magic" identification number, then encodes information about the state of the page. The layout of the data must match the one described in latency-benchmark.h.
 
 // Make the page background a repeating gradient from rgb(0, 0, 0) to rgb(255, 255, 255). This allows the server to read the page's scroll position (mod 255). This background will be almost entirely covered by other content, leaving only one pixel visible for the server to read.
 document.body.style.backgroundImage = 'url("gradient.png")';
@@ -67,8 +67,8 @@ setPrefixed('animationIterationCount', 'infinite', gradientImage.style);
 setPrefixed('transformOrigin', '0px 0px 0px', gradientImage.style);
 
 var keyframesCss = '@{prefix}keyframes gradientImage {' +
-                   'from {{prefix}transform: translate(6px, 0px); }' +
-                   'to {{prefix}transform: translate(6px, -255px); }}';
+                   'from {{prefix}transform: translate(9px, 0px); }' +
+                   'to {{prefix}transform: translate(9px, -255px); }}';
 var keyframesCssWithPrefix = '';
 for (var i = 0; i < cssPrefixes.length; i++) {
   keyframesCssWithPrefix += keyframesCss.replace(/{prefix}/g, cssPrefixes[i]);
@@ -80,7 +80,7 @@ testContainer.appendChild(gradientImage);
 var rightBlocker = document.createElement('div');
 var bottomBlocker = document.createElement('div');
 rightBlocker.style.position = 'absolute';
-rightBlocker.style.left = '7px';
+rightBlocker.style.left = '10px';
 rightBlocker.style.top = '0px';
 rightBlocker.style.background = 'black';
 rightBlocker.style.width = '100%';
@@ -103,10 +103,14 @@ leftBlocker.style.width = '1px';
 leftBlocker.style.height = '10px';
 document.body.appendChild(leftBlocker);
 
-var zPresses = 0;
+// The server sends keystrokes with these keys in turn, and matches our responses to them by the ID of the last key we handled.
+var KEY_IDS = { 90: 1, 88: 2, 67: 3, 86: 4 };  // Z, X, C, V
+var keyPresses = 0;
+var lastKeyId = 0;
 window.onkeydown = function(e) {
-  if (e.keyCode == 90) {
-    zPresses++;
+  if (e.keyCode in KEY_IDS) {
+    keyPresses++;
+    lastKeyId = KEY_IDS[e.keyCode];
   }
   // If Esc is pressed, abort the current test.
   if (e.keyCode == 27) {
@@ -116,7 +120,10 @@ window.onkeydown = function(e) {
 
 
 var frames = 0;
-var patternPixels = 5;
+// The version of the pattern's layout, which the server checks.
+var PATTERN_VERSION = 3;
+// The magic pixels and the data pixels drawn here. The scroll position shows through the transparent pixel after them, and the CSS animation is the pixel after that.
+var patternPixels = 8;
 var patternBytes = patternPixels * 3;
 var randomByte = function() {
   return (Math.random() * 256) | 0;
@@ -147,9 +154,28 @@ var TEST_MODES = {
 var callback = function() {
   raf(callback);
   frames++;
-  patternByteArray[magicPattern.length + 0] = frames;
-  patternByteArray[magicPattern.length + 1] = zPresses;
-  patternByteArray[magicPattern.length + 2] = testMode;
+  var data = magicPattern.length;
+  // The sequence number is drawn twice, so the server can tell if a screenshot caught the pattern half drawn.
+  var sequence = frames & 255;
+  patternByteArray[data + 0] = PATTERN_VERSION;
+  patternByteArray[data + 1] = testMode;
+  patternByteArray[data + 2] = sequence;
+  patternByteArray[data + 3] = frames & 255;
+  patternByteArray[data + 4] = (frames >> 8) & 255;
+  patternByteArray[data + 5] = 0;
+  patternByteArray[data + 6] = keyPresses & 255;
+  patternByteArray[data + 7] = (keyPresses >> 8) & 255;
+  patternByteArray[data + 8] = lastKeyId;
+  // A Fletcher-16 checksum of the three pixels above lets the server reject misread colors.
+  var sum1 = 0;
+  var sum2 = 0;
+  for (var i = data; i < data + 9; i++) {
+    sum1 = (sum1 + patternByteArray[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  patternByteArray[data + 9] = sum1;
+  patternByteArray[data + 10] = sum2;
+  patternByteArray[data + 11] = sequence;
   if (gl) {
     gl.clearColor(0, 0, 0, 0);
     gl.disable(gl.SCISSOR_TEST);
@@ -243,7 +243,11 @@ var round = function(num, sigFigs) {
 
 var requestServerTest = function(test, start, finish) {
   var request = new XMLHttpRequest();
-  request.open('GET', 'http://localhost:5578/test?magicPattern=' + magicPatternHex, true);
+  var url = 'http://localhost:5578/test?magicPattern=' + magicPatternHex;
+  if (test.referenceStrategy) {
+    url += '&referenceStrategy=' + encodeURIComponent(test.referenceStrategy);
+  }
+  request.open('GET', url, true);
   request.onreadystatechange = function() {
     if (request.readyState == 4) {
       if (request.status == 200) {
@@ -262,11 +266,26 @@ var requestServerTest = function(test, start, finish) {
   }, 200);
 };
 
+// Scores are measured in frames of the monitor the test ran on, as reported or
+// measured by the server, or 60 Hz frames if an older server doesn't say.
+var frameTimeMs = function(response) {
+  return response.frameTimeMs || 1000 / (response.refreshRateHz || 60);
+};
+
+// Describes the frames dropped in the pause time test, from one of the frame
+// pacing objects in the server's response.
+var droppedFrames = function(pacing) {
+  if (!pacing || !pacing.frames)
+    return '';
+  return ' (' + pacing.jankPercent.toFixed(1) + '% of frames dropped, up to ' +
+      pacing.longestDroppedRun + ' in a row)';
+};
+
 var inputLatency = function() {
   var test = this;
   testMode = TEST_MODES.JAVASCRIPT_LATENCY;
   requestServerTest(test, function() {}, function(response) {
-    var frames = response.keyDownLatencyMs/(1000/60);
+    var frames = response.keyDownLatencyMs/frameTimeMs(response);
     addScore(frames, 0.5, 3, 1, 'Keydown Latency');
     pass(test, frames.toFixed(1) + ' frames latency (lower is better)');
   });
@@ -276,7 +295,7 @@ var scrollLatency = function() {
   var test = this;
   testMode = TEST_MODES.SCROLL_LATENCY;
   requestServerTest(test, function() {}, function(response) {
-    var frames = response.scrollLatencyMs/(1000/60);
+    var frames = response.scrollLatencyMs/frameTimeMs(response);
     addScore(frames, 0.5, 3, 1, 'Scroll Latency');
     pass(test, frames.toFixed(1) + ' frames latency (lower is better)');
   });
@@ -311,19 +330,22 @@ var testJank = function() {
     for (var i = 0; i < test.report.length; i++) {
       switch (test.report[i]) {
       case 'css':
-        var jank = response.maxCssPauseTimeMs/(1000/60);
+        var jank = response.maxCssPauseTimeMs/frameTimeMs(response);
         addScore(jank, 1, 5, .3, test.name + ' - CSS');
-        reports.push('CSS: ' + jank.toFixed(1) + ' frames jank');
+        reports.push('CSS: ' + jank.toFixed(1) + ' frames jank' +
+            droppedFrames(response.cssFramePacing));
         break;
       case 'js':
-        var jank = response.maxJSPauseTimeMs/(1000/60);
+        var jank = response.maxJSPauseTimeMs/frameTimeMs(response);
         addScore(jank, 1, 5, .3, test.name + ' - Javascript');
-        reports.push('JavaScript: ' + jank.toFixed(1) + ' frames jank');
+        reports.push('JavaScript: ' + jank.toFixed(1) + ' frames jank' +
+            droppedFrames(response.jsFramePacing));
         break;
       case 'scroll':
-        var jank = response.maxScrollPauseTimeMs/(1000/60);
+        var jank = response.maxScrollPauseTimeMs/frameTimeMs(response);
         addScore(jank, 1, 5, .3, test.name + ' - Scrolling');
-        reports.push('Scrolling: ' + jank.toFixed(1) + ' frames jank');
+        reports.push('Scrolling: ' + jank.toFixed(1) + ' frames jank' +
+            droppedFrames(response.scrollFramePacing));
         break;
       }
     }
@@ -336,12 +358,48 @@ var testNative = function() {
   var test = this;
   testMode = TEST_MODES.NATIVE_REFERENCE;
   requestServerTest(test, function() {}, function(response) {
-    results['Native Reference - frames latency'] = (response.keyDownLatencyMs/(1000/60)).toFixed(1);
-    results['Native Reference - frames jank'] = (response.maxCssPauseTimeMs/(1000/60)).toFixed(1);
-    pass(test, ((response.keyDownLatencyMs/(1000/60)).toFixed(1)) + ' frames latency, ' + (response.maxCssPauseTimeMs/(1000/60)).toFixed(1) + ' frames jank (lower is better)');
+    var name = 'Native Reference';
+    if (test.referenceStrategy) {
+      name += ' (' + test.referenceStrategy + ')';
+    }
+    results[name + ' - frames latency'] = (response.keyDownLatencyMs/frameTimeMs(response)).toFixed(1);
+    results[name + ' - frames jank'] = (response.maxCssPauseTimeMs/frameTimeMs(response)).toFixed(1);
+    pass(test, ((response.keyDownLatencyMs/frameTimeMs(response)).toFixed(1)) + ' frames latency, ' + (response.maxCssPauseTimeMs/frameTimeMs(response)).toFixed(1) + ' frames jank (lower is better)');
   });
 };
 
+// The ways the server's native reference window can schedule its frames. Pass
+// one or more of these in the referenceStrategy URL parameter, or 'all', to
+// run the native reference test once for each and compare them.
+var REFERENCE_STRATEGIES = {
+  'immediate': 'Vsync off, renders as soon as input arrives.',
+  'late-vsync': 'Vsync on, renders just before each vblank.',
+  'busy': 'Vsync off, renders continuously.',
+  'vsync': 'Vsync on, double buffered, renders continuously.',
+  'vsync-finish': 'Vsync on, calls glFinish after every frame.',
+  'front-buffer': 'Single buffered, renders to the front buffer on input.'
+};
+
+var nativeReferenceTests = function() {
+  var strategies = params.referenceStrategy || [];
+  if (strategies.indexOf('all') != -1) {
+    strategies = Object.keys(REFERENCE_STRATEGIES);
+  }
+  if (strategies.length == 0) {
+    return [{ name: 'Native reference',
+              info: 'Tests the input latency of a native app\'s window for comparison to the browser.',
+              test: testNative }];
+  }
+  var nativeTests = [];
+  for (var i = 0; i < strategies.length; i++) {
+    nativeTests.push({ name: 'Native reference (' + strategies[i] + ')',
+                       info: REFERENCE_STRATEGIES[strategies[i]] || 'Unknown strategy.',
+                       test: testNative,
+                       referenceStrategy: strategies[i] });
+  }
+  return nativeTests;
+};
+
 
 var giantImageContainer = document.createElement('div');
 var giantImages = [];
@@ -464,9 +522,6 @@ var tests = [
   { name: 'Scroll latency',
     info: 'Tests the delay from mousewheel movement to on-screen response.',
     test: scrollLatency },
-  { name: 'Native reference',
-    info: 'Tests the input latency of a native app\'s window for comparison to the browser.',
-    test: testNative },
   { name: 'Baseline jank',
     info: 'Tests responsiveness while the browser is idle.',
     test: testJank, blocker: control, report: ['css', 'js', 'scroll'] },
@@ -523,6 +578,8 @@ var tests = [
   // { name: 'Work per frame, high load', test: testJank, blocker: cpuLoad(8, 14) },
   // { name: 'Worker GC doesn\'t affect main page', test: testJank, blocker: workerGCLoad },
   ];
+// The native reference tests go after the latency tests.
+tests.splice.apply(tests, [2, 0].concat(nativeReferenceTests()));
 
 for (var i = 0; i < tests.length; i++) {
   var test = tests[i];
@@ -1,13 +1,24 @@
 {
+  'variables': {
+    # Build the Linux version for Wayland instead of X11, with
+    # GYP_DEFINES=use_wayland=1.
+    'use_wayland%': 0,
+  },
   'targets': [
     {
       'target_name': 'latency-benchmark',
       'type': 'executable',
       'sources': [
+        'src/histogram.c',
+        'src/histogram.h',
         'src/latency-benchmark.c',
         'src/latency-benchmark.h',
+        'src/pixel-search.c',
+        'src/pixel-search.h',
         'src/screenscraper.h',
         'src/server.c',
+        'src/trace.c',
+        'src/trace.h',
         'src/oculus.cpp',
         'src/oculus.h',
         'src/clioptions.c',
@@ -43,12 +54,40 @@
         },
       ],
       'conditions': [
-        ['OS=="linux"', {
+        ['OS=="linux" and use_wayland==0', {
           'sources': [
+            'src/x11/clock.c',
+            'src/x11/clock.h',
             'src/x11/screenscraper.c',
+            'src/x11/uinput.c',
+            'src/x11/uinput.h',
             'src/x11/main.c',
+            'src/x11/vblank.c',
+            'src/x11/vblank.h',
           ],
         }],
+        ['OS=="linux" and use_wayland==1', {
+          'sources': [
+            'src/screenshot-pool.c',
+            'src/screenshot-pool.h',
+            'src/wayland/portal.c',
+            'src/wayland/portal.h',
+            'src/wayland/screenscraper.c',
+            'src/x11/clock.c',
+            'src/x11/clock.h',
+            'src/x11/main.c',
+            'src/x11/uinput.c',
+            'src/x11/uinput.h',
+          ],
+          'cflags': [
+            '<!@(pkg-config --cflags libpipewire-0.3 libei-1.0 gio-unix-2.0)',
+          ],
+          'link_settings': {
+            'libraries': [
+              '<!@(pkg-config --libs libpipewire-0.3 libei-1.0 gio-unix-2.0)',
+            ],
+          },
+        }],
         ['OS=="win"', {
           'sources': [
             'src/win/getopt.c',
@@ -84,6 +123,61 @@
         },
       },
     },
+    {
+      # Measures the throughput of the pattern search kernels on synthetic
+      # 1080p, 4K and 8K frames.
+      'target_name': 'pixel-search-benchmark',
+      'type': 'executable',
+      'sources': [
+        'src/pixel-search.c',
+        'src/pixel-search.h',
+        'src/pixel-search-benchmark.c',
+      ],
+      'msvs_settings': {
+        'VCCLCompilerTool': {
+          'CompileAs': 2, # Compile C as C++, since msvs doesn't support C99
+        },
+        'VCLinkerTool': {
+          'SubSystem': 1, # Console
+        },
+      },
+    },
+    {
+      # Runs the latency tests against a simulated display and page, and checks
+      # the results against the simulation's true latency. Needs no display or
+      # browser, so it can run in continuous integration.
+      'target_name': 'latency-benchmark-headless',
+      'type': 'executable',
+      'sources': [
+        'src/headless/headless.h',
+        'src/headless/main.c',
+        'src/headless/screenscraper.c',
+        'src/histogram.c',
+        'src/histogram.h',
+        'src/latency-benchmark.c',
+        'src/latency-benchmark.h',
+        'src/pixel-search.c',
+        'src/pixel-search.h',
+        'src/screenscraper.h',
+        'src/screenshot-pool.c',
+        'src/screenshot-pool.h',
+        'src/trace.c',
+        'src/trace.h',
+      ],
+      'conditions': [
+        ['OS=="win"', {
+          # The simulation uses pthreads.
+          'type': 'none',
+        }],
+        ['OS=="mac"', {
+          'link_settings': {
+            'libraries': [
+              '$(SDKROOT)/System/Library/Frameworks/OpenGL.framework',
+            ],
+          },
+        }],
+      ],
+    },
     {
       'target_name': 'mongoose',
       'type': 'static_library',
@@ -242,14 +336,28 @@
     'conditions': [
       ['OS=="linux"', {
         'ldflags': [ '-pthread' ],
+        # The Oculus SDK finds the headset's display with Xinerama, and the
+        # pattern drawing code uses OpenGL, even in the Wayland build.
         'link_settings': {
           'libraries' : [
           '-ldl',
           '-lX11',
-          '-lXtst',
           '-lGL',
           '-ludev',
           '-lXinerama',
+          '-lm',
+          ],
+        },
+      }],
+      ['OS=="linux" and use_wayland==0', {
+        'link_settings': {
+          'libraries' : [
+          '-lXtst',
+          '-lXext',
+          '-lXdamage',
+          '-lXi',
+          '-lXpresent',
+          '-lXrandr',
           ],
         },
       }],
@@ -1,4 +1,5 @@
 #include "clioptions.h"
+#include "latency-benchmark.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,12 +9,48 @@ extern int optind;
 extern char optopt;
 int getopt(int, char **, char *);
 
+static const int default_min_measurements = 10;
+static const int default_max_measurements = 1000;
+
 void print_usage_and_exit() {
   fprintf(stderr, "usage: latency-benchmark -a -b path_to_browser_executable\n");
   fprintf(stderr, "           [-r url_to_post_results_to] [-e arguments_for_browser]\n");
+  fprintf(stderr, "           [-t trace_file] [-c confidence_interval_ms\n");
+  fprintf(stderr, "           [-q percentile] [-n min_samples] [-m max_samples]] [-T] [-V] [-D]\n");
+  fprintf(stderr, "           [-s reference_strategy] [-i input_method]\n");
+  fprintf(stderr, "           [-k keystrokes | -f keystroke_rate_hz]\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "Measures input latency and jank in web browsers. Specify -a, -b,\n");
   fprintf(stderr, "and -r to automatically run the test and report results to a server.\n");
+  fprintf(stderr, "Specify -t to write a trace of every sample to a file that can be\n");
+  fprintf(stderr, "opened in Perfetto or chrome://tracing.\n");
+  fprintf(stderr, "Specify -c to keep sampling latency until the 95%% confidence interval\n");
+  fprintf(stderr, "on the mean (or on the percentile given by -q) is at most +/- that many\n");
+  fprintf(stderr, "milliseconds, taking between -n (default %d) and -m (default %d) samples.\n",
+          default_min_measurements, default_max_measurements);
+  fprintf(stderr, "On Linux, specify -T to time events with the CPU's invariant TSC.\n");
+  fprintf(stderr, "Specify -V to snap latency to display refreshes where vblank times are\n");
+  fprintf(stderr, "known (X servers with the Present extension).\n");
+  fprintf(stderr, "Specify -D to take screenshots only when the X server reports damage to\n");
+  fprintf(stderr, "the test pattern, instead of polling continuously.\n");
+  fprintf(stderr, "Specify -s to choose how the native reference window schedules frames:\n");
+  fprintf(stderr, "\"immediate\" (the default) draws as soon as input arrives with vsync off.\n");
+  fprintf(stderr, "On Linux there are also \"late-vsync\", which draws just before each vblank,\n");
+  fprintf(stderr, "\"busy\" (vsync off), \"vsync\" and \"vsync-finish\", which draw continuously,\n");
+  fprintf(stderr, "and \"front-buffer\", which draws to a single-buffered window on input.\n");
+  fprintf(stderr, "Test pages can override it with the referenceStrategy URL parameter.\n");
+  fprintf(stderr, "On Linux, specify -i xtest to send input with the XTest extension instead\n");
+  fprintf(stderr, "of XSendEvent, and time latency from when the X server dispatched it.\n");
+  fprintf(stderr, "Specify -i uinput to send input from virtual devices in the kernel, which\n");
+  fprintf(stderr, "requires write access to /dev/uinput.\n");
+  fprintf(stderr, "Specify -k to keep up to that many keystrokes (at most %d) waiting for a\n",
+          KEY_ID_COUNT);
+  fprintf(stderr, "response in the key down latency test, instead of one at a time. Each\n");
+  fprintf(stderr, "is sent with a different key, so responses can still be told apart.\n");
+  fprintf(stderr, "Specify -f to send keystrokes at a fixed rate instead, e.g. 120, whether or\n");
+  fprintf(stderr, "not they have been answered, and report latency under that load and the\n");
+  fprintf(stderr, "rate at which the browser kept up. Test pages can override it with the\n");
+  fprintf(stderr, "injectionRateHz URL parameter.\n");
   exit(1);
 }
 
@@ -24,7 +61,7 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
   int c;
 
   //TODO: use getopt_long for better looking cli args
-  while ((c = getopt(argc, (char **)argv, "ab:d:r:e:p:h:")) != -1) {
+  while ((c = getopt(argc, (char **)argv, "ab:d:r:e:p:h:t:c:q:n:m:s:i:k:f:TVD")) != -1) {
     switch(c) {
     case 'a':
       options->automated = true;
@@ -44,6 +81,58 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
     case 'h':
       options->parent_handle = optarg;
       break;
+    case 't':
+      options->trace_file = optarg;
+      break;
+    case 'c':
+      options->confidence_interval_ms = atof(optarg);
+      break;
+    case 'q':
+      options->confidence_percentile = atof(optarg);
+      break;
+    case 'n':
+      options->min_measurements = atoi(optarg);
+      break;
+    case 'm':
+      options->max_measurements = atoi(optarg);
+      break;
+    case 's':
+      if (!parse_native_reference_strategy(optarg,
+                                           &options->reference_strategy)) {
+        fprintf(stderr, "Unknown native reference strategy: %s\n", optarg);
+        print_usage_and_exit();
+      }
+      break;
+    case 'i':
+      if (!parse_input_method(optarg, &options->input_method)) {
+        fprintf(stderr, "Unknown input method: %s\n", optarg);
+        print_usage_and_exit();
+      }
+      break;
+    case 'k':
+      options->keystrokes_in_flight = atoi(optarg);
+      if (options->keystrokes_in_flight < 1 ||
+          options->keystrokes_in_flight > KEY_ID_COUNT) {
+        fprintf(stderr, "-k must be between 1 and %d.\n", KEY_ID_COUNT);
+        print_usage_and_exit();
+      }
+      break;
+    case 'f':
+      options->injection_rate_hz = atof(optarg);
+      if (options->injection_rate_hz <= 0) {
+        fprintf(stderr, "-f must be a positive rate.\n");
+        print_usage_and_exit();
+      }
+      break;
+    case 'T':
+      options->use_cycle_counter = true;
+      break;
+    case 'V':
+      options->snap_to_vblank = true;
+      break;
+    case 'D':
+      options->wait_for_damage = true;
+      break;
     case ':':
       fprintf(stderr, "Option -%c requires an operand\n", optopt);
       print_usage_and_exit();
@@ -57,7 +146,8 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
   // Validate the options.
   if (options->magic_pattern) {
     if (options->automated || options->browser || options->results_url ||
-        options->browser_args) {
+        options->browser_args || options->trace_file ||
+        options->confidence_interval_ms) {
       fprintf(stderr, "-p is incompatible with all other options except -h.\n");
       print_usage_and_exit();
     }
@@ -74,4 +164,32 @@ void parse_commandline(int argc, const char **argv, clioptions *options) {
     fprintf(stderr, "-b must be specified when -e is present.");
     print_usage_and_exit();
   }
+  if ((options->confidence_percentile || options->min_measurements ||
+       options->max_measurements) && options->confidence_interval_ms <= 0) {
+    fprintf(stderr, "-c must be specified with a positive interval when -q, -n or -m is present.\n");
+    print_usage_and_exit();
+  }
+  if (options->keystrokes_in_flight && options->injection_rate_hz) {
+    fprintf(stderr, "-k and -f can't be used together.\n");
+    print_usage_and_exit();
+  }
+  if (options->confidence_percentile < 0 ||
+      options->confidence_percentile >= 100) {
+    fprintf(stderr, "The percentile given by -q must be between 0 and 100.\n");
+    print_usage_and_exit();
+  }
+  if (options->confidence_interval_ms > 0) {
+    if (!options->min_measurements) {
+      options->min_measurements = default_min_measurements;
+    }
+    if (!options->max_measurements) {
+      options->max_measurements = default_max_measurements;
+    }
+    // A confidence interval needs at least two samples.
+    if (options->min_measurements < 2 ||
+        options->max_measurements < options->min_measurements) {
+      fprintf(stderr, "-n must be at least 2 and no more than -m.\n");
+      print_usage_and_exit();
+    }
+  }
 }
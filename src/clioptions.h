@@ -13,6 +13,29 @@ typedef struct {
                        // hexadecimal.
   char *parent_handle; // On Windows, this option is passed to child processes
                        // holding the HANDLE value of their parent.
+  char *trace_file; // If set, every sample taken during latency tests is
+                    // recorded and written to this file as Chrome trace-event
+                    // JSON when the server exits.
+  double confidence_interval_ms; // If positive, latency tests take samples
+                                 // until the 95% confidence interval is at
+                                 // most +/- this many milliseconds.
+  double confidence_percentile; // Target the interval on this percentile of
+                                // the latency instead of the mean.
+  int min_measurements; // Bounds on the number of samples taken when
+  int max_measurements; // targeting a confidence interval.
+  bool use_cycle_counter; // On Linux, time events with the CPU's invariant
+                          // TSC instead of CLOCK_MONOTONIC_RAW.
+  bool snap_to_vblank; // Snap latency bounds to display refreshes when the
+                       // platform reports vblank times.
+  bool wait_for_damage; // Take screenshots when the platform reports that
+                        // the pattern changed, instead of polling.
+  int keystrokes_in_flight; // How many keystrokes the key down latency test
+                            // keeps waiting for responses at once.
+  double injection_rate_hz; // If positive, the key down latency test sends
+                            // keystrokes at this fixed rate instead.
+  native_reference_strategy reference_strategy; // How the native reference
+                                                // window schedules frames.
+  input_method input_method; // How input events are generated.
 } clioptions;
 
 void parse_commandline(int argc, const char **argv, clioptions *options);
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A simulated display, input queue and test page, used in place of a real
+// platform to run measure_latency without a display or a browser. The
+// simulated page draws the test pattern into an in-memory framebuffer once per
+// refresh, and responds to each keystroke or scroll event after a random delay.
+// Because the simulation knows exactly when each response reached the
+// framebuffer, it can report the true latency to compare with what
+// measure_latency measured.
+
+#ifndef WLB_HEADLESS_H_
+#define WLB_HEADLESS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../latency-benchmark.h"
+
+typedef struct {
+  uint32_t screen_width, screen_height;
+  // Where the top-left pixel of the test pattern is drawn.
+  uint32_t pattern_x, pattern_y;
+  int64_t refresh_period_nanoseconds;
+  // The page handles each input event after a delay chosen uniformly from
+  // this range. Its response is drawn in the next frame after that.
+  int64_t min_response_nanoseconds;
+  int64_t max_response_nanoseconds;
+  // In the pause time test, the page's JavaScript misses every
+  // drop_frame_period-th frame (never if 0), though its CSS animation doesn't,
+  // and the page finishes the test after pause_test_frames refreshes.
+  int drop_frame_period;
+  int pause_test_frames;
+  // If set, the display doesn't report its refresh rate or vblank times, so
+  // the test has to measure the refresh rate itself.
+  bool hide_refresh_timing;
+  unsigned int seed;
+} headless_config;
+
+// Fills in a default configuration: a 1920x1080 screen at 60 Hz, with a page
+// that responds to input after 2 to 30 milliseconds and runs the pause time
+// test for 120 refreshes without dropping frames.
+void headless_default_config(headless_config *config);
+
+// Starts simulating a page that displays the given pattern in the given test
+// mode. Ground truth statistics are reset. Returns false if the configuration
+// is invalid.
+bool headless_start(const headless_config *config,
+    const uint8_t magic_pattern[], test_mode_t test_mode);
+
+// Stops the simulated page.
+void headless_stop();
+
+// The true latency of every input event handled by the page since
+// headless_start: the time from sending the event to the first frame showing
+// the response. Also the number of frames the page missed in the pause time
+// test.
+typedef struct {
+  int events;
+  double mean_ms;
+  histogram latencies;
+  int dropped_frames;
+} headless_ground_truth;
+
+// Copies the ground truth for events handled so far.
+void headless_get_ground_truth(headless_ground_truth *out);
+
+// Counts the frames the page missed in the pause time test between the given
+// times, and the most of them in a row.
+void headless_count_dropped_frames(int64_t start_time, int64_t end_time,
+    int *out_dropped_frames, int *out_longest_run);
+
+#endif  // WLB_HEADLESS_H_
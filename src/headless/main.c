@@ -0,0 +1,240 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the key down and scroll latency tests and the pause time test against
+// the simulated page in headless.h and checks the results against the true
+// latency and dropped frames of the simulated page. Exits with status 0 if
+// every measurement is within the tolerance, so it can be run in continuous
+// integration.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../screenscraper.h"
+#include "../latency-benchmark.h"
+#include "headless.h"
+
+extern char *optarg;
+int getopt(int, char **, char *);
+
+static void print_usage() {
+  fprintf(stderr, "usage: latency-benchmark-headless [-r refresh_hz]\n");
+  fprintf(stderr, "           [-d min_response_ms] [-D max_response_ms]\n");
+  fprintf(stderr, "           [-s seed] [-e tolerance_ms] [-V] [-w]\n");
+  fprintf(stderr, "           [-k keystrokes | -f keystroke_rate_hz]\n");
+  fprintf(stderr, "           [-j drop_frame_period] [-R] [-h]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Measures the latency of a simulated page that responds\n");
+  fprintf(stderr, "to input after a random delay, and checks the results\n");
+  fprintf(stderr, "against the true latency. In the pause time test the\n");
+  fprintf(stderr, "page misses every drop_frame_period-th frame (10 by\n");
+  fprintf(stderr, "default), and the frames the test saw dropped are\n");
+  fprintf(stderr, "checked against the frames the page missed while the\n");
+  fprintf(stderr, "test was watching. Specify -R to hide the display's\n");
+  fprintf(stderr, "refresh rate and vblank times, so that the test has to\n");
+  fprintf(stderr, "measure the refresh rate from the page's frame\n");
+  fprintf(stderr, "counters.\n");
+}
+
+
+static void print_usage_and_exit() {
+  print_usage();
+  exit(1);
+}
+
+
+// Runs one test against a freshly started page. Returns false if the test
+// failed or the measured latency is further than tolerance_ms from the truth.
+static bool run_headless_test(const char *name, test_mode_t test_mode,
+    const headless_config *config, const measurement_options *options,
+    double tolerance_ms) {
+  uint8_t magic_pattern[pattern_magic_bytes];
+  for (int i = 0; i < pattern_magic_bytes; i++) {
+    magic_pattern[i] = (i % 4 == 3) ? 255 : rand();
+  }
+  if (!headless_start(config, magic_pattern, test_mode)) {
+    fprintf(stderr, "Invalid headless configuration.\n");
+    return false;
+  }
+  // The results include several histograms, which are too big for the stack.
+  latency_results *results =
+      (latency_results *)calloc(1, sizeof(latency_results));
+  char *error = "Unknown error.";
+  bool success = measure_latency(magic_pattern, options, results, &error);
+  headless_stop();
+  headless_ground_truth *truth =
+      (headless_ground_truth *)malloc(sizeof(headless_ground_truth));
+  headless_get_ground_truth(truth);
+  if (!success) {
+    printf("%-8s FAILED: %s\n", name, error);
+  } else if (results->refresh_rate_hz * config->refresh_period_nanoseconds <
+                 0.98 * nanoseconds_per_second ||
+             results->refresh_rate_hz * config->refresh_period_nanoseconds >
+                 1.02 * nanoseconds_per_second) {
+    printf("%-8s FAILED: refresh rate %.2f Hz, should be %.2f Hz\n", name,
+           results->refresh_rate_hz,
+           nanoseconds_per_second /
+               (double)config->refresh_period_nanoseconds);
+    success = false;
+  } else if (test_mode == TEST_MODE_PAUSE_TIME) {
+    const frame_pacing *pacing = &results->javascript_pacing;
+    printf("%-8s measured %4d dropped frames (%.1f%% jank, longest run %d)\n",
+           name, pacing->dropped_frames, pacing->jank_percent,
+           pacing->longest_dropped_run);
+    // Frames missed before the test loop's first frame, e.g. while it
+    // measured the refresh rate, aren't seen, so only the frames the page
+    // missed between the first and last frames the test timed are counted.
+    int true_dropped_frames, true_longest_run;
+    headless_count_dropped_frames(pacing->first_frame_time,
+        pacing->last_frame_time, &true_dropped_frames, &true_longest_run);
+    printf("%-8s true     %4d dropped frames (%d in all, longest run %d)\n",
+           name, true_dropped_frames, truth->dropped_frames,
+           true_longest_run);
+    if (pacing->dropped_frames > true_dropped_frames + 1 ||
+        pacing->dropped_frames < true_dropped_frames - 1) {
+      printf("%-8s FAILED: off by %d frames\n", name,
+             pacing->dropped_frames - true_dropped_frames);
+      success = false;
+    }
+    if (pacing->longest_dropped_run != true_longest_run) {
+      printf("%-8s FAILED: longest run of dropped frames is %d, should be "
+             "%d\n", name, pacing->longest_dropped_run, true_longest_run);
+      success = false;
+    }
+  } else {
+    double measured_ms = test_mode == TEST_MODE_JAVASCRIPT_LATENCY ?
+        results->key_down_latency_ms : results->scroll_latency_ms;
+    const percentiles *measured = test_mode == TEST_MODE_JAVASCRIPT_LATENCY ?
+        &results->key_down_latency : &results->scroll_latency;
+    double error_ms = measured_ms - truth->mean_ms;
+    printf("%-8s measured %7.3f ms (p50 %7.3f, p99 %7.3f)\n", name,
+           measured_ms, measured->p50_ms, measured->p99_ms);
+    printf("%-8s true     %7.3f ms (p50 %7.3f, p99 %7.3f) over %d events\n",
+           name, truth->mean_ms,
+           histogram_value_at_percentile(&truth->latencies, 50) /
+               (double)nanoseconds_per_millisecond,
+           histogram_value_at_percentile(&truth->latencies, 99) /
+               (double)nanoseconds_per_millisecond,
+           truth->events);
+    printf("%-8s sampled  %7.0f screenshots per second\n", name,
+           results->samples_per_second);
+    printf("%-8s refresh  %7.2f Hz, so %.2f frames of latency\n", name,
+           results->refresh_rate_hz, measured_ms / results->frame_time_ms);
+    if (test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
+      printf("%-8s handled  %7.1f keystrokes per second\n", name,
+             results->key_down_events_per_second);
+    }
+    if (error_ms > tolerance_ms || error_ms < -tolerance_ms) {
+      printf("%-8s FAILED: off by %.3f ms\n", name, error_ms);
+      success = false;
+    }
+  }
+  free(truth);
+  free(results);
+  return success;
+}
+
+
+int main(int argc, const char **argv) {
+  headless_config config;
+  headless_default_config(&config);
+  measurement_options options;
+  memset(&options, 0, sizeof(options));
+  double tolerance_ms = 1;
+  int drop_frame_period = 10;
+  int c;
+  while ((c = getopt(argc, (char **)argv, "r:d:D:s:e:k:f:j:RVwh")) != -1) {
+    switch (c) {
+    case 'r':
+      config.refresh_period_nanoseconds =
+          (int64_t)(nanoseconds_per_second / atof(optarg));
+      break;
+    case 'd':
+      config.min_response_nanoseconds =
+          (int64_t)(atof(optarg) * nanoseconds_per_millisecond);
+      break;
+    case 'D':
+      config.max_response_nanoseconds =
+          (int64_t)(atof(optarg) * nanoseconds_per_millisecond);
+      break;
+    case 's':
+      config.seed = (unsigned int)atoi(optarg);
+      break;
+    case 'e':
+      tolerance_ms = atof(optarg);
+      break;
+    case 'V':
+      options.snap_to_vblank = true;
+      break;
+    case 'w':
+      options.wait_for_screen_changes = true;
+      break;
+    case 'k':
+      options.keystrokes_in_flight = atoi(optarg);
+      if (options.keystrokes_in_flight < 1 ||
+          options.keystrokes_in_flight > KEY_ID_COUNT) {
+        fprintf(stderr, "-k must be between 1 and %d.\n", KEY_ID_COUNT);
+        print_usage_and_exit();
+      }
+      break;
+    case 'f':
+      options.injection_rate_hz = atof(optarg);
+      if (options.injection_rate_hz <= 0) {
+        fprintf(stderr, "-f must be a positive rate.\n");
+        print_usage_and_exit();
+      }
+      break;
+    case 'j':
+      drop_frame_period = atoi(optarg);
+      break;
+    case 'R':
+      config.hide_refresh_timing = true;
+      break;
+    case 'h':
+      print_usage();
+      exit(0);
+    default:
+      print_usage_and_exit();
+    }
+  }
+  if (options.keystrokes_in_flight && options.injection_rate_hz) {
+    fprintf(stderr, "-k and -f can't be used together.\n");
+    print_usage_and_exit();
+  }
+  srand(config.seed);
+  bool success = run_headless_test("keydown", TEST_MODE_JAVASCRIPT_LATENCY,
+      &config, &options, tolerance_ms);
+  success &= run_headless_test("scroll", TEST_MODE_SCROLL_LATENCY, &config,
+      &options, tolerance_ms);
+  config.drop_frame_period = drop_frame_period;
+  success &= run_headless_test("pause", TEST_MODE_PAUSE_TIME, &config,
+      &options, tolerance_ms);
+  // The refresh rate must also be measured correctly when the display hides
+  // it, at the slow end of the plausible range and when the page's JavaScript
+  // misses every other frame.
+  headless_config hidden_config = config;
+  hidden_config.hide_refresh_timing = true;
+  hidden_config.refresh_period_nanoseconds = nanoseconds_per_second / 30;
+  success &= run_headless_test("30hz", TEST_MODE_PAUSE_TIME, &hidden_config,
+      &options, tolerance_ms);
+  hidden_config = config;
+  hidden_config.hide_refresh_timing = true;
+  hidden_config.drop_frame_period = 2;
+  success &= run_headless_test("halfrate", TEST_MODE_PAUSE_TIME,
+      &hidden_config, &options, tolerance_ms);
+  printf(success ? "PASS\n" : "FAIL\n");
+  return success ? 0 : 1;
+}
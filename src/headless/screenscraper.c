@@ -0,0 +1,531 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// An implementation of screenscraper.h backed by the simulated display in
+// headless.h. Time is real time, so the test loop runs at the same speed as
+// it would against a real browser.
+
+#include "../screenscraper.h"
+#include "../screenshot-pool.h"
+#include "headless.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define min(X, Y) ((X) < (Y) ? (X) : (Y))
+
+// Input events waiting for the page to handle them.
+#define MAX_PENDING_INPUTS 64
+typedef struct {
+  bool scroll;  // A scroll event if true, otherwise a keystroke.
+  int key_id;   // For keystrokes, which key was pressed.
+  int64_t sent_time;
+  int64_t handle_time;  // When the page's event handler runs.
+} pending_input;
+
+// Everything below is protected by page_mutex.
+static pthread_mutex_t page_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled every time a frame is drawn.
+static pthread_cond_t frame_drawn = PTHREAD_COND_INITIALIZER;
+static headless_config page_config;
+static bool page_running = false;
+static volatile bool page_stop = false;
+static pthread_t page_thread;
+static uint8_t *framebuffer = NULL;
+// pattern_bytes isn't a compile-time constant in C.
+static uint8_t pattern[10 * 4];
+// The data the page draws in the pattern.
+static pattern_data page_data;
+static pending_input pending_inputs[MAX_PENDING_INPUTS];
+static int pending_input_count = 0;
+static int64_t last_input_time = 0;
+static unsigned int random_state = 0;
+static int64_t last_vblank_time = 0;
+static int64_t frame_counter = 0;
+// The number of refreshes since the page started.
+static int page_refreshes = 0;
+static headless_ground_truth ground_truth;
+// When each frame the page missed would have been drawn, and which refresh it
+// was.
+#define MAX_DROPPED_FRAMES 4096
+typedef struct {
+  int64_t time;
+  int refresh;
+} dropped_frame;
+static dropped_frame dropped_frames[MAX_DROPPED_FRAMES];
+static double ground_truth_sum_ms = 0;
+
+
+void headless_default_config(headless_config *config) {
+  memset(config, 0, sizeof(headless_config));
+  config->screen_width = 1920;
+  config->screen_height = 1080;
+  config->pattern_x = 320;
+  config->pattern_y = 240;
+  config->refresh_period_nanoseconds = nanoseconds_per_second / 60;
+  config->min_response_nanoseconds = 2 * nanoseconds_per_millisecond;
+  config->max_response_nanoseconds = 30 * nanoseconds_per_millisecond;
+  config->pause_test_frames = 120;
+  config->seed = 1;
+}
+
+
+// rand() is shared with the test loop, so the page has its own generator to
+// keep runs with the same seed comparable.
+static int64_t random_response_delay() {
+  random_state = random_state * 1103515245 + 12345;
+  int64_t range = page_config.max_response_nanoseconds -
+      page_config.min_response_nanoseconds;
+  return page_config.min_response_nanoseconds +
+      (int64_t)((random_state >> 8) / (double)(1 << 24) * range);
+}
+
+
+static void enqueue_input(bool scroll, int key_id) {
+  pthread_mutex_lock(&page_mutex);
+  if (page_running && pending_input_count < MAX_PENDING_INPUTS) {
+    pending_input *input = &pending_inputs[pending_input_count++];
+    input->scroll = scroll;
+    input->key_id = key_id;
+    input->sent_time = get_nanoseconds();
+    input->handle_time = input->sent_time + random_response_delay();
+    // Like a browser, the page handles events in the order they arrive.
+    if (pending_input_count > 1 &&
+        input->handle_time < input[-1].handle_time) {
+      input->handle_time = input[-1].handle_time;
+    }
+    last_input_time = input->sent_time;
+  }
+  pthread_mutex_unlock(&page_mutex);
+}
+
+
+// Runs the event handlers for every input due before the next frame, then
+// draws the frame. Must be called with page_mutex held.
+static void draw_frame(int64_t vblank_time) {
+  page_refreshes++;
+  // In the pause time test the page misses some frames: its JavaScript is too
+  // busy to run, so neither its frame counter nor its input handlers advance,
+  // but the compositor still runs the CSS animation.
+  bool dropped = false;
+  if (page_data.test_mode == TEST_MODE_PAUSE_TIME) {
+    if (page_refreshes > page_config.pause_test_frames) {
+      page_data.test_mode = TEST_MODE_PAUSE_TIME_TEST_FINISHED;
+    } else if (page_config.drop_frame_period &&
+               page_refreshes % page_config.drop_frame_period == 0) {
+      dropped = true;
+      if (ground_truth.dropped_frames < MAX_DROPPED_FRAMES) {
+        dropped_frame *frame = &dropped_frames[ground_truth.dropped_frames];
+        frame->time = get_nanoseconds();
+        frame->refresh = page_refreshes;
+      }
+      ground_truth.dropped_frames++;
+    }
+  }
+  int handled = 0;
+  int64_t sent_times[MAX_PENDING_INPUTS];
+  for (int i = 0; i < pending_input_count; i++) {
+    pending_input *input = &pending_inputs[i];
+    if (dropped || input->handle_time > vblank_time) {
+      pending_inputs[i - handled] = *input;
+      continue;
+    }
+    if (input->scroll) {
+      page_data.scroll_position++;
+    } else {
+      page_data.key_down_events++;
+      page_data.last_key_id = input->key_id;
+    }
+    sent_times[handled++] = input->sent_time;
+  }
+  pending_input_count -= handled;
+  // The JavaScript and CSS animation frame counters advance every frame that
+  // isn't dropped.
+  if (!dropped) {
+    page_data.sequence++;
+    page_data.javascript_frames++;
+  }
+  page_data.css_frames++;
+  encode_pattern_data(&page_data, pattern);
+  uint8_t *row = framebuffer +
+      ((size_t)page_config.pattern_y * page_config.screen_width +
+       page_config.pattern_x) * 4;
+  memcpy(row, pattern, pattern_bytes);
+  // The response is on the screen as of now.
+  int64_t now = get_nanoseconds();
+  last_vblank_time = now;
+  frame_counter++;
+  pthread_cond_broadcast(&frame_drawn);
+  for (int i = 0; i < handled; i++) {
+    int64_t latency = now - sent_times[i];
+    histogram_record(&ground_truth.latencies, latency);
+    ground_truth.events++;
+    ground_truth_sum_ms += latency / (double)nanoseconds_per_millisecond;
+    ground_truth.mean_ms = ground_truth_sum_ms / ground_truth.events;
+  }
+}
+
+
+static void *page_thread_main(void *unused) {
+  int64_t next_vblank = get_nanoseconds();
+  while (!page_stop) {
+    next_vblank += page_config.refresh_period_nanoseconds;
+    int64_t now = get_nanoseconds();
+    if (next_vblank > now) {
+      usleep((unsigned int)((next_vblank - now) / 1000));
+    }
+    pthread_mutex_lock(&page_mutex);
+    draw_frame(next_vblank);
+    pthread_mutex_unlock(&page_mutex);
+  }
+  return NULL;
+}
+
+
+bool headless_start(const headless_config *config,
+    const uint8_t magic_pattern[], test_mode_t test_mode) {
+  assert(!page_running);
+  assert(sizeof(pattern) == pattern_bytes);
+  if (config->pattern_x + pattern_pixels > config->screen_width ||
+      config->pattern_y >= config->screen_height ||
+      config->refresh_period_nanoseconds <= 0 ||
+      config->min_response_nanoseconds < 0 ||
+      config->max_response_nanoseconds < config->min_response_nanoseconds) {
+    return false;
+  }
+  size_t length = (size_t)config->screen_width * config->screen_height * 4;
+  framebuffer = (uint8_t *)malloc(length);
+  if (!framebuffer) {
+    return false;
+  }
+  // A plain gray desktop.
+  memset(framebuffer, 0x80, length);
+  page_config = *config;
+  random_state = config->seed;
+  memset(pattern, 0, pattern_bytes);
+  memcpy(pattern, magic_pattern, pattern_magic_bytes);
+  for (int i = 3; i < pattern_bytes; i += 4) {
+    pattern[i] = 255;
+  }
+  memset(&page_data, 0, sizeof(page_data));
+  page_data.test_mode = test_mode;
+  pending_input_count = 0;
+  last_input_time = 0;
+  frame_counter = 0;
+  page_refreshes = 0;
+  memset(&ground_truth, 0, sizeof(ground_truth));
+  histogram_init(&ground_truth.latencies);
+  ground_truth_sum_ms = 0;
+  pthread_mutex_lock(&page_mutex);
+  draw_frame(get_nanoseconds());
+  pthread_mutex_unlock(&page_mutex);
+  page_stop = false;
+  if (pthread_create(&page_thread, NULL, page_thread_main, NULL) != 0) {
+    free(framebuffer);
+    framebuffer = NULL;
+    return false;
+  }
+  page_running = true;
+  return true;
+}
+
+
+void headless_stop() {
+  if (!page_running) {
+    return;
+  }
+  page_stop = true;
+  pthread_join(page_thread, NULL);
+  pthread_mutex_lock(&page_mutex);
+  page_running = false;
+  free(framebuffer);
+  framebuffer = NULL;
+  pthread_mutex_unlock(&page_mutex);
+}
+
+
+void headless_get_ground_truth(headless_ground_truth *out) {
+  pthread_mutex_lock(&page_mutex);
+  *out = ground_truth;
+  pthread_mutex_unlock(&page_mutex);
+}
+
+
+void headless_count_dropped_frames(int64_t start_time, int64_t end_time,
+    int *out_dropped_frames, int *out_longest_run) {
+  pthread_mutex_lock(&page_mutex);
+  int count = min(ground_truth.dropped_frames, MAX_DROPPED_FRAMES);
+  int dropped = 0;
+  int longest_run = 0;
+  int run = 0;
+  int previous_refresh = -1;
+  for (int i = 0; i < count; i++) {
+    const dropped_frame *frame = &dropped_frames[i];
+    if (frame->time <= start_time || frame->time >= end_time) {
+      continue;
+    }
+    dropped++;
+    run = frame->refresh == previous_refresh + 1 ? run + 1 : 1;
+    if (run > longest_run) {
+      longest_run = run;
+    }
+    previous_refresh = frame->refresh;
+  }
+  pthread_mutex_unlock(&page_mutex);
+  *out_dropped_frames = dropped;
+  *out_longest_run = longest_run;
+}
+
+
+screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
+    uint32_t height) {
+  pthread_mutex_lock(&page_mutex);
+  if (!page_running || x >= page_config.screen_width ||
+      y >= page_config.screen_height) {
+    pthread_mutex_unlock(&page_mutex);
+    return NULL;
+  }
+  width = min(width, page_config.screen_width - x);
+  height = min(height, page_config.screen_height - y);
+  screenshot *shot = screenshot_pool_acquire(width, height);
+  if (!shot) {
+    pthread_mutex_unlock(&page_mutex);
+    return NULL;
+  }
+  uint8_t *pixels = (uint8_t *)shot->pixels;
+  for (uint32_t row = 0; row < height; row++) {
+    memcpy(pixels + (size_t)row * width * 4,
+           framebuffer + ((size_t)(y + row) * page_config.screen_width + x) * 4,
+           (size_t)width * 4);
+  }
+  shot->time_nanoseconds = get_nanoseconds();
+  if (!page_config.hide_refresh_timing) {
+    shot->vblank_time_nanoseconds = last_vblank_time;
+    shot->frame_counter = frame_counter;
+  }
+  shot->platform_specific_data = NULL;
+  pthread_mutex_unlock(&page_mutex);
+  return shot;
+}
+
+
+void free_screenshot(screenshot *shot) {
+  screenshot_pool_release(shot);
+}
+
+
+bool reserve_screenshot_buffers(uint32_t width, uint32_t height, int count) {
+  return screenshot_pool_reserve(width, height, count);
+}
+
+
+void release_screenshot_buffers(uint32_t width, uint32_t height) {
+  screenshot_pool_unreserve(width, height);
+}
+
+
+#ifndef NDEBUG
+int64_t get_screenshot_allocation_count() {
+  return screenshot_pool_allocation_count();
+}
+#endif
+
+
+// The simulated display is a single monitor.
+int get_screen_outputs(screen_output *out_outputs, int max_outputs) {
+  if (max_outputs < 1 || page_config.refresh_period_nanoseconds <= 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&page_mutex);
+  out_outputs[0].x = 0;
+  out_outputs[0].y = 0;
+  out_outputs[0].width = page_config.screen_width;
+  out_outputs[0].height = page_config.screen_height;
+  out_outputs[0].refresh_rate_hz = page_config.hide_refresh_timing ? 0 :
+      nanoseconds_per_second / (double)page_config.refresh_period_nanoseconds;
+  pthread_mutex_unlock(&page_mutex);
+  return 1;
+}
+
+
+void select_screen_output(const screen_output *output) {
+}
+
+
+// Every frame redraws the pattern, so any frame counts as a change. The
+// notification arrives the instant the frame is drawn.
+screen_change_result wait_for_screen_change(uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int64_t timeout_nanoseconds,
+    int64_t *out_change_time) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  int64_t nanoseconds = deadline.tv_nsec + timeout_nanoseconds;
+  deadline.tv_sec += nanoseconds / nanoseconds_per_second;
+  deadline.tv_nsec = nanoseconds % nanoseconds_per_second;
+  pthread_mutex_lock(&page_mutex);
+  int64_t frame = frame_counter;
+  int result = 0;
+  while (frame_counter == frame && result == 0) {
+    result = pthread_cond_timedwait(&frame_drawn, &page_mutex, &deadline);
+  }
+  bool changed = frame_counter != frame;
+  if (changed) {
+    *out_change_time = last_vblank_time;
+  }
+  pthread_mutex_unlock(&page_mutex);
+  return changed ? SCREEN_CHANGED : SCREEN_CHANGE_TIMEOUT;
+}
+
+
+// The simulated page only responds to the keys the test page counts.
+bool send_keystroke_b() { return true; }
+bool send_keystroke_t() { return true; }
+bool send_keystroke_w() { return true; }
+
+bool send_keystroke_z() {
+  enqueue_input(false, 1);
+  return true;
+}
+
+bool send_keystroke_x() {
+  enqueue_input(false, 2);
+  return true;
+}
+
+bool send_keystroke_c() {
+  enqueue_input(false, 3);
+  return true;
+}
+
+bool send_keystroke_v() {
+  enqueue_input(false, 4);
+  return true;
+}
+
+
+bool send_scroll_down(int x, int y) {
+  enqueue_input(true, 0);
+  return true;
+}
+
+
+bool set_input_method(input_method method) {
+  return method == INPUT_METHOD_DEFAULT;
+}
+
+
+// The page receives input the moment it is sent, so the dispatch time is
+// exactly the time the page's latency is measured from.
+int64_t get_last_input_dispatch_time() {
+  pthread_mutex_lock(&page_mutex);
+  int64_t time = last_input_time;
+  pthread_mutex_unlock(&page_mutex);
+  return time;
+}
+
+
+int64_t get_nanoseconds() {
+  static int64_t start = -1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t nanoseconds = (int64_t)now.tv_sec * nanoseconds_per_second +
+      now.tv_nsec;
+  if (start == -1) {
+    start = nanoseconds;
+  }
+  return nanoseconds - start;
+}
+
+
+typedef struct {
+  pthread_t thread;
+  void (*thread_main)(void *);
+  void *argument;
+} headless_thread;
+
+
+static void *run_thread(void *thread) {
+  headless_thread *t = (headless_thread *)thread;
+  t->thread_main(t->argument);
+  return NULL;
+}
+
+
+void *start_thread(void (*thread_main)(void *), void *argument) {
+  headless_thread *thread = (headless_thread *)malloc(sizeof(headless_thread));
+  if (!thread) {
+    return NULL;
+  }
+  thread->thread_main = thread_main;
+  thread->argument = argument;
+  if (pthread_create(&thread->thread, NULL, run_thread, thread) != 0) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+
+void join_thread(void *thread) {
+  headless_thread *t = (headless_thread *)thread;
+  pthread_join(t->thread, NULL);
+  free(t);
+}
+
+
+int get_processor_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
+
+void debug_log(const char *message, ...) {
+#ifndef NDEBUG
+  va_list list;
+  va_start(list, message);
+  vprintf(message, list);
+  va_end(list);
+  putchar('\n');
+  fflush(stdout);
+#endif
+}
+
+
+// There's no browser and no native reference window in headless mode.
+bool open_browser(const char *program, const char *args, const char *url) {
+  return false;
+}
+
+
+bool close_browser() {
+  return false;
+}
+
+
+bool open_native_reference_window(uint8_t *test_pattern,
+    native_reference_strategy strategy) {
+  return false;
+}
+
+
+bool close_native_reference_window() {
+  return false;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include "histogram.h"
+
+static const int64_t nanoseconds_per_unit = 1000;  // Microseconds.
+static const int sub_bucket_count = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+static const int sub_bucket_half_count = 1 << (HISTOGRAM_SUB_BUCKET_BITS - 1);
+static const int64_t max_value = (1LL << HISTOGRAM_MAX_VALUE_BITS) - 1;
+
+
+// The first bucket holds values 0 to sub_bucket_count - 1 exactly. Bucket n
+// holds values in [sub_bucket_count << (n - 1), sub_bucket_count << n), with a
+// resolution of 1 << n. Only the upper half of each bucket after the first is
+// stored, since the lower half overlaps the previous bucket.
+static int bucket_for_value(int64_t value) {
+  int bucket = 0;
+  while ((value >> bucket) >= sub_bucket_count) {
+    bucket++;
+  }
+  return bucket;
+}
+
+
+static int index_for_value(int64_t value) {
+  int bucket = bucket_for_value(value);
+  int sub_bucket = (int)(value >> bucket);
+  int index = bucket * sub_bucket_half_count + sub_bucket;
+  assert(index >= 0 && index < HISTOGRAM_BUCKETS);
+  return index;
+}
+
+
+// Returns the lowest value that maps to the given index, and the number of
+// values that map to it.
+static int64_t lowest_value_for_index(int index, int64_t *out_width) {
+  int bucket = 0;
+  if (index >= sub_bucket_count) {
+    bucket = index / sub_bucket_half_count - 1;
+  }
+  int sub_bucket = index - bucket * sub_bucket_half_count;
+  *out_width = 1LL << bucket;
+  return (int64_t)sub_bucket << bucket;
+}
+
+
+void histogram_init(histogram *histogram) {
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->min_nanoseconds = LLONG_MAX;
+  histogram->max_nanoseconds = 0;
+}
+
+
+void histogram_record(histogram *histogram, int64_t nanoseconds) {
+  if (nanoseconds < 0) {
+    nanoseconds = 0;
+  }
+  int64_t value = nanoseconds / nanoseconds_per_unit;
+  if (value > max_value) {
+    value = max_value;
+  }
+  histogram->counts[index_for_value(value)]++;
+  histogram->total_count++;
+  if (nanoseconds < histogram->min_nanoseconds) {
+    histogram->min_nanoseconds = nanoseconds;
+  }
+  if (nanoseconds > histogram->max_nanoseconds) {
+    histogram->max_nanoseconds = nanoseconds;
+  }
+}
+
+
+int64_t histogram_bucket_value(int bucket) {
+  int64_t width;
+  int64_t lowest = lowest_value_for_index(bucket, &width);
+  return (lowest * nanoseconds_per_unit) +
+      (width * nanoseconds_per_unit) / 2;
+}
+
+
+int64_t histogram_value_at_rank(const histogram *histogram, int64_t rank) {
+  if (histogram->total_count == 0) {
+    return 0;
+  }
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > histogram->total_count) {
+    rank = histogram->total_count;
+  }
+  // The extremes are known exactly, so don't round them to a bucket.
+  if (rank == 1) {
+    return histogram->min_nanoseconds;
+  }
+  if (rank == histogram->total_count) {
+    return histogram->max_nanoseconds;
+  }
+  int64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      int64_t value = histogram_bucket_value(i);
+      if (value < histogram->min_nanoseconds) {
+        value = histogram->min_nanoseconds;
+      }
+      if (value > histogram->max_nanoseconds) {
+        value = histogram->max_nanoseconds;
+      }
+      return value;
+    }
+  }
+  return histogram->max_nanoseconds;
+}
+
+
+int64_t histogram_value_at_percentile(const histogram *histogram,
+    double percentile) {
+  // The rank of the percentile, rounded up (the "nearest rank" method).
+  double exact_rank = percentile / 100 * histogram->total_count;
+  int64_t rank = (int64_t)exact_rank;
+  if (rank < exact_rank) {
+    rank++;
+  }
+  return histogram_value_at_rank(histogram, rank);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A fixed-size histogram of durations, in the style of HdrHistogram. Buckets
+// are log-linear: every power of two range is divided into the same number of
+// equal sub-buckets, so every value is recorded with about 1% precision
+// without any allocation, no matter how long the test runs.
+
+#ifndef WLB_HISTOGRAM_H_
+#define WLB_HISTOGRAM_H_
+
+#include <stdint.h>
+
+// Values are recorded in microseconds. Values from 0 to 127 microseconds are
+// recorded exactly; above that each power of two range has 64 sub-buckets.
+// The largest value that can be recorded is about 134 seconds; larger values
+// are clamped.
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_MAX_VALUE_BITS 27
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 2) << \
+        (HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+typedef struct {
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  int64_t total_count;
+  // The exact extremes of the recorded values, in nanoseconds.
+  int64_t min_nanoseconds;
+  int64_t max_nanoseconds;
+} histogram;
+
+// Initializes an empty histogram.
+void histogram_init(histogram *histogram);
+
+// Records one value. Negative values are recorded as zero.
+void histogram_record(histogram *histogram, int64_t nanoseconds);
+
+// Returns the value below which the given percentage (0-100) of the recorded
+// values fall, in nanoseconds. Returns 0 if the histogram is empty.
+int64_t histogram_value_at_percentile(const histogram *histogram,
+    double percentile);
+
+// Returns the value of the recorded value with the given rank (1 is the
+// smallest, total_count the largest), in nanoseconds. The rank is clamped to
+// the valid range. Returns 0 if the histogram is empty.
+int64_t histogram_value_at_rank(const histogram *histogram, int64_t rank);
+
+// Returns the value that represents the given bucket, in nanoseconds. This is
+// the middle of the range of values that fall in the bucket.
+int64_t histogram_bucket_value(int bucket);
+
+#endif  // WLB_HISTOGRAM_H_
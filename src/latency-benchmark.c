@@ -26,16 +26,101 @@
 #include <stdlib.h>
 #include <time.h>
 #include <limits.h>
+#include <math.h>
 #include "screenscraper.h"
 #include "latency-benchmark.h"
+#include "pixel-search.h"
+#include "trace.h"
 
 int64_t last_draw_time = 0;
 int64_t biggest_draw_time_gap = 0;
 
+// Returns the byte of the data part of a pattern at the given pixel and
+// channel (0 for blue, 1 for green, 2 for red).
+static int pattern_data_byte(int pixel, int channel) {
+  return (pattern_magic_pixels + pixel) * 4 + channel;
+}
+
+
+// Computes the Fletcher-16 checksum of the first three data pixels.
+static void pattern_checksum(const uint8_t pattern[], uint8_t *out_sum1,
+    uint8_t *out_sum2) {
+  int sum1 = 0, sum2 = 0;
+  for (int pixel = 0; pixel < 3; pixel++) {
+    for (int channel = 0; channel < 3; channel++) {
+      sum1 = (sum1 + pattern[pattern_data_byte(pixel, channel)]) % 255;
+      sum2 = (sum2 + sum1) % 255;
+    }
+  }
+  *out_sum1 = sum1;
+  *out_sum2 = sum2;
+}
+
+
+// Reads the data part of a pattern without checking it.
+static void read_pattern_data(const uint8_t pattern[], pattern_data *out) {
+  out->test_mode = (test_mode_t)pattern[pattern_data_byte(0, 1)];
+  out->sequence = pattern[pattern_data_byte(0, 2)];
+  out->javascript_frames = pattern[pattern_data_byte(1, 0)] |
+      pattern[pattern_data_byte(1, 1)] << 8;
+  out->key_down_events = pattern[pattern_data_byte(2, 0)] |
+      pattern[pattern_data_byte(2, 1)] << 8;
+  out->last_key_id = pattern[pattern_data_byte(2, 2)];
+  out->scroll_position = pattern[pattern_data_byte(4, 0)];
+  out->css_frames = pattern[pattern_data_byte(5, 0)];
+}
+
+
+void encode_pattern_data(const pattern_data *data, uint8_t pattern[]) {
+  pattern[pattern_data_byte(0, 0)] = pattern_version;
+  pattern[pattern_data_byte(0, 1)] = data->test_mode;
+  pattern[pattern_data_byte(0, 2)] = data->sequence;
+  pattern[pattern_data_byte(1, 0)] = data->javascript_frames & 0xff;
+  pattern[pattern_data_byte(1, 1)] = data->javascript_frames >> 8;
+  pattern[pattern_data_byte(1, 2)] = 0;
+  pattern[pattern_data_byte(2, 0)] = data->key_down_events & 0xff;
+  pattern[pattern_data_byte(2, 1)] = data->key_down_events >> 8;
+  pattern[pattern_data_byte(2, 2)] = data->last_key_id;
+  pattern_checksum(pattern, &pattern[pattern_data_byte(3, 0)],
+      &pattern[pattern_data_byte(3, 1)]);
+  pattern[pattern_data_byte(3, 2)] = data->sequence;
+  for (int channel = 0; channel < 3; channel++) {
+    pattern[pattern_data_byte(4, channel)] = data->scroll_position;
+    pattern[pattern_data_byte(5, channel)] = data->css_frames;
+  }
+}
+
+
+bool decode_pattern_data(const uint8_t pattern[], pattern_data *out_data) {
+  if (pattern[pattern_data_byte(0, 0)] != pattern_version) {
+    return false;
+  }
+  uint8_t sum1, sum2;
+  pattern_checksum(pattern, &sum1, &sum2);
+  if (sum1 != pattern[pattern_data_byte(3, 0)] ||
+      sum2 != pattern[pattern_data_byte(3, 1)] ||
+      pattern[pattern_data_byte(0, 2)] != pattern[pattern_data_byte(3, 2)] ||
+      pattern[pattern_data_byte(1, 2)] ||
+      pattern[pattern_data_byte(2, 2)] > KEY_ID_COUNT) {
+    return false;
+  }
+  for (int pixel = 4; pixel < 6; pixel++) {
+    uint8_t value = pattern[pattern_data_byte(pixel, 0)];
+    if (pattern[pattern_data_byte(pixel, 1)] != value ||
+        pattern[pattern_data_byte(pixel, 2)] != value) {
+      return false;
+    }
+  }
+  read_pattern_data(pattern, out_data);
+  return true;
+}
+
+
 // Updates the given pattern with the given event data, then draws the pattern
 // to the current OpenGL context.
 void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
-                              int keydown_events, int esc_presses) {
+                              int keydown_events, int last_key_id,
+                              int esc_presses) {
   int64_t time = get_nanoseconds();
   if (last_draw_time > 0) {
     if (time - last_draw_time > biggest_draw_time_gap) {
@@ -45,28 +130,31 @@ void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
     }
   }
   last_draw_time = time;
+  // The pattern holds the frame counters between frames.
+  pattern_data data;
+  read_pattern_data(pattern, &data);
   if (esc_presses == 0) {
-    pattern[4 * 4 + 2] = TEST_MODE_JAVASCRIPT_LATENCY;
+    data.test_mode = TEST_MODE_JAVASCRIPT_LATENCY;
   } else {
-    pattern[4 * 4 + 2] = TEST_MODE_ABORT;
-  }
-  // Update the pattern with the number of scroll events mod 255.
-  pattern[4 * 5] = pattern[4 * 5 + 1] = pattern[4 * 5 + 2] = scroll_events;
-  // Update the pattern with the number of keydown events mod 255.
-  pattern[4 * 4 + 1] = keydown_events;
-  // Increment the "JavaScript frames" counter.
-  pattern[4 * 4 + 0]++;
-  // Increment the "CSS animation frames" counter.
-  pattern[4 * 6 + 0]++;
-  pattern[4 * 6 + 1]++;
-  pattern[4 * 6 + 2]++;
+    data.test_mode = TEST_MODE_ABORT;
+  }
+  data.sequence++;
+  // Update the pattern with the number of scroll events mod 256.
+  data.scroll_position = scroll_events;
+  // Update the pattern with the number of keydown events mod 65536.
+  data.key_down_events = keydown_events;
+  data.last_key_id = last_key_id;
+  // Increment the "JavaScript frames" and "CSS animation frames" counters.
+  data.javascript_frames++;
+  data.css_frames++;
+  encode_pattern_data(&data, pattern);
   GLint viewport[4];
   glGetIntegerv(GL_VIEWPORT, viewport);
   GLint height = viewport[3];
   glDisable(GL_SCISSOR_TEST);
   // Alternate background each frame to make tearing easy to spot.
   float background = 1;
-  if (pattern[4 * 4 + 0] % 2 == 1)
+  if (data.javascript_frames % 2 == 1)
     background = 0.8;
   glClearColor(background, background, background, 1);
   glClear(GL_COLOR_BUFFER_BIT);
@@ -81,6 +169,67 @@ void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
 }
 
 
+static const char *native_reference_strategy_names[] = {
+  "immediate",
+  "late-vsync",
+  "busy",
+  "vsync",
+  "vsync-finish",
+  "front-buffer",
+};
+
+
+const char *native_reference_strategy_name(native_reference_strategy strategy) {
+  assert(sizeof(native_reference_strategy_names) /
+         sizeof(native_reference_strategy_names[0]) ==
+         NATIVE_REFERENCE_STRATEGY_COUNT);
+  if (strategy < 0 || strategy >= NATIVE_REFERENCE_STRATEGY_COUNT) {
+    return "unknown";
+  }
+  return native_reference_strategy_names[strategy];
+}
+
+
+static const char *input_method_names[] = {
+  "default",
+  "xtest",
+  "uinput",
+};
+
+
+const char *input_method_name(input_method method) {
+  assert(sizeof(input_method_names) / sizeof(input_method_names[0]) ==
+         INPUT_METHOD_COUNT);
+  if (method < 0 || method >= INPUT_METHOD_COUNT) {
+    return "unknown";
+  }
+  return input_method_names[method];
+}
+
+
+bool parse_input_method(const char *name, input_method *out_method) {
+  for (int i = 0; i < INPUT_METHOD_COUNT; i++) {
+    if (strcmp(name, input_method_names[i]) == 0) {
+      *out_method = (input_method)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool parse_native_reference_strategy(const char *name,
+                                     native_reference_strategy *out_strategy) {
+  for (int i = 0; i < NATIVE_REFERENCE_STRATEGY_COUNT; i++) {
+    if (strcmp(name, native_reference_strategy_names[i]) == 0) {
+      *out_strategy = (native_reference_strategy)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+
 // Parses the magic pattern from a hexadecimal encoded string and fills
 // parsed_pattern with the result. parsed_pattern must be a buffer at least
 // pattern_magic_bytes long.
@@ -128,24 +277,109 @@ void hex_encode_magic_pattern(const uint8_t magic_pattern[],
 }
 
 
-// This function works something like memmem, except that it expects needle to
-// be 4-byte aligned in haystack (since each pixel is 4 bytes) and it ignores
-// every fourth byte (starting with haystack[3]) because those bytes represent
-// alpha.
-static const uint8_t *find_BGRA_pixels_ignoring_alpha(const uint8_t *haystack,
-  size_t haystack_length, const uint8_t *needle, size_t needle_length) {
-  const uint8_t *haystack_end = haystack + haystack_length;
-  for(const uint8_t *i = haystack; i < haystack_end - needle_length; i += 4) {
-    for(size_t j = 0; j < needle_length; j++) {
-      if (j % 4 == 3 /* alpha byte */ ||
-          i[j] == needle[j] /* non-alpha byte */) {
-        if (j == needle_length - 1) return i;
-      } else {
-        break;
+// Full-screen screenshots are split into bands of rows which are searched in
+// parallel by a small pool of worker threads. Workers take bands in raster
+// order from a shared counter, and stop once a match has been found in an
+// earlier band, so the first match in raster order wins just like in a serial
+// search.
+#define MAX_SEARCH_THREADS 8
+static const int search_bands_per_thread = 4;
+// Smaller screenshots, like the ones taken in the test loop, aren't worth the
+// overhead of starting threads.
+static const size_t parallel_search_min_bytes = 1024 * 1024;
+
+typedef struct {
+  const uint8_t *magic_pattern;
+  const uint8_t *pixels;
+  size_t length;      // The number of bytes in the screenshot.
+  size_t band_bytes;  // The number of bytes in each band, a whole number of rows.
+  long band_count;
+  volatile long next_band;
+  // The lowest band index with a match, or band_count if none has been found.
+  volatile long first_match_band;
+  const uint8_t **band_matches;
+} pattern_search;
+
+
+static void pattern_search_worker(void *argument) {
+  pattern_search *search = (pattern_search *)argument;
+  while (true) {
+    long band = __sync_fetch_and_add(&search->next_band, 1);
+    // Bands are handed out in order, so once a match has been found every
+    // band after this one would be a later match.
+    if (band >= search->band_count || band > search->first_match_band) {
+      return;
+    }
+    size_t start = band * search->band_bytes;
+    // Search every position that starts inside the band. A match starting near
+    // the end of the band extends into the next one, so the haystack includes
+    // the length of the pattern past the end of the band.
+    size_t length = search->band_bytes + pattern_magic_bytes;
+    if (length > search->length - start) {
+      length = search->length - start;
+    }
+    const uint8_t *found = find_BGRA_pixels_ignoring_alpha(
+        search->pixels + start, length, search->magic_pattern,
+        pattern_magic_bytes);
+    // Positions past the end of the band are searched by the next band.
+    if (found && (size_t)(found - search->pixels) >= start + search->band_bytes) {
+      found = NULL;
+    }
+    if (found) {
+      search->band_matches[band] = found;
+      long first = search->first_match_band;
+      while (band < first) {
+        long previous = __sync_val_compare_and_swap(&search->first_match_band,
+            first, band);
+        if (previous == first) {
+          break;
+        }
+        first = previous;
       }
     }
   }
-  return NULL;
+}
+
+
+// Searches the whole screenshot using all available processors. Returns the
+// first match in raster order, or NULL.
+static const uint8_t *find_pattern_in_parallel(const uint8_t magic_pattern[],
+    const screenshot *screenshot) {
+  int threads = get_processor_count();
+  if (threads > MAX_SEARCH_THREADS) {
+    threads = MAX_SEARCH_THREADS;
+  }
+  pattern_search search;
+  memset(&search, 0, sizeof(pattern_search));
+  search.magic_pattern = magic_pattern;
+  search.pixels = screenshot->pixels;
+  search.length = screenshot->stride * screenshot->height;
+  uint32_t band_rows = screenshot->height / (threads * search_bands_per_thread);
+  if (band_rows == 0) {
+    band_rows = 1;
+  }
+  search.band_bytes = band_rows * screenshot->stride;
+  search.band_count = (long)((screenshot->height + band_rows - 1) / band_rows);
+  search.first_match_band = search.band_count;
+  search.band_matches =
+      (const uint8_t **)calloc(search.band_count, sizeof(uint8_t *));
+  // The calling thread searches too.
+  void *workers[MAX_SEARCH_THREADS];
+  for (int i = 0; i < threads - 1; i++) {
+    workers[i] = start_thread(pattern_search_worker, &search);
+  }
+  pattern_search_worker(&search);
+  for (int i = 0; i < threads - 1; i++) {
+    if (workers[i]) {
+      join_thread(workers[i]);
+    }
+  }
+  const uint8_t *found = NULL;
+  if (search.first_match_band < search.band_count) {
+    found = search.band_matches[search.first_match_band];
+  }
+  free(search.band_matches);
+  return found;
 }
 
 
@@ -153,9 +387,14 @@ static const uint8_t *find_BGRA_pixels_ignoring_alpha(const uint8_t *haystack,
 static bool find_pattern(const uint8_t magic_pattern[], screenshot *screenshot,
     size_t *out_x, size_t *out_y) {
   assert(out_x && out_y && screenshot->width && screenshot->height);
-  const uint8_t *found = find_BGRA_pixels_ignoring_alpha(screenshot->pixels,
-      screenshot->stride * screenshot->height, magic_pattern,
-      pattern_magic_bytes);
+  const uint8_t *found;
+  size_t length = screenshot->stride * screenshot->height;
+  if (length >= parallel_search_min_bytes) {
+    found = find_pattern_in_parallel(magic_pattern, screenshot);
+  } else {
+    found = find_BGRA_pixels_ignoring_alpha(screenshot->pixels, length,
+        magic_pattern, pattern_magic_bytes);
+  }
   if (found) {
     size_t offset = (size_t)(found - screenshot->pixels);
     *out_x = (offset % screenshot->stride) / 4;
@@ -169,17 +408,34 @@ static bool find_pattern(const uint8_t magic_pattern[], screenshot *screenshot,
 // the test pattern.
 typedef struct {
   int64_t screenshot_time;
-  uint8_t javascript_frames;
-  uint8_t key_down_events;
+  // The last vblank before the screenshot and its frame counter, or 0 if the
+  // platform doesn't report them.
+  int64_t vblank_time;
+  int64_t frame_counter;
+  // When waiting for change notifications, the time the notification that
+  // triggered this sample arrived, or 0 for samples taken on a timeout.
+  int64_t change_notification_time;
+  uint16_t javascript_frames;
+  uint16_t key_down_events;
+  uint8_t last_key_id;
   uint8_t css_frames;
   uint8_t scroll_position;
   test_mode_t test_mode;
+  uint8_t sequence;
+  // False if the screenshot failed or the magic pattern wasn't found. True if
+  // the pattern was found but its data was misread.
+  bool pattern_found;
+  // If the pattern was lost and the capture thread had to find it again before
+  // taking this sample, the time it was lost. Changes between the previous
+  // sample and this one can't be timed, so they aren't measured. Otherwise 0.
+  int64_t relock_start_time;
 } measurement_t;
 
 // This function takes a small screenshot at the specified position, checks for
 // the magic pattern, and then fills in the measurement struct with data
 // decoded from the pixels of the pattern. Returns true if successful, false
-// if the screenshot failed or the magic pattern was not present.
+// if the screenshot failed, the magic pattern was not present, or the data
+// failed its checks.
 static bool read_data_from_screen(uint32_t x, uint32_t y,
   const uint8_t magic_pattern[], measurement_t *out) {
   assert(out);
@@ -198,12 +454,23 @@ static bool read_data_from_screen(uint32_t x, uint32_t y,
     free_screenshot(screenshot);
     return false;
   }
-  out->javascript_frames = screenshot->pixels[pattern_magic_pixels * 4 + 0];
-  out->key_down_events = screenshot->pixels[pattern_magic_pixels * 4 + 1];
-  out->test_mode = (test_mode_t) screenshot->pixels[pattern_magic_pixels * 4 + 2];
-  out->scroll_position = screenshot->pixels[(pattern_magic_pixels + 1) * 4];
-  out->css_frames = screenshot->pixels[(pattern_magic_pixels + 2) * 4];
+  out->pattern_found = true;
+  pattern_data data;
+  if (!decode_pattern_data(screenshot->pixels, &data)) {
+    debug_log("Rejected a misread or partly drawn pattern.");
+    free_screenshot(screenshot);
+    return false;
+  }
+  out->javascript_frames = data.javascript_frames;
+  out->key_down_events = data.key_down_events;
+  out->last_key_id = data.last_key_id;
+  out->test_mode = data.test_mode;
+  out->scroll_position = data.scroll_position;
+  out->css_frames = data.css_frames;
+  out->sequence = data.sequence;
   out->screenshot_time = screenshot->time_nanoseconds;
+  out->vblank_time = screenshot->vblank_time_nanoseconds;
+  out->frame_counter = screenshot->frame_counter;
   free_screenshot(screenshot);
   debug_log("javascript frames: %d, javascript events: %d, scroll position: %d"
       ", css frames: %d, test mode: %d", out->javascript_frames,
@@ -212,6 +479,88 @@ static bool read_data_from_screen(uint32_t x, uint32_t y,
   return true;
 }
 
+// Each monitor is captured and searched for the pattern on its own thread.
+typedef struct {
+  const uint8_t *magic_pattern;
+  screen_output output;
+  bool screenshot_failed;
+  bool found;
+  size_t x, y;  // The location of the pattern on the screen, if found.
+} output_search;
+
+
+static void search_output(void *argument) {
+  output_search *search = (output_search *)argument;
+  screenshot *screenshot = take_screenshot(search->output.x, search->output.y,
+      search->output.width, search->output.height);
+  if (!screenshot) {
+    search->screenshot_failed = true;
+    return;
+  }
+  assert(screenshot->width > 0 && screenshot->height > 0);
+  size_t x, y;
+  search->found = find_pattern(search->magic_pattern, screenshot, &x, &y);
+  search->x = search->output.x + x;
+  search->y = search->output.y + y;
+  free_screenshot(screenshot);
+}
+
+
+// Finds the pattern on any of the monitors. On success, fills in the monitor
+// it was found on, its index (-1 if the platform can't list monitors) and the
+// location of the pattern. Returns false and sets error on failure.
+static bool locate_pattern(const uint8_t magic_pattern[],
+    screen_output *out_output, int *out_output_index, size_t *out_x,
+    size_t *out_y, char **error) {
+  screen_output outputs[MAX_SCREEN_OUTPUTS];
+  int output_count = get_screen_outputs(outputs, MAX_SCREEN_OUTPUTS);
+  bool whole_screen = output_count == 0;
+  if (whole_screen) {
+    outputs[0].x = outputs[0].y = 0;
+    outputs[0].width = outputs[0].height = UINT32_MAX;
+    outputs[0].refresh_rate_hz = 0;
+    output_count = 1;
+  }
+  output_search searches[MAX_SCREEN_OUTPUTS];
+  void *threads[MAX_SCREEN_OUTPUTS];
+  memset(searches, 0, sizeof(searches));
+  for (int i = 0; i < output_count; i++) {
+    searches[i].magic_pattern = magic_pattern;
+    searches[i].output = outputs[i];
+    // The calling thread searches the first monitor.
+    threads[i] = i > 0 ? start_thread(search_output, &searches[i]) : NULL;
+  }
+  search_output(&searches[0]);
+  for (int i = 1; i < output_count; i++) {
+    if (threads[i]) {
+      join_thread(threads[i]);
+    } else {
+      search_output(&searches[i]);
+    }
+  }
+  bool any_screenshot = false;
+  for (int i = 0; i < output_count; i++) {
+    any_screenshot |= !searches[i].screenshot_failed;
+    if (searches[i].found) {
+      *out_output = searches[i].output;
+      *out_x = searches[i].x;
+      *out_y = searches[i].y;
+      debug_log("Found the pattern on monitor %d at %d, %d (%.2f Hz)", i,
+                (int)*out_x, (int)*out_y, out_output->refresh_rate_hz);
+      *out_output_index = whole_screen ? -1 : i;
+      return true;
+    }
+  }
+  if (!any_screenshot) {
+    *error = "Failed to take screenshot.";
+  } else if (whole_screen) {
+    *error = "Failed to find test pattern on screen. Ensure that your browser's zoom level is set to \"100%\", and the top-left corner of the window is visible. If you have multiple displays, try moving the browser window to the main display.";
+  } else {
+    *error = "Failed to find test pattern on screen. Ensure that your browser's zoom level is set to \"100%\", and the top-left corner of the window is visible.";
+  }
+  return false;
+}
+
 // Each value reported in the measurement struct is tracked by a statistic
 // struct that records the length of time between changes.
 typedef struct {
@@ -232,30 +581,40 @@ typedef struct {
   // the number of measurements to get the average time.
   int64_t lower_bound_time;
   int64_t upper_bound_time;
+  // The running mean and sum of squared deviations (Welford's method) of the
+  // midpoint of each measurement's bounds, used for confidence intervals.
+  double latency_mean;
+  double latency_m2;
   // This records the longest length of time during which the value did not
   // change.
   int64_t max_lower_bound;
+  // The distributions of the individual lower and upper bounds, and of the
+  // midpoint of each measurement's bounds.
+  histogram lower_bounds;
+  histogram upper_bounds;
+  histogram latencies;
+  // If the value should change once per refresh, the refresh period, and the
+  // pacing of its changes. Otherwise 0.
+  int64_t refresh_period;
+  frame_pacing pacing;
+  // The middle of the bounds on the last change, or 0 if there hasn't been one
+  // since pacing started.
+  int64_t previous_frame_time;
   char *name;
+  trace_track track;  // Where changes in the value are drawn in traces.
+  int modulus;        // The value wraps around to 0 when it reaches this.
 } statistic;
 
 
-// Updates a statistic struct with a new value from a recent measurement.
-static bool update_statistic(statistic *stat, int value, int64_t screenshot_time,
-    int64_t previous_screenshot_time) {
-  assert(value >= 0 && stat->value >= 0);
-  int change = value - stat->value;
-  if (change < 0) {
-    // Handle values that wrap at 255.
-    assert(stat->value < 256 && value < 256);
-    change += 256;
-    assert(change > 0);
-  }
-  assert(change >= 0);
-  if (change == 0) {
-    return false;
-  }
-  int64_t lower_bound_time = previous_screenshot_time - stat->previous_change_time;
+// Records the time from start_time to a change first seen in the screenshot at
+// screenshot_time, which happened after the screenshot at
+// previous_screenshot_time. Returns false if the bounds are unusable.
+static bool measure_change(statistic *stat, int64_t start_time, int value,
+    int64_t screenshot_time, int64_t previous_screenshot_time) {
+  int64_t lower_bound_time = previous_screenshot_time - start_time;
+  int64_t upper_bound_time = screenshot_time - start_time;
   int64_t screenshot_duration = screenshot_time - previous_screenshot_time;
+  bool measured = false;
   if (lower_bound_time <= 0) {
     debug_log("%s: Didn't get a screenshot before response.", stat->name);
   } else if (screenshot_duration > 20 * nanoseconds_per_millisecond &&
@@ -263,21 +622,138 @@ static bool update_statistic(statistic *stat, int value, int64_t screenshot_time
     debug_log("%s: Ignoring measurement due to slow screenshot.", stat->name);
   } else {
     // Record the measurement.
+    measured = true;
     stat->measurements++;
-    stat->upper_bound_time += screenshot_time - stat->previous_change_time;
+    stat->upper_bound_time += upper_bound_time;
     stat->lower_bound_time += lower_bound_time;
+    histogram_record(&stat->lower_bounds, lower_bound_time);
+    histogram_record(&stat->upper_bounds, upper_bound_time);
+    double latency = (lower_bound_time + upper_bound_time) / 2.0;
+    histogram_record(&stat->latencies, (int64_t)latency);
+    double delta = latency - stat->latency_mean;
+    stat->latency_mean += delta / stat->measurements;
+    stat->latency_m2 += delta * (latency - stat->latency_mean);
     if (lower_bound_time > stat->max_lower_bound) {
       debug_log("%s: updated max_lower_bound to %f", stat->name,
           lower_bound_time / (double)nanoseconds_per_millisecond);
       stat->max_lower_bound = lower_bound_time;
     }
   }
+  if (tracing_enabled()) {
+    // The span covers the time from the previous change (or the input event)
+    // to the screenshot that showed this change.
+    trace_arg args[] = {
+      { "value", (double)value },
+      { "lower_bound_ms",
+        lower_bound_time / (double)nanoseconds_per_millisecond },
+      { "upper_bound_ms",
+        upper_bound_time / (double)nanoseconds_per_millisecond },
+      { "measured", measured ? 1.0 : 0.0 },
+    };
+    trace_span(stat->track, "change", start_time, screenshot_time,
+        (int)(sizeof(args) / sizeof(args[0])), args);
+    trace_counter(stat->name, screenshot_time, value);
+  }
+  return measured;
+}
+
+
+// Records the pacing of a change of the given number of frames, which happened
+// between the given times, in a statistic that should change every refresh.
+static void record_frames(statistic *stat, int frames,
+    int64_t earliest_change_time, int64_t latest_change_time) {
+  int64_t frame_time = earliest_change_time +
+      (latest_change_time - earliest_change_time) / 2;
+  int64_t previous_frame_time = stat->previous_frame_time;
+  stat->previous_frame_time = frame_time;
+  if (!previous_frame_time) {
+    return;
+  }
+  // If several frames were drawn between screenshots, they share the time.
+  frame_pacing *pacing = &stat->pacing;
+  if (!pacing->first_frame_time) {
+    pacing->first_frame_time = previous_frame_time;
+  }
+  pacing->last_frame_time = frame_time;
+  int64_t interval = frame_time - previous_frame_time;
+  for (int i = 0; i < frames; i++) {
+    histogram_record(&pacing->frame_times, interval / frames);
+  }
+  pacing->frames += frames;
+  int refreshes = (int)((interval + stat->refresh_period / 2) /
+      stat->refresh_period);
+  int dropped = refreshes - frames;
+  if (dropped > 0) {
+    debug_log("%s: dropped %d frames", stat->name, dropped);
+    pacing->dropped_frames += dropped;
+    if (dropped > pacing->longest_dropped_run) {
+      pacing->longest_dropped_run = dropped;
+    }
+  }
+}
+
+
+// Fills in the pacing recorded by a statistic.
+static void frame_pacing_results(const statistic *stat, frame_pacing *out) {
+  *out = stat->pacing;
+  int refreshes = out->frames + out->dropped_frames;
+  out->jank_percent = refreshes ?
+      out->dropped_frames * 100.0 / refreshes : 0;
+}
+
+
+// Returns how much a statistic's value has advanced to reach the given value.
+static int statistic_change(const statistic *stat, int value) {
+  assert(value >= 0 && stat->value >= 0);
+  int change = value - stat->value;
+  if (change < 0) {
+    // Handle values that wrap around.
+    assert(stat->value < stat->modulus && value < stat->modulus);
+    change += stat->modulus;
+    assert(change > 0);
+  }
+  return change;
+}
+
+
+// Updates a statistic struct with a new value from a recent measurement.
+static bool update_statistic(statistic *stat, int value, int64_t screenshot_time,
+    int64_t previous_screenshot_time) {
+  int change = statistic_change(stat, value);
+  if (change == 0) {
+    return false;
+  }
+  measure_change(stat, stat->previous_change_time, value, screenshot_time,
+      previous_screenshot_time);
+  if (stat->refresh_period) {
+    record_frames(stat, change, previous_screenshot_time, screenshot_time);
+  }
   stat->previous_change_time = screenshot_time;
   stat->value = value;
   stat->value_delta += change;
   return true;
 }
 
+
+// Updates a statistic struct with a value that changed while the pattern was
+// lost, without measuring the change, since the time it happened isn't known.
+// The next interval starts at the given screenshot time if the value changed,
+// or always if restart is set, for statistics that measure the time between
+// changes rather than the time since an input event. Returns true if the value
+// changed.
+static bool skip_statistic(statistic *stat, int value, int64_t screenshot_time,
+    bool restart) {
+  int change = statistic_change(stat, value);
+  if (change > 0 || restart) {
+    stat->previous_change_time = screenshot_time;
+  }
+  // The frames drawn while the pattern was lost can't be told apart.
+  stat->previous_frame_time = 0;
+  stat->value = value;
+  stat->value_delta += change;
+  return change > 0;
+}
+
 // Returns the average upper bound time for a statistic, in milliseconds.
 static double upper_bound_ms(statistic *stat) {
   double bound = stat->upper_bound_time / (double) stat->measurements /
@@ -298,155 +774,944 @@ static double lower_bound_ms(statistic *stat) {
   return bound;
 }
 
+// Returns a percentile of the latency of individual events for a statistic, in
+// milliseconds. Like the average, each event's latency is the midpoint of its
+// own lower and upper bounds.
+static double latency_percentile_ms(statistic *stat, double percentile) {
+  return histogram_value_at_percentile(&stat->latencies, percentile) /
+      (double)nanoseconds_per_millisecond;
+}
+
+
+static void latency_percentiles(statistic *stat, percentiles *out) {
+  out->p50_ms = latency_percentile_ms(stat, 50);
+  out->p90_ms = latency_percentile_ms(stat, 90);
+  out->p99_ms = latency_percentile_ms(stat, 99);
+  out->p99_9_ms = latency_percentile_ms(stat, 99.9);
+}
+
+
+// The normal quantile for a two-sided 95% confidence interval.
+static const double confidence_z = 1.96;
+
+// Computes the 95% confidence interval on the mean latency of a statistic, or
+// on the given percentile if it's positive. Percentile intervals use the ranks
+// of the order statistics that bracket the percentile, so they don't assume
+// anything about the shape of the distribution.
+static void latency_confidence_interval(statistic *stat, double percentile,
+    double target_ms, confidence_interval *out) {
+  memset(out, 0, sizeof(confidence_interval));
+  int n = stat->measurements;
+  out->measurements = n;
+  if (n < 2) {
+    return;
+  }
+  double center_ms, low_ms, high_ms;
+  if (percentile <= 0) {
+    center_ms = stat->latency_mean / nanoseconds_per_millisecond;
+    double standard_error = sqrt(stat->latency_m2 / (n - 1) / n);
+    double half_width_ms =
+        confidence_z * standard_error / nanoseconds_per_millisecond;
+    low_ms = center_ms - half_width_ms;
+    high_ms = center_ms + half_width_ms;
+  } else {
+    double p = percentile / 100;
+    double spread = confidence_z * sqrt(n * p * (1 - p));
+    int64_t low_rank = (int64_t)floor(n * p - spread);
+    int64_t high_rank = (int64_t)ceil(n * p + spread);
+    low_ms = histogram_value_at_rank(&stat->latencies, low_rank) /
+        (double)nanoseconds_per_millisecond;
+    high_ms = histogram_value_at_rank(&stat->latencies, high_rank) /
+        (double)nanoseconds_per_millisecond;
+  }
+  out->low_ms = low_ms;
+  out->high_ms = high_ms;
+  out->half_width_ms = (high_ms - low_ms) / 2;
+  out->target_met = target_ms > 0 && out->half_width_ms <= target_ms;
+}
+
+
 // Initializes a statistic struct.
-static void init_statistic(char *name, statistic *stat, int value,
-    int64_t start_time) {
+static void init_statistic(char *name, trace_track track, int modulus,
+    statistic *stat, int value, int64_t start_time) {
   memset(stat, 0, sizeof(statistic));
+  histogram_init(&stat->lower_bounds);
+  histogram_init(&stat->upper_bounds);
+  histogram_init(&stat->latencies);
+  histogram_init(&stat->pacing.frame_times);
   stat->value = value;
   stat->previous_change_time = start_time;
   stat->name = name;
+  stat->track = track;
+  stat->modulus = modulus;
 }
 
 
-static const int64_t test_timeout_ms = 80000;
-static const int64_t event_response_timeout_ms = 4000;
-static const int latency_measurements_to_take = 50;
+// Screenshots are taken continuously on a dedicated capture thread, so the
+// screen is still observed while the test loop waits to send the next input
+// event. Decoded samples are passed to the test loop through a lock-free
+// single-producer, single-consumer ring buffer.
+#define SAMPLE_RING_SIZE 1024  // Must be a power of two.
+typedef struct {
+  measurement_t samples[SAMPLE_RING_SIZE];
+  volatile uint32_t write_index;  // Only modified by the capture thread.
+  volatile uint32_t read_index;   // Only modified by the test loop.
+} sample_ring;
 
-// Main test function. Locates the given magic pixel pattern on the screen, then
-// runs one full latency test, sending input events and recording responses. On
-// success, the results of the test are reported in the output parameters, and
-// true is returned. If the test fails, the error parameter is filled in with
-// an error message and false is returned.
-bool measure_latency(
-    const uint8_t magic_pattern[],
-    double *out_key_down_latency_ms,
-    double *out_scroll_latency_ms,
-    double *out_max_js_pause_time_ms,
-    double *out_max_css_pause_time_ms,
-    double *out_max_scroll_pause_time_ms,
-    char **error) {
-  screenshot *screenshot = take_screenshot(0, 0, UINT32_MAX, UINT32_MAX);
-  if (!screenshot) {
-    *error = "Failed to take screenshot.";
+
+// Adds a sample to the ring. Returns false if the ring is full.
+static bool sample_ring_push(sample_ring *ring, const measurement_t *sample) {
+  uint32_t write_index = ring->write_index;
+  if (write_index - ring->read_index == SAMPLE_RING_SIZE) {
     return false;
   }
-  assert(screenshot->width > 0 && screenshot->height > 0);
+  ring->samples[write_index % SAMPLE_RING_SIZE] = *sample;
+  // The sample must be visible to the test loop before the new index is.
+  __sync_synchronize();
+  ring->write_index = write_index + 1;
+  return true;
+}
 
-  size_t x, y;
-  bool found_pattern = find_pattern(magic_pattern, screenshot, &x, &y);
-  free_screenshot(screenshot);
-  if (!found_pattern) {
-    *error = "Failed to find test pattern on screen. Ensure that your browser's zoom level is set to \"100%\", and the top-left corner of the window is visible. If you have multiple displays, try moving the browser window to the main display.";
+
+// Removes the oldest sample from the ring. Returns false if the ring is empty.
+static bool sample_ring_pop(sample_ring *ring, measurement_t *out_sample) {
+  uint32_t read_index = ring->read_index;
+  if (read_index == ring->write_index) {
     return false;
   }
-  uint8_t full_pattern[pattern_bytes];
-  for (int i = 0; i < pattern_magic_bytes; i++) {
-    full_pattern[i] = magic_pattern[i];
+  __sync_synchronize();
+  *out_sample = ring->samples[read_index % SAMPLE_RING_SIZE];
+  // Finish reading the sample before the capture thread can overwrite it.
+  __sync_synchronize();
+  ring->read_index = read_index + 1;
+  return true;
+}
+
+
+typedef struct {
+  uint32_t x, y;  // The location of the pattern on the screen.
+  const uint8_t *magic_pattern;
+  // If true, the capture thread sleeps until the platform reports a change to
+  // the pattern instead of polling. Cleared if the platform can't do that.
+  bool wait_for_changes;
+  sample_ring ring;
+  volatile bool stop;
+  // The number of samples taken, and the times of the first and last, for
+  // reporting the sampling rate. Only read once the capture thread has exited.
+  int64_t samples;
+  int64_t first_sample_time;
+  int64_t last_sample_time;
+  // The number of samples dropped because the pattern's data was misread.
+  int rejected_samples;
+  // Set before the failed sample is pushed if the pattern was found but its
+  // data couldn't be read for relock_timeout_ms.
+  bool data_unreadable;
+} capture_context;
+
+// How long the capture thread keeps looking for the pattern after losing it,
+// e.g. because the window was moved or a notification popup covered it, before
+// the test fails.
+static const int64_t relock_timeout_ms = 5000;
+// When the pattern is lost, the area around its last location is searched
+// first, growing to each of these distances from it in turn, before every
+// monitor is searched.
+static const uint32_t relock_search_radii[] = { 32, 128, 512 };
+static const int relock_search_radius_count = 3;
+
+
+// Searches the area within radius pixels of the given location for the
+// pattern. Returns true and fills in the location if it's found.
+static bool search_near(const uint8_t magic_pattern[], uint32_t x, uint32_t y,
+    uint32_t radius, uint32_t *out_x, uint32_t *out_y) {
+  uint32_t left = x > radius ? x - radius : 0;
+  uint32_t top = y > radius ? y - radius : 0;
+  screenshot *screenshot = take_screenshot(left, top,
+      x - left + radius + pattern_pixels, y - top + radius + 1);
+  if (!screenshot) {
+    return false;
   }
-  measurement_t measurement;
-  measurement_t previous_measurement;
-  memset(&measurement, 0, sizeof(measurement_t));
-  memset(&previous_measurement, 0, sizeof(measurement_t));
-  int screenshots = 0;
-  bool first_screenshot_successful = read_data_from_screen((uint32_t)x,
-      (uint32_t) y, magic_pattern, &measurement);
-  if (!first_screenshot_successful) {
-    *error = "Failed to read data from test pattern.";
+  size_t found_x, found_y;
+  bool found = find_pattern(magic_pattern, screenshot, &found_x, &found_y);
+  free_screenshot(screenshot);
+  if (found) {
+    *out_x = left + (uint32_t)found_x;
+    *out_y = top + (uint32_t)found_y;
+  }
+  return found;
+}
+
+
+// Finds the pattern again after it has been lost, searching outward from
+// where it was last seen and then every monitor, until it turns up or
+// relock_timeout_ms passes. On success, moves the capture to the pattern's new
+// location and returns true.
+static bool relock_pattern(capture_context *capture) {
+  int64_t deadline = get_nanoseconds() +
+      relock_timeout_ms * nanoseconds_per_millisecond;
+  while (!capture->stop && get_nanoseconds() < deadline) {
+    uint32_t x, y;
+    bool found = false;
+    for (int i = 0; i < relock_search_radius_count && !found; i++) {
+      found = search_near(capture->magic_pattern, capture->x, capture->y,
+          relock_search_radii[i], &x, &y);
+    }
+    if (!found) {
+      screen_output output;
+      int output_index;
+      size_t found_x, found_y;
+      char *error;
+      found = locate_pattern(capture->magic_pattern, &output, &output_index,
+          &found_x, &found_y, &error);
+      x = (uint32_t)found_x;
+      y = (uint32_t)found_y;
+      if (found && output_index >= 0) {
+        select_screen_output(&output);
+      }
+    }
+    if (found) {
+      debug_log("Pattern moved from %d, %d to %d, %d", (int)capture->x,
+          (int)capture->y, (int)x, (int)y);
+      capture->x = x;
+      capture->y = y;
+      return true;
+    }
+    // The pattern may be covered for a moment, e.g. by a popup.
+    usleep(50 * 1000);
+  }
+  return false;
+}
+
+// When waiting for change notifications, a sample is still taken this often so
+// that the test notices if the window moves or a notification is lost.
+static const int64_t capture_heartbeat_ms = 50;
+
+
+static void capture_loop(capture_context *capture, bool buffers_reserved) {
+#ifndef NDEBUG
+  int64_t allocations = -1;
+#endif
+  // The time the pattern was lost, until a sample is read after finding it.
+  int64_t lost_time = 0;
+  // The time of the first of the latest run of rejected samples.
+  int64_t first_rejected_time = 0;
+  while (!capture->stop) {
+    measurement_t sample;
+    memset(&sample, 0, sizeof(measurement_t));
+    if (capture->wait_for_changes) {
+      int64_t change_time;
+      screen_change_result result = wait_for_screen_change(capture->x,
+          capture->y, pattern_pixels, 1,
+          capture_heartbeat_ms * nanoseconds_per_millisecond, &change_time);
+      if (result == SCREEN_CHANGED) {
+        sample.change_notification_time = change_time;
+      } else if (result == SCREEN_CHANGE_UNSUPPORTED) {
+        debug_log("Screen change notifications unsupported; polling.");
+        capture->wait_for_changes = false;
+      }
+    }
+    bool read = read_data_from_screen(capture->x, capture->y,
+        capture->magic_pattern, &sample);
+    if (read) {
+      sample.relock_start_time = lost_time;
+      lost_time = 0;
+      first_rejected_time = 0;
+    } else if (sample.pattern_found) {
+      // The data was misread or torn. Drop the sample, so that the next one
+      // bounds any change instead.
+      capture->rejected_samples++;
+      int64_t now = get_nanoseconds();
+      if (!first_rejected_time) {
+        first_rejected_time = now;
+      }
+      if (now - first_rejected_time <
+          relock_timeout_ms * nanoseconds_per_millisecond) {
+        continue;
+      }
+      capture->data_unreadable = true;
+      sample.pattern_found = false;
+    } else if (!capture->stop) {
+      if (!lost_time) {
+        lost_time = get_nanoseconds();
+      }
+      debug_log("Lost the pattern; searching for it.");
+      if (relock_pattern(capture)) {
+#ifndef NDEBUG
+        // Searching takes screenshots of other sizes.
+        allocations = -1;
+#endif
+        continue;
+      }
+    }
+    capture->last_sample_time = get_nanoseconds();
+    if (capture->samples++ == 0) {
+      capture->first_sample_time = capture->last_sample_time;
+    }
+#ifndef NDEBUG
+    // Once the first screenshot has been taken, polling must not allocate.
+    int64_t allocation_count = get_screenshot_allocation_count();
+    assert(!buffers_reserved || allocations < 0 ||
+           allocation_count == allocations);
+    allocations = allocation_count;
+#endif
+    // Each sample's time is used as a bound on the time of the next change, so
+    // if the test loop falls behind we wait for it instead of dropping samples.
+    while (!sample_ring_push(&capture->ring, &sample)) {
+      if (capture->stop) {
+        return;
+      }
+      usleep(100);
+    }
+    if (!sample.pattern_found) {
+      // The test loop will report the error.
+      return;
+    }
+    if (!capture->wait_for_changes) {
+      usleep(0);
+    }
+  }
+}
+
+
+static void capture_thread_main(void *argument) {
+  capture_context *capture = (capture_context *)argument;
+  // Every sample is a screenshot of the same size, so keep a buffer for it.
+  bool buffers_reserved = reserve_screenshot_buffers(pattern_pixels, 1, 1);
+  capture_loop(capture, buffers_reserved);
+  if (buffers_reserved) {
+    release_screenshot_buffers(pattern_pixels, 1);
+  }
+}
+
+
+// Returns the rate at which the capture thread took samples.
+static double capture_rate(const capture_context *capture) {
+  int64_t duration = capture->last_sample_time - capture->first_sample_time;
+  if (capture->samples < 2 || duration <= 0) {
+    return 0;
+  }
+  return (capture->samples - 1) * (double)nanoseconds_per_second / duration;
+}
+
+
+// Blocks until the capture thread produces the next sample.
+static void wait_for_sample(capture_context *capture, measurement_t *out) {
+  while (!sample_ring_pop(&capture->ring, out)) {
+    usleep(0);
+  }
+}
+
+
+// Input events are sent from a dedicated injector thread so that the random
+// delay before each event doesn't stall the test loop. The test loop queues
+// requests, up to MAX_INJECTIONS_IN_FLIGHT at a time, and is notified as each
+// has been sent. Requests can also be scheduled for a given time, so that
+// keystrokes can be sent at a fixed rate.
+typedef enum {
+  INJECT_KEYSTROKE,
+  INJECT_SCROLL,
+} injection_t;
+
+typedef struct {
+  // These fields describe the request, and are written by the test loop.
+  injection_t type;
+  unsigned int delay_microseconds;
+  // If nonzero, the event is sent at this time instead of after the delay.
+  int64_t send_at;
+  int key_id;  // For keystrokes, which key to send.
+  // These fields are written by the injector thread when the request has been
+  // sent, before it increments completed.
+  int64_t sent_time;
+  bool failed;
+} injection;
+
+#define MAX_INJECTIONS_IN_FLIGHT 16
+
+typedef struct {
+  // Request n is in slot n % MAX_INJECTIONS_IN_FLIGHT. The test loop only
+  // reuses a slot once it has handled the completion of the request before.
+  injection queue[MAX_INJECTIONS_IN_FLIGHT];
+  // Only written by the test loop while no request is in flight.
+  int scroll_x, scroll_y;
+  // The number of keystrokes requested, for cycling through the keys.
+  int keystrokes;
+  volatile int requested;
+  volatile int completed;
+  volatile bool stop;
+} injector_context;
+
+
+// The functions that send each key, indexed by key ID - 1.
+static bool (*const send_keystroke_functions[KEY_ID_COUNT])() = {
+  send_keystroke_z,
+  send_keystroke_x,
+  send_keystroke_c,
+  send_keystroke_v,
+};
+
+
+static void injector_thread_main(void *argument) {
+  injector_context *injector = (injector_context *)argument;
+  while (!injector->stop) {
+    if (injector->requested == injector->completed) {
+      usleep(100);
+      continue;
+    }
+    __sync_synchronize();
+    injection *request =
+        &injector->queue[injector->completed % MAX_INJECTIONS_IN_FLIGHT];
+    if (request->send_at) {
+      int64_t wait = request->send_at - get_nanoseconds();
+      if (wait > 0) {
+        usleep((unsigned int)(wait / 1000));
+      }
+    } else {
+      usleep(request->delay_microseconds);
+    }
+    bool success;
+    if (request->type == INJECT_KEYSTROKE) {
+      success = send_keystroke_functions[request->key_id - 1]();
+    } else {
+      success = send_scroll_down(injector->scroll_x, injector->scroll_y);
+    }
+    request->sent_time = get_nanoseconds();
+    // The window system may know when it actually dispatched the event.
+    int64_t dispatch_time = get_last_input_dispatch_time();
+    if (dispatch_time) {
+      request->sent_time = dispatch_time;
+    }
+    request->failed = !success;
+    __sync_synchronize();
+    injector->completed++;
+  }
+}
+
+
+static bool injection_in_flight(injector_context *injector) {
+  return injector->requested != injector->completed;
+}
+
+
+static void queue_injection(injector_context *injector, injection_t type,
+    unsigned int delay_microseconds, int64_t send_at) {
+  injection *request =
+      &injector->queue[injector->requested % MAX_INJECTIONS_IN_FLIGHT];
+  request->type = type;
+  request->delay_microseconds = delay_microseconds;
+  request->send_at = send_at;
+  request->key_id = 0;
+  if (type == INJECT_KEYSTROKE) {
+    request->key_id = injector->keystrokes++ % KEY_ID_COUNT + 1;
+  }
+  __sync_synchronize();
+  injector->requested++;
+}
+
+
+// Asks the injector thread to send an event after the given delay, once the
+// events requested before it have been sent. The caller must have handled the
+// completion of all but the last MAX_INJECTIONS_IN_FLIGHT - 1 requests.
+static void request_injection(injector_context *injector, injection_t type,
+    unsigned int delay_microseconds) {
+  queue_injection(injector, type, delay_microseconds, 0);
+}
+
+
+// As request_injection, but the event is sent at the given time, or as soon as
+// the events before it have been sent if that has passed.
+static void request_injection_at(injector_context *injector, injection_t type,
+    int64_t send_at) {
+  queue_injection(injector, type, 0, send_at);
+}
+
+
+// The keystrokes sent by the key down latency test, by the number of
+// keystrokes sent before them, for matching responses to them. Only the last
+// KEYSTROKE_LOG_SIZE are kept, so no more keystrokes than that may be waiting
+// for a response at once.
+#define KEYSTROKE_LOG_SIZE 1024
+typedef struct {
+  int64_t sent_times[KEYSTROKE_LOG_SIZE];
+  int key_ids[KEYSTROKE_LOG_SIZE];
+  int sent;
+  int64_t first_sent_time;
+} keystroke_log;
+
+
+static void log_keystroke(keystroke_log *log, const injection *keystroke) {
+  if (log->sent == 0) {
+    log->first_sent_time = keystroke->sent_time;
+  }
+  log->sent_times[log->sent % KEYSTROKE_LOG_SIZE] = keystroke->sent_time;
+  log->key_ids[log->sent % KEYSTROKE_LOG_SIZE] = keystroke->key_id;
+  log->sent++;
+}
+
+
+// Updates the key down statistic, whose value counts the keystrokes the page
+// has handled. The page handles keystrokes in the order they were sent, so the
+// responses first seen in this screenshot are to the oldest keystrokes still
+// waiting, and each is timed from its own keystroke. The page also reports the
+// ID of the last key it handled, which must be the last of those keystrokes';
+// otherwise a keystroke was lost or a key was pressed by someone else, and the
+// responses aren't measured. Returns true if the value changed.
+static bool update_keystroke_statistic(statistic *stat,
+    const keystroke_log *log, int value, int last_key_id,
+    int64_t screenshot_time, int64_t previous_screenshot_time) {
+  int change = statistic_change(stat, value);
+  if (change == 0) {
     return false;
   }
-  if (measurement.test_mode == TEST_MODE_NATIVE_REFERENCE) {
-    uint8_t *test_pattern = (uint8_t *)malloc(pattern_bytes);
-    memset(test_pattern, 0, pattern_bytes);
-    for (int i = 0; i < pattern_magic_bytes; i++) {
-      test_pattern[i] = rand();
+  int first = stat->value_delta;
+  int last = first + change - 1;
+  if (last >= log->sent) {
+    // The test loop reports this as an error.
+    debug_log("%s: %d responses to %d keystrokes.", stat->name, last + 1,
+        log->sent);
+  } else if (last_key_id &&
+             last_key_id != log->key_ids[last % KEYSTROKE_LOG_SIZE]) {
+    debug_log("%s: Response to key %d, expected key %d. Not measuring.",
+        stat->name, last_key_id, log->key_ids[last % KEYSTROKE_LOG_SIZE]);
+  } else {
+    for (int i = first; i <= last; i++) {
+      measure_change(stat, log->sent_times[i % KEYSTROKE_LOG_SIZE],
+          value, screenshot_time, previous_screenshot_time);
     }
-    if (!open_native_reference_window(test_pattern)) {
-      *error = "Failed to open native reference window.";
-      return false;
+  }
+  stat->previous_change_time = screenshot_time;
+  stat->value = value;
+  stat->value_delta += change;
+  return true;
+}
+
+
+// The refresh period to assume if the monitor's refresh rate isn't known: 60 Hz.
+static const int64_t default_refresh_period = 16666667;
+
+// If the platform doesn't report the monitor's refresh rate, it is measured by
+// watching the pattern for this many frames, or for as long as that many
+// frames take at the lowest plausible rate. Rates outside the plausible range
+// are ignored, since the frame counter of a page or native window that draws
+// without vsync needn't follow the monitor.
+#define REFRESH_DETECTION_FRAMES 30
+static const double min_detected_refresh_rate_hz = 20;
+static const double max_detected_refresh_rate_hz = 360;
+
+// The intervals between changes of one of the page's frame counters, per
+// frame.
+typedef struct {
+  int64_t previous_frame_time;
+  int64_t intervals[REFRESH_DETECTION_FRAMES];
+  int count;
+} frame_cadence;
+
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t difference = *(const int64_t *)a - *(const int64_t *)b;
+  return difference < 0 ? -1 : difference > 0;
+}
+
+
+// Records that a frame counter advanced by the given number of frames between
+// two samples.
+static void record_cadence(frame_cadence *cadence, int frames,
+    const measurement_t *previous, const measurement_t *sample) {
+  if (!frames || cadence->count == REFRESH_DETECTION_FRAMES) {
+    return;
+  }
+  int64_t frame_time = previous->screenshot_time +
+      (sample->screenshot_time - previous->screenshot_time) / 2;
+  if (cadence->previous_frame_time) {
+    cadence->intervals[cadence->count++] =
+        (frame_time - cadence->previous_frame_time) / frames;
+  }
+  cadence->previous_frame_time = frame_time;
+}
+
+
+// Returns the refresh period a frame counter's cadence suggests, or 0 if it
+// didn't advance often enough to tell. Frames the page was too busy to draw
+// only make intervals longer, so the lower quartile ignores them unless most
+// frames were dropped.
+static int64_t cadence_period(frame_cadence *cadence) {
+  if (cadence->count < REFRESH_DETECTION_FRAMES / 2) {
+    return 0;
+  }
+  qsort(cadence->intervals, cadence->count, sizeof(int64_t), compare_int64);
+  return cadence->intervals[cadence->count / 4];
+}
+
+
+// Measures the refresh period of the monitor showing the pattern, starting
+// from the given sample. Uses the vblanks the platform reports if it can, or
+// else the cadence of the page's frame counters, which advance once per
+// refresh. The CSS animation keeps its cadence even while the page's
+// JavaScript is too busy to draw every frame, so the faster of the two is
+// used. The sample is updated to the last one read. Returns
+// REFRESH_RATE_UNKNOWN if neither works.
+static refresh_rate_source detect_refresh_period(uint32_t x, uint32_t y,
+    const uint8_t magic_pattern[], measurement_t *measurement,
+    int64_t *out_period) {
+  measurement_t first = *measurement;
+  measurement_t previous = *measurement;
+  frame_cadence javascript_cadence;
+  frame_cadence css_cadence;
+  memset(&javascript_cadence, 0, sizeof(frame_cadence));
+  memset(&css_cadence, 0, sizeof(frame_cadence));
+  int64_t period = 0;
+  refresh_rate_source source = REFRESH_RATE_UNKNOWN;
+  // Allow for the frames before the first change of each counter.
+  int64_t deadline = get_nanoseconds() + (int64_t)(
+      (REFRESH_DETECTION_FRAMES + 2) * nanoseconds_per_second /
+      min_detected_refresh_rate_hz);
+  while (javascript_cadence.count < REFRESH_DETECTION_FRAMES &&
+         css_cadence.count < REFRESH_DETECTION_FRAMES &&
+         get_nanoseconds() < deadline) {
+    measurement_t sample;
+    memset(&sample, 0, sizeof(measurement_t));
+    if (!read_data_from_screen(x, y, magic_pattern, &sample)) {
+      continue;
     }
-    bool return_value = measure_latency(test_pattern, out_key_down_latency_ms, out_scroll_latency_ms, out_max_js_pause_time_ms, out_max_css_pause_time_ms, out_max_scroll_pause_time_ms, error);
-    if (!close_native_reference_window()) {
-      debug_log("Failed to close native reference window.");
-    };
-    return return_value;
+    int64_t vblanks = sample.frame_counter - first.frame_counter;
+    if (first.frame_counter && vblanks >= REFRESH_DETECTION_FRAMES) {
+      period = (sample.vblank_time - first.vblank_time) / vblanks;
+      source = REFRESH_RATE_FROM_VBLANKS;
+      previous = sample;
+      break;
+    }
+    record_cadence(&javascript_cadence,
+        (uint16_t)(sample.javascript_frames - previous.javascript_frames),
+        &previous, &sample);
+    record_cadence(&css_cadence,
+        (uint8_t)(sample.css_frames - previous.css_frames), &previous,
+        &sample);
+    previous = sample;
+  }
+  *measurement = previous;
+  if (source == REFRESH_RATE_UNKNOWN) {
+    int64_t javascript_period = cadence_period(&javascript_cadence);
+    int64_t css_period = cadence_period(&css_cadence);
+    period = javascript_period;
+    if (css_period && (!period || css_period < period)) {
+      period = css_period;
+    }
+    if (period) {
+      source = REFRESH_RATE_FROM_FRAME_COUNTER;
+    }
+  }
+  // Allow for measurement error at the ends of the range.
+  double rate = period > 0 ? nanoseconds_per_second / (double)period : 0;
+  if (source == REFRESH_RATE_UNKNOWN ||
+      rate < min_detected_refresh_rate_hz * 0.95 ||
+      rate > max_detected_refresh_rate_hz * 1.05) {
+    debug_log("Couldn't detect the refresh rate; assuming 60 Hz.");
+    return REFRESH_RATE_UNKNOWN;
+  }
+  debug_log("Detected a refresh rate of %f Hz", rate);
+  *out_period = period;
+  return source;
+}
+
+
+// We want to avoid sending input events at a predictable time relative to
+// frames, so each event is sent after a random delay of up to 1 frame, in
+// whole milliseconds.
+static unsigned int random_injection_delay(int64_t refresh_period) {
+  int frame_ms = (int)(refresh_period / nanoseconds_per_millisecond);
+  return (rand() % (frame_ms + 1)) * 1000;
+}
+
+
+static const int64_t test_timeout_ms = 80000;
+static const int64_t event_response_timeout_ms = 4000;
+static const int latency_measurements_to_take = 50;
+
+
+// Returns true once a key down or scroll latency test has taken enough
+// measurements of the given statistic.
+static bool enough_measurements(statistic *stat,
+    const measurement_options *options, int64_t elapsed_time) {
+  if (options->target_confidence_interval_ms <= 0) {
+    return stat->measurements >= latency_measurements_to_take;
+  }
+  if (stat->measurements >= options->max_measurements) {
+    return true;
+  }
+  if (stat->measurements < options->min_measurements) {
+    return false;
   }
+  // Stop before a slow response could make the whole test time out, and report
+  // whatever interval has been reached.
+  if (elapsed_time > (test_timeout_ms - event_response_timeout_ms) *
+      nanoseconds_per_millisecond) {
+    debug_log("%s: stopping at %d measurements before timing out.",
+        stat->name, stat->measurements);
+    return true;
+  }
+  confidence_interval interval;
+  latency_confidence_interval(stat, options->confidence_percentile,
+      options->target_confidence_interval_ms, &interval);
+  return interval.target_met;
+}
+
+
+// Computes the interval during which a change first seen in the current sample
+// must have reached the screen. Normally this is the time between the two
+// screenshots. When the sample was triggered by a change notification, nothing
+// changed between the previous sample and the notification, which arrives just
+// after the change, so the notification time is used as the earliest time
+// instead. When snapping to vblanks, the screen only changes at a vblank,
+// so the change reached the screen at one of the vblanks after the previous
+// sample's vblank, up to and including the current sample's vblank. When the
+// two samples are one frame apart this pins the change to a single refresh.
+static void change_interval(const measurement_t *previous,
+    const measurement_t *current, const measurement_options *options,
+    int64_t *out_earliest, int64_t *out_latest) {
+  *out_earliest = previous->screenshot_time;
+  *out_latest = current->screenshot_time;
+  if (current->change_notification_time > previous->screenshot_time) {
+    *out_earliest = current->change_notification_time;
+  }
+  if (!options->snap_to_vblank || !previous->frame_counter ||
+      current->frame_counter <= previous->frame_counter) {
+    return;
+  }
+  int64_t frames = current->frame_counter - previous->frame_counter;
+  int64_t period = (current->vblank_time - previous->vblank_time) / frames;
+  *out_earliest = previous->vblank_time + period;
+  *out_latest = current->vblank_time;
+}
+
+
+// Records a sample taken by the capture thread in the trace, if tracing.
+static void trace_screenshot(const measurement_t *measurement,
+    int64_t previous_screenshot_time) {
+  if (!tracing_enabled()) {
+    return;
+  }
+  trace_arg args[] = {
+    { "interval_ms", (measurement->screenshot_time - previous_screenshot_time) /
+        (double)nanoseconds_per_millisecond },
+    { "javascript_frames", measurement->javascript_frames },
+    { "key_down_events", measurement->key_down_events },
+    { "scroll_position", measurement->scroll_position },
+    { "sequence", measurement->sequence },
+  };
+  trace_instant(TRACE_TRACK_SCREENSHOTS, "screenshot",
+      measurement->screenshot_time, (int)(sizeof(args) / sizeof(args[0])),
+      args);
+}
+
+
+// Runs the test loop, consuming samples from the capture thread and sending
+// input events through the injector thread until the test finishes. The first
+// sample must already have been read from the screen.
+static bool run_test_loop(
+    capture_context *capture,
+    injector_context *injector,
+    measurement_t measurement,
+    const measurement_options *options,
+    int64_t refresh_period,
+    latency_results *out_results,
+    char **error) {
+  int screenshots = 0;
   int64_t start_time = measurement.screenshot_time;
-  previous_measurement = measurement;
+  measurement_t previous_measurement = measurement;
   statistic javascript_frames;
   statistic css_frames;
   statistic key_down_events;
   statistic scroll_stats;
-  init_statistic("javascript_frames", &javascript_frames,
-      measurement.javascript_frames, start_time);
-  init_statistic("key_down_events", &key_down_events,
-      measurement.key_down_events, start_time);
-  init_statistic("css_frames", &css_frames, measurement.css_frames, start_time);
-  init_statistic("scroll", &scroll_stats, measurement.scroll_position,
-      start_time);
-  int sent_events = 0;
-  int scroll_x = x + 40;
-  int scroll_y = y + 40;
+  // The page's own counters are 16 bits, but the scroll position and the CSS
+  // animation are read from 8-bit gradients.
+  init_statistic("javascript_frames", TRACE_TRACK_JAVASCRIPT_FRAMES, 65536,
+      &javascript_frames, measurement.javascript_frames, start_time);
+  init_statistic("key_down_events", TRACE_TRACK_KEY_DOWN_EVENTS, 65536,
+      &key_down_events, measurement.key_down_events, start_time);
+  init_statistic("css_frames", TRACE_TRACK_CSS_FRAMES, 256, &css_frames,
+      measurement.css_frames, start_time);
+  init_statistic("scroll", TRACE_TRACK_SCROLL, 256, &scroll_stats,
+      measurement.scroll_position, start_time);
+  // The pause time test expects the page to animate and scroll every refresh.
+  if (measurement.test_mode == TEST_MODE_PAUSE_TIME) {
+    javascript_frames.refresh_period = refresh_period;
+    css_frames.refresh_period = refresh_period;
+    scroll_stats.refresh_period = refresh_period;
+  }
+  keystroke_log keystrokes;
+  memset(&keystrokes, 0, sizeof(keystroke_log));
+  int keystrokes_in_flight = options->keystrokes_in_flight;
+  if (keystrokes_in_flight < 1) {
+    keystrokes_in_flight = 1;
+  } else if (keystrokes_in_flight > KEY_ID_COUNT) {
+    keystrokes_in_flight = KEY_ID_COUNT;
+  }
+  // In the fixed-rate mode, the time the next keystroke is scheduled for.
+  int64_t keystroke_interval = 0;
+  int64_t next_keystroke_time = 0;
+  if (options->injection_rate_hz > 0) {
+    keystroke_interval =
+        (int64_t)(nanoseconds_per_second / options->injection_rate_hz);
+    next_keystroke_time = get_nanoseconds();
+  }
+  // The number of injector requests whose completion has been handled.
+  int handled_injections = 0;
   int64_t last_scroll_sent = start_time;
+  // The number of times the pattern was lost and found again, and the total
+  // time it was lost for, which is excluded from the measurements.
+  int relocks = 0;
+  int64_t excluded_time = 0;
   if (measurement.test_mode == TEST_MODE_SCROLL_LATENCY) {
-    send_scroll_down(scroll_x, scroll_y);
-    scroll_stats.previous_change_time = get_nanoseconds();
+    request_injection(injector, INJECT_SCROLL, 0);
   }
   while(true) {
-    bool screenshot_successful = read_data_from_screen((uint32_t)x,
-        (uint32_t) y, magic_pattern, &measurement);
-    if (!screenshot_successful) {
-      *error = "Test window moved during test. The test window must remain "
-          "stationary and focused during the entire test.";
+    wait_for_sample(capture, &measurement);
+    if (!measurement.pattern_found) {
+      *error = capture->data_unreadable ?
+          "The test pattern could not be read reliably. Make sure that color "
+          "management and display scaling are disabled for the browser." :
+          "Test window moved during test and could not be found again. "
+          "The test window must remain visible and focused during the entire "
+          "test.";
       return false;
     }
     if (measurement.test_mode == TEST_MODE_ABORT) {
       *error = "Test aborted.";
       return false;
     }
+    // If this sample shows a response to an event that's still in flight, the
+    // event must have been sent already. Wait for the injector thread to record
+    // the send time before using it to compute latency. Keystrokes may be
+    // queued ahead, so only wait for the ones that have been answered.
+    if (measurement.test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
+      int answered = key_down_events.value_delta +
+          statistic_change(&key_down_events, measurement.key_down_events);
+      while (injection_in_flight(injector) &&
+             keystrokes.sent + injector->completed - handled_injections <
+                 answered) {
+        usleep(0);
+      }
+    } else if (injection_in_flight(injector) &&
+        measurement.scroll_position != scroll_stats.value) {
+      while (injection_in_flight(injector)) {
+        usleep(0);
+      }
+    }
+    while (handled_injections != injector->completed) {
+      __sync_synchronize();
+      const injection *sent =
+          &injector->queue[handled_injections % MAX_INJECTIONS_IN_FLIGHT];
+      handled_injections++;
+      if (sent->failed) {
+        *error = sent->type == INJECT_KEYSTROKE ?
+            "Failed to send keystroke to test window." :
+            "Failed to send scroll event to test window.";
+        return false;
+      }
+      trace_instant(TRACE_TRACK_INPUT,
+          sent->type == INJECT_KEYSTROKE ? "keystroke" : "scroll",
+          sent->sent_time, 0, NULL);
+      if (measurement.test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
+        log_keystroke(&keystrokes, sent);
+      } else if (measurement.test_mode == TEST_MODE_SCROLL_LATENCY) {
+        scroll_stats.previous_change_time = sent->sent_time;
+      } else {
+        last_scroll_sent = sent->sent_time;
+      }
+    }
     screenshots++;
     int64_t screenshot_time = measurement.screenshot_time;
     int64_t previous_screenshot_time = previous_measurement.screenshot_time;
     debug_log("screenshot time %f",
         (screenshot_time - previous_screenshot_time) /
             (double)nanoseconds_per_millisecond);
-    update_statistic(&javascript_frames, measurement.javascript_frames,
-        screenshot_time, previous_screenshot_time);
-    update_statistic(&key_down_events, measurement.key_down_events,
-        screenshot_time, previous_screenshot_time);
-    update_statistic(&css_frames, measurement.css_frames, screenshot_time,
-        previous_screenshot_time);
-    bool scroll_updated = update_statistic(&scroll_stats,
-        measurement.scroll_position, screenshot_time, previous_screenshot_time);
+    trace_screenshot(&measurement, previous_screenshot_time);
+    bool scroll_updated;
+    if (measurement.relock_start_time) {
+      // The test window moved. Nothing that happened while the pattern was
+      // lost is measured, and scrolling follows the window once the event in
+      // flight, which may have missed it, has been sent.
+      relocks++;
+      excluded_time += screenshot_time - measurement.relock_start_time;
+      trace_span(TRACE_TRACK_SCREENSHOTS, "relock",
+          measurement.relock_start_time, screenshot_time, 0, NULL);
+      skip_statistic(&javascript_frames, measurement.javascript_frames,
+          screenshot_time, true);
+      skip_statistic(&key_down_events, measurement.key_down_events,
+          screenshot_time, false);
+      skip_statistic(&css_frames, measurement.css_frames, screenshot_time,
+          true);
+      scroll_updated = skip_statistic(&scroll_stats,
+          measurement.scroll_position, screenshot_time,
+          measurement.test_mode == TEST_MODE_PAUSE_TIME);
+      while (injection_in_flight(injector)) {
+        usleep(0);
+      }
+      injector->scroll_x = capture->x + 40;
+      injector->scroll_y = capture->y + 40;
+    } else {
+      int64_t earliest_change_time, latest_change_time;
+      change_interval(&previous_measurement, &measurement, options,
+          &earliest_change_time, &latest_change_time);
+      update_statistic(&javascript_frames, measurement.javascript_frames,
+          latest_change_time, earliest_change_time);
+      if (measurement.test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
+        update_keystroke_statistic(&key_down_events, &keystrokes,
+            measurement.key_down_events, measurement.last_key_id,
+            latest_change_time, earliest_change_time);
+      } else {
+        update_statistic(&key_down_events, measurement.key_down_events,
+            latest_change_time, earliest_change_time);
+      }
+      update_statistic(&css_frames, measurement.css_frames, latest_change_time,
+          earliest_change_time);
+      scroll_updated = update_statistic(&scroll_stats,
+          measurement.scroll_position, latest_change_time,
+          earliest_change_time);
+    }
 
     if (measurement.test_mode == TEST_MODE_JAVASCRIPT_LATENCY) {
-      if (key_down_events.measurements >= latency_measurements_to_take) {
+      if (enough_measurements(&key_down_events, options,
+          screenshot_time - start_time)) {
         break;
       }
-      if (key_down_events.value_delta > sent_events) {
+      if (key_down_events.value_delta > keystrokes.sent) {
         *error = "More events received than sent! This is probably a bug in "
             "the test.";
         return false;
       }
-      if (screenshot_time - key_down_events.previous_change_time >
+      // Time out if the oldest keystroke still waiting hasn't been answered.
+      if (key_down_events.value_delta < keystrokes.sent &&
+          screenshot_time - keystrokes.sent_times[key_down_events.value_delta %
+              KEYSTROKE_LOG_SIZE] >
           event_response_timeout_ms * nanoseconds_per_millisecond) {
         *error = "Browser did not respond to keyboard input. Make sure the "
             "test page remains focused for the entire test.";
         return false;
       }
-      if (key_down_events.value_delta == sent_events) {
-        // We want to avoid sending input events at a predictable time relative
-        // to frames, so introduce a random delay of up to 1 frame (16.67 ms)
-        // before sending the next event.
-        usleep((rand() % 17) * 1000);
-        if (!send_keystroke_z()) {
-          *error = "Failed to send keystroke for \"Z\" key to test window.";
-          return false;
+      if (keystroke_interval) {
+        // Keep the injector's queue full of keystrokes at the fixed rate,
+        // whether or not the earlier ones have been answered.
+        while (injector->requested - handled_injections <
+                   MAX_INJECTIONS_IN_FLIGHT &&
+               injector->requested - key_down_events.value_delta <
+                   KEYSTROKE_LOG_SIZE) {
+          // If the test loop fell behind, skip the keystrokes it missed
+          // rather than sending them all at once.
+          int64_t now = get_nanoseconds();
+          if (next_keystroke_time < now - keystroke_interval) {
+            next_keystroke_time = now;
+          }
+          request_injection_at(injector, INJECT_KEYSTROKE,
+              next_keystroke_time);
+          next_keystroke_time += keystroke_interval;
         }
-        key_down_events.previous_change_time = get_nanoseconds();
-        sent_events++;
+      } else if (injector->requested - key_down_events.value_delta <
+          keystrokes_in_flight) {
+        request_injection(injector, INJECT_KEYSTROKE,
+            random_injection_delay(refresh_period));
       }
     } else if (measurement.test_mode == TEST_MODE_SCROLL_LATENCY) {
-        if (scroll_stats.measurements >= latency_measurements_to_take) {
+        if (enough_measurements(&scroll_stats, options,
+            screenshot_time - start_time)) {
           break;
         }
         if (screenshot_time - scroll_stats.previous_change_time >
@@ -465,13 +1730,14 @@ bool measure_latency(
           int64_t scroll_wait_start_time = screenshot_time;
           while (screenshot_time - scroll_update_time <
                  100 * nanoseconds_per_millisecond) {
-            screenshot_successful = read_data_from_screen((uint32_t)x,
-                (uint32_t) y, magic_pattern, &measurement);
-            if (!screenshot_successful) {
-              *error = "Test window moved during test. The test window must "
-                  "remain stationary and focused during the entire test.";
+            wait_for_sample(capture, &measurement);
+            if (!measurement.pattern_found) {
+              *error = "Test window moved during test and could not be found "
+                  "again. The test window must remain visible and focused "
+                  "during the entire test.";
               return false;
             }
+            trace_screenshot(&measurement, screenshot_time);
             screenshot_time = measurement.screenshot_time;
             if (screenshot_time - scroll_wait_start_time >
                 nanoseconds_per_second) {
@@ -484,20 +1750,17 @@ bool measure_latency(
               scroll_update_time = screenshot_time;
             }
           }
-          // We want to avoid sending input events at a predictable time
-          // relative to frames, so introduce a random delay of up to 1 frame
-          // (16.67 ms) before sending the next event.
-          usleep((rand() % 17) * 1000);
-          send_scroll_down(scroll_x, scroll_y);
-          scroll_stats.previous_change_time = get_nanoseconds();
+          // The injector thread sends the next event after a random delay,
+          // while the capture thread keeps watching the screen.
+          request_injection(injector, INJECT_SCROLL,
+              random_injection_delay(refresh_period));
         }
     } else if (measurement.test_mode == TEST_MODE_PAUSE_TIME) {
       // For the pause time test we want the browser to scroll continuously.
       // Send a scroll event every frame.
-      if (screenshot_time - last_scroll_sent >
-          17 * nanoseconds_per_millisecond) {
-        send_scroll_down(scroll_x, scroll_y);
-        last_scroll_sent = get_nanoseconds();
+      if (screenshot_time - last_scroll_sent > refresh_period &&
+          !injection_in_flight(injector)) {
+        request_injection(injector, INJECT_SCROLL, 0);
       }
     } else if (measurement.test_mode == TEST_MODE_PAUSE_TIME_TEST_FINISHED) {
       break;
@@ -512,27 +1775,169 @@ bool measure_latency(
       return false;
     }
     previous_measurement = measurement;
-    usleep(0);
   }
   // The latency we report is the midpoint of the interval given by the average
   // upper and lower bounds we've computed.
-  *out_key_down_latency_ms =
+  out_results->key_down_latency_ms =
       (upper_bound_ms(&key_down_events) + lower_bound_ms(&key_down_events)) / 2;
-  *out_scroll_latency_ms =
-      (upper_bound_ms(&scroll_stats) + lower_bound_ms(&scroll_stats) / 2);
-  *out_max_js_pause_time_ms =
+  out_results->scroll_latency_ms =
+      (upper_bound_ms(&scroll_stats) + lower_bound_ms(&scroll_stats)) / 2;
+  out_results->max_js_pause_time_ms =
       javascript_frames.max_lower_bound / (double) nanoseconds_per_millisecond;
-  *out_max_css_pause_time_ms =
+  out_results->max_css_pause_time_ms =
       css_frames.max_lower_bound / (double) nanoseconds_per_millisecond;
-  *out_max_scroll_pause_time_ms =
+  out_results->max_scroll_pause_time_ms =
       scroll_stats.max_lower_bound / (double) nanoseconds_per_millisecond;
-  debug_log("out_key_down_latency_ms: %f out_scroll_latency_ms: %f "
-      "out_max_js_pause_time_ms: %f out_max_css_pause_time: %f\n "
-      "out_max_scroll_pause_time_ms: %f",
-      *out_key_down_latency_ms,
-      *out_scroll_latency_ms,
-      *out_max_js_pause_time_ms,
-      *out_max_css_pause_time_ms,
-      *out_max_scroll_pause_time_ms);
+  frame_pacing_results(&javascript_frames, &out_results->javascript_pacing);
+  frame_pacing_results(&css_frames, &out_results->css_pacing);
+  frame_pacing_results(&scroll_stats, &out_results->scroll_pacing);
+  latency_percentiles(&key_down_events, &out_results->key_down_latency);
+  latency_percentiles(&scroll_stats, &out_results->scroll_latency);
+  latency_confidence_interval(&key_down_events, options->confidence_percentile,
+      options->target_confidence_interval_ms, &out_results->key_down_interval);
+  latency_confidence_interval(&scroll_stats, options->confidence_percentile,
+      options->target_confidence_interval_ms, &out_results->scroll_interval);
+  out_results->key_down_lower_bounds = key_down_events.lower_bounds;
+  out_results->key_down_upper_bounds = key_down_events.upper_bounds;
+  out_results->scroll_lower_bounds = scroll_stats.lower_bounds;
+  out_results->scroll_upper_bounds = scroll_stats.upper_bounds;
+  if (keystrokes.sent && key_down_events.value_delta &&
+      key_down_events.previous_change_time > keystrokes.first_sent_time) {
+    out_results->key_down_events_per_second = key_down_events.value_delta *
+        (double)nanoseconds_per_second /
+        (key_down_events.previous_change_time - keystrokes.first_sent_time);
+  }
+  out_results->relocks = relocks;
+  out_results->excluded_time_ms =
+      excluded_time / (double)nanoseconds_per_millisecond;
+  debug_log("key_down_latency_ms: %f (p50 %f, p99 %f) scroll_latency_ms: %f "
+      "(p50 %f, p99 %f) max_js_pause_time_ms: %f max_css_pause_time: %f\n "
+      "max_scroll_pause_time_ms: %f",
+      out_results->key_down_latency_ms,
+      out_results->key_down_latency.p50_ms,
+      out_results->key_down_latency.p99_ms,
+      out_results->scroll_latency_ms,
+      out_results->scroll_latency.p50_ms,
+      out_results->scroll_latency.p99_ms,
+      out_results->max_js_pause_time_ms,
+      out_results->max_css_pause_time_ms,
+      out_results->max_scroll_pause_time_ms);
   return true;
 }
+
+
+// Main test function. Locates the given magic pixel pattern on the screen, then
+// runs one full latency test, sending input events and recording responses. On
+// success, the results of the test are reported in out_results, and true is
+// returned. If the test fails, the error parameter is filled in with an error
+// message and false is returned.
+bool measure_latency(
+    const uint8_t magic_pattern[],
+    const measurement_options *options,
+    latency_results *out_results,
+    char **error) {
+  screen_output output;
+  size_t x, y;
+  int output_index;
+  if (!locate_pattern(magic_pattern, &output, &output_index, &x, &y, error)) {
+    return false;
+  }
+  if (output_index >= 0) {
+    select_screen_output(&output);
+  }
+  measurement_t measurement;
+  bool first_screenshot_successful = false;
+  // The first screenshot may catch the pattern while it's being drawn.
+  for (int i = 0; i < 10 && !first_screenshot_successful; i++) {
+    memset(&measurement, 0, sizeof(measurement_t));
+    first_screenshot_successful = read_data_from_screen((uint32_t)x,
+        (uint32_t) y, magic_pattern, &measurement);
+  }
+  if (!first_screenshot_successful) {
+    *error = "Failed to read data from test pattern. If the test page was "
+        "open before the server was updated, reload it.";
+    return false;
+  }
+  if (measurement.test_mode == TEST_MODE_NATIVE_REFERENCE) {
+    uint8_t *test_pattern = (uint8_t *)malloc(pattern_bytes);
+    memset(test_pattern, 0, pattern_bytes);
+    for (int i = 0; i < pattern_magic_bytes; i++) {
+      test_pattern[i] = rand();
+    }
+    if (!open_native_reference_window(test_pattern,
+        options->native_reference_strategy)) {
+      *error = "Failed to open native reference window.";
+      return false;
+    }
+    bool return_value = measure_latency(test_pattern, options,
+        out_results, error);
+    if (!close_native_reference_window()) {
+      debug_log("Failed to close native reference window.");
+    };
+    return return_value;
+  }
+  // Input events are timed, the pause time test scrolls, and the results are
+  // reported in frames, relative to the monitor's refreshes.
+  int64_t refresh_period = default_refresh_period;
+  refresh_rate_source refresh_source = REFRESH_RATE_UNKNOWN;
+  if (output.refresh_rate_hz > 0) {
+    refresh_period =
+        (int64_t)(nanoseconds_per_second / output.refresh_rate_hz);
+    refresh_source = REFRESH_RATE_FROM_OUTPUT;
+  } else {
+    refresh_source = detect_refresh_period((uint32_t)x, (uint32_t)y,
+        magic_pattern, &measurement, &refresh_period);
+  }
+  // The ring buffer is too big for the stack.
+  capture_context *capture =
+      (capture_context *)calloc(1, sizeof(capture_context));
+  capture->x = (uint32_t)x;
+  capture->y = (uint32_t)y;
+  capture->magic_pattern = magic_pattern;
+  capture->wait_for_changes = options->wait_for_screen_changes;
+  injector_context injector;
+  memset(&injector, 0, sizeof(injector_context));
+  injector.scroll_x = x + 40;
+  injector.scroll_y = y + 40;
+  void *capture_thread = start_thread(capture_thread_main, capture);
+  void *injector_thread = start_thread(injector_thread_main, &injector);
+  bool success = false;
+  if (!capture_thread || !injector_thread) {
+    *error = "Failed to start test threads.";
+  } else {
+    success = run_test_loop(capture, &injector, measurement, options,
+        refresh_period, out_results, error);
+  }
+  capture->stop = true;
+  injector.stop = true;
+  if (capture_thread) {
+    join_thread(capture_thread);
+  }
+  if (injector_thread) {
+    join_thread(injector_thread);
+  }
+  if (success) {
+    out_results->output_index = output_index;
+    out_results->refresh_rate_source = refresh_source;
+    out_results->refresh_rate_hz = refresh_source == REFRESH_RATE_UNKNOWN ?
+        0 : nanoseconds_per_second / (double)refresh_period;
+    double frame_ms = refresh_period / (double)nanoseconds_per_millisecond;
+    out_results->frame_time_ms = frame_ms;
+    out_results->key_down_latency_frames =
+        out_results->key_down_latency_ms / frame_ms;
+    out_results->scroll_latency_frames =
+        out_results->scroll_latency_ms / frame_ms;
+    out_results->max_js_pause_time_frames =
+        out_results->max_js_pause_time_ms / frame_ms;
+    out_results->max_css_pause_time_frames =
+        out_results->max_css_pause_time_ms / frame_ms;
+    out_results->max_scroll_pause_time_frames =
+        out_results->max_scroll_pause_time_ms / frame_ms;
+    out_results->samples_per_second = capture_rate(capture);
+    out_results->rejected_samples = capture->rejected_samples;
+    debug_log("Took %.0f screenshots per second",
+              out_results->samples_per_second);
+  }
+  free(capture);
+  return success;
+}
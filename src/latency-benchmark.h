@@ -26,6 +26,7 @@
 #else
 #include <GL/gl.h>
 #endif
+#include "histogram.h"
 
 // The test mode is communicated from the test page to the server as one of the
 // pixel values in the test pattern.
@@ -38,24 +39,221 @@ typedef enum {
   TEST_MODE_ABORT = 6,
 } test_mode_t;
 
+// Percentiles of a distribution of per-event measurements, in milliseconds.
+typedef struct {
+  double p50_ms;
+  double p90_ms;
+  double p99_ms;
+  double p99_9_ms;
+} percentiles;
+
+// A 95% confidence interval on a latency, in milliseconds.
+typedef struct {
+  double low_ms;
+  double high_ms;
+  double half_width_ms;
+  // The number of measurements the interval was computed from.
+  int measurements;
+  // True if the interval is narrower than the target given in
+  // measurement_options.
+  bool target_met;
+} confidence_interval;
+
+// How smoothly a value that should change every refresh kept up with the
+// display during the pause time test.
+typedef struct {
+  // The time between each frame and the one before it.
+  histogram frame_times;
+  int frames;
+  // The number of refreshes in which the value should have changed but didn't,
+  // and the most of them in a row.
+  int dropped_frames;
+  int longest_dropped_run;
+  // The percentage of refreshes that were dropped.
+  double jank_percent;
+  // The times of the first and last frames the pacing was measured between,
+  // in get_nanoseconds() time, or 0 if there were none.
+  int64_t first_frame_time;
+  int64_t last_frame_time;
+} frame_pacing;
+
+// Where the refresh rate the results are relative to came from.
+typedef enum {
+  // It couldn't be found, so 60 Hz was assumed.
+  REFRESH_RATE_UNKNOWN,
+  // The platform's mode information for the monitor, e.g. from XRandR.
+  REFRESH_RATE_FROM_OUTPUT,
+  // The times of the vblanks the platform reported during the test.
+  REFRESH_RATE_FROM_VBLANKS,
+  // The cadence of the page's JavaScript or CSS animation frame counters.
+  REFRESH_RATE_FROM_FRAME_COUNTER,
+} refresh_rate_source;
+
+// Controls how many measurements the key down and scroll latency tests take.
+typedef struct {
+  // If positive, the tests keep taking measurements until the half-width of the
+  // 95% confidence interval on the latency is at most this many milliseconds.
+  // Otherwise a fixed number of measurements is taken.
+  double target_confidence_interval_ms;
+  // If positive, the confidence interval is on this percentile (0-100) of the
+  // latency instead of the mean.
+  double confidence_percentile;
+  // Bounds on the number of measurements when targeting a confidence interval.
+  // The test also stops early, with whatever interval it has reached, if it is
+  // close to timing out.
+  int min_measurements;
+  int max_measurements;
+  // If true and the platform reports vblank times, the bounds on each change
+  // are snapped to the display refreshes around it instead of the screenshot
+  // times. This assumes the screen only changes at vblank, which is true with
+  // a compositor or page flipping but not when drawing to the front buffer.
+  bool snap_to_vblank;
+  // If true, screenshots are only taken when the platform reports that the
+  // pattern changed (plus a periodic heartbeat), instead of continuously. This
+  // uses much less CPU. Ignored on platforms that can't report changes.
+  bool wait_for_screen_changes;
+  // The key down latency test sends the next keystroke once fewer than this
+  // many are waiting for a response, instead of only once the last one has
+  // been answered. At most KEY_ID_COUNT; 0 means 1.
+  int keystrokes_in_flight;
+  // If positive, the key down latency test instead sends keystrokes at this
+  // fixed rate, whether or not the earlier ones have been answered, to
+  // measure latency under sustained input.
+  double injection_rate_hz;
+  // How the native reference window schedules its frames when the test page
+  // asks for the native reference test.
+  native_reference_strategy native_reference_strategy;
+} measurement_options;
+
+// The results of one run of measure_latency. Latencies are reported as the
+// midpoint between the lower and upper bounds on the time of each response.
+typedef struct {
+  double key_down_latency_ms;
+  double scroll_latency_ms;
+  double max_js_pause_time_ms;
+  double max_css_pause_time_ms;
+  double max_scroll_pause_time_ms;
+  // The same results in refreshes of the monitor, so that they can be compared
+  // between monitors with different refresh rates.
+  double frame_time_ms;
+  double key_down_latency_frames;
+  double scroll_latency_frames;
+  double max_js_pause_time_frames;
+  double max_css_pause_time_frames;
+  double max_scroll_pause_time_frames;
+  // The pacing of the JavaScript frames, CSS animation frames and scrolling
+  // during the pause time test, relative to the monitor's refresh rate.
+  frame_pacing javascript_pacing;
+  frame_pacing css_pacing;
+  frame_pacing scroll_pacing;
+  percentiles key_down_latency;
+  percentiles scroll_latency;
+  // The confidence intervals on the statistic chosen in measurement_options.
+  confidence_interval key_down_interval;
+  confidence_interval scroll_interval;
+  // The full distributions of the lower and upper bounds on the latency of
+  // every event.
+  histogram key_down_lower_bounds;
+  histogram key_down_upper_bounds;
+  histogram scroll_lower_bounds;
+  histogram scroll_upper_bounds;
+  // The rate at which the page handled keystrokes during the key down latency
+  // test, from the first keystroke to the last response.
+  double key_down_events_per_second;
+  // The rate at which the screen was sampled during the test. Each sample is a
+  // screenshot of the pattern, so this bounds the precision of the results.
+  double samples_per_second;
+  // The monitor the test ran on, as an index into the platform's list of
+  // monitors or -1 if the platform can't list them, and its refresh rate, or 0
+  // if that isn't known. If the platform doesn't report the refresh rate, it's
+  // measured before the test.
+  int output_index;
+  double refresh_rate_hz;
+  refresh_rate_source refresh_rate_source;
+  // The number of times the test window moved during the test and the pattern
+  // had to be found again, and the total time it was lost for. Changes during
+  // that time aren't included in the results.
+  int relocks;
+  double excluded_time_ms;
+  // The number of screenshots of the pattern dropped because its data failed
+  // the checks in decode_pattern_data.
+  int rejected_samples;
+} latency_results;
+
 // Main test function. Locates the given magic pixel pattern on the screen, then
 // runs one full latency test, sending input events and recording responses. On
-// success, the results of the test are reported in the output parameters, and
-// true is returned. If the test fails, the error parameter is filled in with
-// an error message and false is returned.
+// success, the results of the test are reported in out_results, and true is
+// returned. If the test fails, the error parameter is filled in with an error
+// message and false is returned.
 bool measure_latency(
     const uint8_t magic_pattern[],
-    double *out_key_down_latency_ms,
-    double *out_scroll_latency_ms,
-    double *out_max_js_pause_time_ms,
-    double *out_max_css_pause_time_ms,
-    double *out_max_scroll_pause_time_ms,
+    const measurement_options *options,
+    latency_results *out_results,
     char **error);
 
+// The layout of the data part of the pattern, which the test page and the
+// native reference window draw the same way. Each pixel holds three bytes, in
+// blue, green, red order. After the magic pixels, version 3 of the layout is:
+//   0: the layout version, the test mode, and the sequence number
+//   1: the JavaScript frame counter (16 bits, low byte first), and 0
+//   2: the key down event counter (16 bits, low byte first), and the key ID of
+//      the last key down event
+//   3: the Fletcher-16 checksum of pixels 0-2 (2 bytes), and the sequence
+//      number again
+//   4: the scroll position (8 bits), in all three channels
+//   5: the CSS animation frame counter (8 bits), in all three channels
+// The sequence number advances every time the pattern is drawn, so a
+// screenshot that catches the pattern half drawn has two different ones. The
+// last two pixels are drawn by the browser rather than the page's JavaScript,
+// so they can't be part of the checksum; instead their channels must agree.
+static const int pattern_version = 3;
+
+// Keystrokes are sent with several keys in turn, so that the page's responses
+// can be matched to them even when more than one is in flight. The key ID the
+// page reports is 1 for Z, 2 for X, 3 for C and 4 for V, or 0 if it doesn't
+// tell them apart.
+#define KEY_ID_COUNT 4
+
+typedef struct {
+  test_mode_t test_mode;
+  uint8_t sequence;
+  uint16_t javascript_frames;
+  uint16_t key_down_events;
+  uint8_t last_key_id;
+  uint8_t scroll_position;
+  uint8_t css_frames;
+} pattern_data;
+
+// Writes the given data into the data part of a pattern, which is
+// pattern_bytes long. Alpha bytes are left alone.
+void encode_pattern_data(const pattern_data *data, uint8_t pattern[]);
+
+// Reads the data part of a pattern. Returns false if the pattern has another
+// layout version or was misread, e.g. because of dithering, color management or
+// a screenshot taken while it was being drawn.
+bool decode_pattern_data(const uint8_t pattern[], pattern_data *out_data);
+
 // Updates the given pattern with the given event data, then draws the pattern to
 // the current OpenGL context.
 void draw_pattern_with_opengl(uint8_t pattern[], int scroll_events,
-                              int keydown_events, int esc_presses);
+                              int keydown_events, int last_key_id,
+                              int esc_presses);
+
+// Returns the name of the strategy, as accepted by
+// parse_native_reference_strategy.
+const char *native_reference_strategy_name(native_reference_strategy strategy);
+
+// Looks up a native reference strategy by name. Returns false if there is no
+// strategy with that name.
+bool parse_native_reference_strategy(const char *name,
+                                     native_reference_strategy *out_strategy);
+
+// Returns the name of the input method, as accepted by parse_input_method.
+const char *input_method_name(input_method method);
+
+// Looks up an input method by name. Returns false if there is no method with
+// that name.
+bool parse_input_method(const char *name, input_method *out_method);
 
 // Parses the magic pattern from a hexadecimal encoded string and fills
 // parsed_pattern with the result. parsed_pattern must be a buffer at least
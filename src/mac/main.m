@@ -27,6 +27,7 @@ NSOpenGLContext *context;
 uint8_t pattern[pattern_bytes];
 static int scrolls = 0;
 static int key_downs = 0;
+static int last_key_id = 0;
 static int esc_presses = 0;
 
 // This callback is called for each display refresh by CVDisplayLink so that we
@@ -60,7 +61,8 @@ static CVReturn vsync_callback(
   // We must lock the OpenGL context since it's shared with the main thread.
   CGLLockContext((CGLContextObj)[context CGLContextObj]);
   [context makeCurrentContext];
-  draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+  draw_pattern_with_opengl(pattern, scrolls, key_downs, last_key_id,
+      esc_presses);
   [context flushBuffer];
   CGLUnlockContext((CGLContextObj)[context CGLContextObj]);
   return kCVReturnSuccess;
@@ -141,7 +143,8 @@ int main(int argc, const char *argv[])
     [context setView:[window contentView]];
     // Draw the test pattern on the window before it is shown.
     [context makeCurrentContext];
-    draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+    draw_pattern_with_opengl(pattern, scrolls, key_downs, last_key_id,
+        esc_presses);
     [context flushBuffer];
     // Show the window.
     [window makeKeyAndOrderFront:window];
@@ -159,8 +162,12 @@ int main(int argc, const char *argv[])
       return nil;
     }];
     [NSEvent addLocalMonitorForEventsMatchingMask:NSKeyDownMask handler:^NSEvent *(NSEvent *event) {
-      if ([event keyCode] == 53) {
-        esc_presses++;
+      switch ([event keyCode]) {
+      case 53: esc_presses++; break;
+      case 6: last_key_id = 1; break;  // Z
+      case 7: last_key_id = 2; break;  // X
+      case 8: last_key_id = 3; break;  // C
+      case 9: last_key_id = 4; break;  // V
       }
       key_downs++;
       return nil;
@@ -15,6 +15,7 @@
  */
 
 #include <wordexp.h>
+#include <pthread.h>
 #import "../screenscraper.h"
 #import "../latency-benchmark.h"
 #import <Cocoa/Cocoa.h>
@@ -29,6 +30,10 @@ bool near_integer(float f) {
 static const CGWindowImageOption image_options =
     kCGWindowImageBestResolution | kCGWindowImageShouldBeOpaque;
 
+#ifndef NDEBUG
+static volatile long screenshot_allocation_count = 0;
+#endif
+
 screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
     uint32_t height) {
   // TODO: support multiple monitors.
@@ -92,11 +97,16 @@ screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
   CFRelease(window_image);
   const uint8_t *pixels = CFDataGetBytePtr(image_data);
   screenshot *shot = (screenshot *)malloc(sizeof(screenshot));
+#ifndef NDEBUG
+  __sync_fetch_and_add(&screenshot_allocation_count, 1);
+#endif
   shot->width = (int32_t)image_width;
   shot->height = (int32_t)image_height;
   shot->stride = (int32_t)stride;
   shot->pixels = pixels;
   shot->time_nanoseconds = screenshot_time;
+  shot->vblank_time_nanoseconds = 0;
+  shot->frame_counter = 0;
   shot->platform_specific_data = (void *)image_data;
   return shot;
 }
@@ -106,6 +116,35 @@ void free_screenshot(screenshot *shot) {
   free(shot);
 }
 
+// Every screenshot is a new CGImage, so there's nothing to reserve.
+bool reserve_screenshot_buffers(uint32_t width, uint32_t height, int count) {
+  return false;
+}
+
+void release_screenshot_buffers(uint32_t width, uint32_t height) {
+}
+
+#ifndef NDEBUG
+int64_t get_screenshot_allocation_count() {
+  return screenshot_allocation_count;
+}
+#endif
+
+// TODO: support multiple monitors. Screenshots are only taken of the main
+// one.
+int get_screen_outputs(screen_output *out_outputs, int max_outputs) {
+  return 0;
+}
+
+void select_screen_output(const screen_output *output) {
+}
+
+screen_change_result wait_for_screen_change(uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int64_t timeout_nanoseconds,
+    int64_t *out_change_time) {
+  return SCREEN_CHANGE_UNSUPPORTED;
+}
+
 bool send_keystroke(int keyCode) {
   CGEventRef down = CGEventCreateKeyboardEvent(NULL, (CGKeyCode)keyCode, true);
   CGEventRef up = CGEventCreateKeyboardEvent(NULL, (CGKeyCode)keyCode, false);
@@ -120,6 +159,9 @@ bool send_keystroke_b() { return send_keystroke(11); }
 bool send_keystroke_t() { return send_keystroke(17); }
 bool send_keystroke_w() { return send_keystroke(13); }
 bool send_keystroke_z() { return send_keystroke(6); }
+bool send_keystroke_x() { return send_keystroke(7); }
+bool send_keystroke_c() { return send_keystroke(8); }
+bool send_keystroke_v() { return send_keystroke(9); }
 
 bool send_scroll_down(x, y) {
   CGFloat devicePixelRatio =
@@ -133,6 +175,14 @@ bool send_scroll_down(x, y) {
   return true;
 }
 
+bool set_input_method(input_method method) {
+  return method == INPUT_METHOD_DEFAULT;
+}
+
+int64_t get_last_input_dispatch_time() {
+  return 0;
+}
+
 static AbsoluteTime start_time = { .hi = 0, .lo = 0 };
 int64_t get_nanoseconds() {
   // TODO: Apple deprecated UpTime(), so switch to mach_absolute_time.
@@ -143,6 +193,40 @@ int64_t get_nanoseconds() {
   return UnsignedWideToUInt64(AbsoluteDeltaToNanoseconds(UpTime(), start_time));
 }
 
+typedef struct {
+  pthread_t thread;
+  void (*thread_main)(void *);
+  void *argument;
+} mac_thread;
+
+static void *run_thread(void *thread) {
+  mac_thread *t = (mac_thread *)thread;
+  t->thread_main(t->argument);
+  return NULL;
+}
+
+void *start_thread(void (*thread_main)(void *), void *argument) {
+  mac_thread *thread = (mac_thread *)malloc(sizeof(mac_thread));
+  thread->thread_main = thread_main;
+  thread->argument = argument;
+  if (pthread_create(&thread->thread, NULL, run_thread, thread)) {
+    debug_log("pthread_create failed");
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+void join_thread(void *thread) {
+  pthread_join(((mac_thread *)thread)->thread, NULL);
+  free(thread);
+}
+
+int get_processor_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
 void debug_log(const char *message, ...) {
 #ifdef DEBUG
   va_list list;
@@ -209,7 +293,12 @@ bool close_browser() {
 
 pid_t window_process_pid = 0;
 
-bool open_native_reference_window(uint8_t *test_pattern_for_window) {
+bool open_native_reference_window(uint8_t *test_pattern_for_window,
+    native_reference_strategy strategy) {
+  if (strategy != NATIVE_REFERENCE_IMMEDIATE) {
+    debug_log("Only the immediate native reference strategy is supported");
+    return false;
+  }
   if (window_process_pid != 0) {
     debug_log("Native reference window already open");
     return false;
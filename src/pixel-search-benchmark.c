@@ -0,0 +1,125 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the throughput of each pattern search kernel on synthetic
+// screenshots. The pattern is placed at the end of the last row, which is the
+// worst case: the whole frame has to be scanned to find it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pixel-search.h"
+#ifdef _WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+static const int pattern_bytes = 16;  // 4 BGRA pixels.
+
+// This benchmark doesn't link against the platform layer, so it has its own
+// clock.
+static int64_t benchmark_nanoseconds() {
+#ifdef _WINDOWS
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (int64_t)(counter.QuadPart * (1e9 / frequency.QuadPart));
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+
+// Fills the frame with random opaque pixels and puts the pattern (with a
+// different alpha, which should be ignored) at the end of the last row.
+static void fill_frame(uint8_t *frame, uint32_t width, uint32_t height,
+    const uint8_t pattern[]) {
+  size_t length = (size_t)width * height * 4;
+  uint32_t random = 12345;
+  for (size_t i = 0; i < length; i += 4) {
+    // xorshift is much faster than rand() for filling an 8K frame.
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    frame[i + 0] = (uint8_t)random;
+    frame[i + 1] = (uint8_t)(random >> 8);
+    frame[i + 2] = (uint8_t)(random >> 16);
+    frame[i + 3] = 255;
+  }
+  uint8_t *end = frame + length - pattern_bytes;
+  for (int i = 0; i < pattern_bytes; i++) {
+    end[i] = (i % 4 == 3) ? 0 : pattern[i];
+  }
+}
+
+
+static void benchmark_frame(const char *name, uint32_t width,
+    uint32_t height) {
+  const uint8_t pattern[] = { 0x8a, 0x36, 0x05, 0xff, 0x2d, 0x02, 0xc5, 0xff,
+                              0x11, 0x22, 0x33, 0xff, 0x44, 0x55, 0x66, 0xff };
+  // Pad the frame by one pixel so that the pattern isn't in the very last
+  // position, which find_BGRA_pixels_ignoring_alpha never checks.
+  size_t length = (size_t)width * height * 4 + 4;
+  uint8_t *frame = (uint8_t *)malloc(length);
+  if (!frame) {
+    fprintf(stderr, "%s: failed to allocate frame\n", name);
+    return;
+  }
+  fill_frame(frame, width, height, pattern);
+  memset(frame + length - 4, 0, 4);
+  const uint8_t *expected = frame + length - 4 - pattern_bytes;
+  for (int k = 0; k < PIXEL_SEARCH_KERNEL_COUNT; k++) {
+    pixel_search_kernel kernel = (pixel_search_kernel)k;
+    if (!pixel_search_kernel_supported(kernel)) {
+      printf("%-6s %-7s unsupported on this CPU\n", name,
+          pixel_search_kernel_name(kernel));
+      continue;
+    }
+    // Run for at least half a second to get a stable number.
+    int iterations = 0;
+    int64_t start = benchmark_nanoseconds();
+    int64_t elapsed = 0;
+    bool correct = true;
+    do {
+      const uint8_t *found = find_BGRA_pixels_ignoring_alpha_with_kernel(
+          kernel, frame, length, pattern, pattern_bytes);
+      correct &= found == expected;
+      iterations++;
+      elapsed = benchmark_nanoseconds() - start;
+    } while (elapsed < 500000000 || iterations < 3);
+    double seconds_per_search = elapsed / 1e9 / iterations;
+    printf("%-6s %-7s %8.3f ms/search %7.2f GB/s%s\n", name,
+        pixel_search_kernel_name(kernel), seconds_per_search * 1000,
+        length / seconds_per_search / 1e9,
+        correct ? "" : "  WRONG RESULT");
+  }
+  free(frame);
+}
+
+
+int main(void) {
+  printf("Best kernel for this CPU: %s\n",
+      pixel_search_kernel_name(best_pixel_search_kernel()));
+  benchmark_frame("1080p", 1920, 1080);
+  benchmark_frame("4K", 3840, 2160);
+  benchmark_frame("8K", 7680, 4320);
+  return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include "pixel-search.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define WLB_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC compiles intrinsics for any instruction set without extra flags.
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+// GCC and Clang only allow intrinsics in functions compiled for an instruction
+// set that includes them, so the kernels are compiled for their instruction set
+// individually and the rest of the program still runs on older CPUs.
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+
+// The original byte-by-byte implementation, used on non-x86 CPUs and for
+// needles that aren't exactly 4 pixels long.
+static const uint8_t *find_pixels_scalar(const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle, size_t needle_length) {
+  const uint8_t *haystack_end = haystack + haystack_length;
+  for(const uint8_t *i = haystack; i < haystack_end - needle_length; i += 4) {
+    for(size_t j = 0; j < needle_length; j++) {
+      if (j % 4 == 3 /* alpha byte */ ||
+          i[j] == needle[j] /* non-alpha byte */) {
+        if (j == needle_length - 1) return i;
+      } else {
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+
+#ifdef WLB_X86
+
+// The SIMD kernels search for a needle of exactly 4 pixels, which fits in one
+// 128-bit register. They find candidate positions by comparing several pixels
+// at once against the first pixel of the needle, then verify each candidate by
+// comparing the whole needle as a single 128-bit lane. Every kernel checks the
+// same candidate positions as find_pixels_scalar and so returns the same
+// result.
+static const size_t simd_needle_length = 16;
+
+// Returns the number of candidate positions (pixel offsets) that
+// find_pixels_scalar would check. Each candidate has at least 16 readable bytes
+// starting at its offset.
+static size_t candidate_count(size_t haystack_length) {
+  if (haystack_length <= simd_needle_length) {
+    return 0;
+  }
+  return (haystack_length - simd_needle_length + 3) / 4;
+}
+
+
+// Checks the candidates in candidate_mask (one bit per pixel starting at
+// haystack + 4 * first) against the full needle. Returns the first match.
+TARGET_SSE2
+static const uint8_t *verify_candidates(const uint8_t *haystack, size_t first,
+    unsigned int candidate_mask, __m128i masked_needle, __m128i alpha_mask) {
+  while (candidate_mask) {
+    int bit = 0;
+    while (!(candidate_mask & (1u << bit))) {
+      bit++;
+    }
+    candidate_mask &= ~(1u << bit);
+    const uint8_t *candidate = haystack + 4 * (first + bit);
+    __m128i pixels = _mm_and_si128(
+        _mm_loadu_si128((const __m128i *)candidate), alpha_mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, masked_needle)) == 0xFFFF) {
+      return candidate;
+    }
+  }
+  return NULL;
+}
+
+
+// Checks candidates [first, candidates) 4 at a time.
+TARGET_SSE2
+static const uint8_t *find_pixels_sse2_from(const uint8_t *haystack,
+    size_t first, size_t candidates, const uint8_t *needle) {
+  const __m128i alpha_mask = _mm_set1_epi32(0x00FFFFFF);
+  const __m128i masked_needle = _mm_and_si128(
+      _mm_loadu_si128((const __m128i *)needle), alpha_mask);
+  const __m128i first_pixel = _mm_shuffle_epi32(masked_needle, 0);
+  for (size_t i = first; i < candidates; i += 4) {
+    __m128i pixels = _mm_and_si128(
+        _mm_loadu_si128((const __m128i *)(haystack + 4 * i)), alpha_mask);
+    unsigned int mask = _mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(pixels, first_pixel)));
+    if (candidates - i < 4) {
+      // Ignore pixels past the last candidate.
+      mask &= (1u << (candidates - i)) - 1;
+    }
+    if (mask) {
+      const uint8_t *found = verify_candidates(haystack, i, mask,
+          masked_needle, alpha_mask);
+      if (found) return found;
+    }
+  }
+  return NULL;
+}
+
+
+static const uint8_t *find_pixels_sse2(const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle) {
+  return find_pixels_sse2_from(haystack, 0, candidate_count(haystack_length),
+      needle);
+}
+
+
+// Checks candidates 8 at a time, then finishes the last few with SSE2.
+TARGET_AVX2
+static const uint8_t *find_pixels_avx2(const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle) {
+  size_t candidates = candidate_count(haystack_length);
+  const __m128i alpha_mask = _mm_set1_epi32(0x00FFFFFF);
+  const __m128i masked_needle = _mm_and_si128(
+      _mm_loadu_si128((const __m128i *)needle), alpha_mask);
+  const __m256i wide_alpha_mask = _mm256_set1_epi32(0x00FFFFFF);
+  const __m256i first_pixel = _mm256_set1_epi32(
+      _mm_cvtsi128_si32(masked_needle));
+  size_t i = 0;
+  // A 32 byte load at candidate i is in bounds as long as candidate i + 7
+  // exists, since every candidate has 16 readable bytes.
+  for (; i + 8 <= candidates; i += 8) {
+    __m256i pixels = _mm256_and_si256(
+        _mm256_loadu_si256((const __m256i *)(haystack + 4 * i)),
+        wide_alpha_mask);
+    unsigned int mask = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(pixels, first_pixel)));
+    if (mask) {
+      const uint8_t *found = verify_candidates(haystack, i, mask,
+          masked_needle, alpha_mask);
+      if (found) return found;
+    }
+  }
+  return find_pixels_sse2_from(haystack, i, candidates, needle);
+}
+
+
+static void cpuid(unsigned int leaf, unsigned int subleaf,
+    unsigned int registers[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int *)registers, leaf, subleaf);
+#else
+  __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2],
+      registers[3]);
+#endif
+}
+
+
+static bool cpu_supports_avx2() {
+  unsigned int registers[4];
+  cpuid(0, 0, registers);
+  if (registers[0] < 7) {
+    return false;
+  }
+  cpuid(1, 0, registers);
+  // The OS must save the AVX registers on context switches (OSXSAVE), which we
+  // check with XGETBV.
+  bool osxsave = registers[2] & (1u << 27);
+  bool avx = registers[2] & (1u << 28);
+  if (!osxsave || !avx) {
+    return false;
+  }
+#ifdef _MSC_VER
+  unsigned long long xcr0 = _xgetbv(0);
+#else
+  unsigned int xcr0_low, xcr0_high;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  unsigned long long xcr0 = xcr0_low;
+#endif
+  // XMM and YMM state.
+  if ((xcr0 & 6) != 6) {
+    return false;
+  }
+  cpuid(7, 0, registers);
+  return registers[1] & (1u << 5);
+}
+
+
+static bool cpu_supports_sse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+  // SSE2 is part of x86-64.
+  return true;
+#else
+  unsigned int registers[4];
+  cpuid(1, 0, registers);
+  return registers[3] & (1u << 26);
+#endif
+}
+
+#endif  // WLB_X86
+
+
+bool pixel_search_kernel_supported(pixel_search_kernel kernel) {
+  switch (kernel) {
+  case PIXEL_SEARCH_SCALAR:
+    return true;
+#ifdef WLB_X86
+  case PIXEL_SEARCH_SSE2:
+    return cpu_supports_sse2();
+  case PIXEL_SEARCH_AVX2:
+    return cpu_supports_avx2();
+#endif
+  default:
+    return false;
+  }
+}
+
+
+pixel_search_kernel best_pixel_search_kernel() {
+  // CPUID is slow, so only check once.
+  static int best = -1;
+  if (best == -1) {
+    int kernel = PIXEL_SEARCH_KERNEL_COUNT - 1;
+    while (!pixel_search_kernel_supported((pixel_search_kernel)kernel)) {
+      kernel--;
+    }
+    best = kernel;
+  }
+  return (pixel_search_kernel)best;
+}
+
+
+const char *pixel_search_kernel_name(pixel_search_kernel kernel) {
+  switch (kernel) {
+  case PIXEL_SEARCH_SCALAR:
+    return "scalar";
+  case PIXEL_SEARCH_SSE2:
+    return "sse2";
+  case PIXEL_SEARCH_AVX2:
+    return "avx2";
+  default:
+    return "unknown";
+  }
+}
+
+
+const uint8_t *find_BGRA_pixels_ignoring_alpha_with_kernel(
+    pixel_search_kernel kernel, const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle, size_t needle_length) {
+  assert(pixel_search_kernel_supported(kernel));
+#ifdef WLB_X86
+  if (needle_length == simd_needle_length) {
+    if (kernel == PIXEL_SEARCH_AVX2) {
+      return find_pixels_avx2(haystack, haystack_length, needle);
+    }
+    if (kernel == PIXEL_SEARCH_SSE2) {
+      return find_pixels_sse2(haystack, haystack_length, needle);
+    }
+  }
+#endif
+  return find_pixels_scalar(haystack, haystack_length, needle, needle_length);
+}
+
+
+const uint8_t *find_BGRA_pixels_ignoring_alpha(const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle, size_t needle_length) {
+  return find_BGRA_pixels_ignoring_alpha_with_kernel(
+      best_pixel_search_kernel(), haystack, haystack_length, needle,
+      needle_length);
+}
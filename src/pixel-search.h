@@ -0,0 +1,60 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Searching a full-screen screenshot for the test pattern is the most
+// expensive thing the server does, so the search has SIMD implementations
+// that are selected at runtime based on the features of the CPU.
+
+#ifndef WLB_PIXEL_SEARCH_H_
+#define WLB_PIXEL_SEARCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#if __STDC_VERSION__ >= 199901L  // C99
+#include <stdbool.h>
+#endif
+
+typedef enum {
+  PIXEL_SEARCH_SCALAR,
+  PIXEL_SEARCH_SSE2,
+  PIXEL_SEARCH_AVX2,
+  PIXEL_SEARCH_KERNEL_COUNT,
+} pixel_search_kernel;
+
+// Returns true if the given kernel can run on this CPU.
+bool pixel_search_kernel_supported(pixel_search_kernel kernel);
+
+// Returns the fastest kernel that can run on this CPU.
+pixel_search_kernel best_pixel_search_kernel();
+
+// Returns a short human readable name for the kernel, e.g. "avx2".
+const char *pixel_search_kernel_name(pixel_search_kernel kernel);
+
+// This function works something like memmem, except that it expects needle to
+// be 4-byte aligned in haystack (since each pixel is 4 bytes) and it ignores
+// every fourth byte (starting with haystack[3]) because those bytes represent
+// alpha. Uses the fastest kernel supported by the CPU.
+const uint8_t *find_BGRA_pixels_ignoring_alpha(const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle, size_t needle_length);
+
+// Same as find_BGRA_pixels_ignoring_alpha, but uses the given kernel, which
+// must be supported by the CPU. The SIMD kernels only handle 4 pixel needles
+// and fall back to the scalar kernel for other lengths.
+const uint8_t *find_BGRA_pixels_ignoring_alpha_with_kernel(
+    pixel_search_kernel kernel, const uint8_t *haystack,
+    size_t haystack_length, const uint8_t *needle, size_t needle_length);
+
+#endif  // WLB_PIXEL_SEARCH_H_
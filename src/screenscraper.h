@@ -35,6 +35,9 @@
 #endif
 #include <intrin.h>
 #define __sync_fetch_and_add _InterlockedExchangeAdd
+#define __sync_synchronize _mm_mfence
+#define __sync_val_compare_and_swap(destination, comparand, exchange) \
+    _InterlockedCompareExchange((destination), (exchange), (comparand))
 // Ugh, MSVC doesn't have a sensible snprintf. sprintf_s is close, as long as
 // you don't care about the return value.
 #define snprintf sprintf_s
@@ -45,6 +48,11 @@ typedef struct {
     uint32_t stride;           // The distance between rows in memory, in bytes.
     const uint8_t *pixels;     // 32-bit BGRA format, 4 * stride * height bytes.
     int64_t time_nanoseconds;  // The moment when the screenshot was taken.
+    // The time of the last vblank before the screenshot was taken, and the
+    // display's frame counter at that vblank. Both are 0 if the platform
+    // doesn't know when the display refreshes.
+    int64_t vblank_time_nanoseconds;
+    int64_t frame_counter;
     void *platform_specific_data;
 } screenshot;
 
@@ -59,17 +67,91 @@ screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
                             uint32_t height);
 void free_screenshot(screenshot *screenshot);
 
+// A monitor, as an area of the screen in the coordinates take_screenshot uses.
+typedef struct {
+  uint32_t x, y, width, height;
+  // The monitor's refresh rate, or 0 if it isn't known.
+  double refresh_rate_hz;
+} screen_output;
+
+#define MAX_SCREEN_OUTPUTS 16
+
+// Fills in up to max_outputs of the monitors that make up the screen, and
+// returns how many were filled in. Returns 0 if the platform can't tell, in
+// which case the whole screen should be treated as one monitor.
+int get_screen_outputs(screen_output *out_outputs, int max_outputs);
+
+// Tells the platform which monitor the test is running on, so that the vblank
+// times of later screenshots come from that monitor's refreshes.
+void select_screen_output(const screen_output *output);
+
+// take_screenshot acquires a capture buffer from a pool keyed by the
+// screenshot's size, and free_screenshot releases it back to the pool.
+// Reserving buffers for a size ahead of time means that taking screenshots of
+// that size, up to count at once, never allocates, until the reservation is
+// released. Returns false if the platform can't reserve buffers, in which case
+// take_screenshot may allocate but still works.
+bool reserve_screenshot_buffers(uint32_t width, uint32_t height, int count);
+void release_screenshot_buffers(uint32_t width, uint32_t height);
+
+#ifndef NDEBUG
+// The number of heap allocations that take_screenshot has made, for checking
+// that polling a reserved size doesn't allocate.
+int64_t get_screenshot_allocation_count();
+#endif
+
+typedef enum {
+  SCREEN_CHANGED,
+  SCREEN_CHANGE_TIMEOUT,
+  // The platform can't report changes, so the caller has to poll.
+  SCREEN_CHANGE_UNSUPPORTED,
+} screen_change_result;
+
+// Blocks until something is drawn to the given rectangle of the screen, or
+// until the timeout passes. On SCREEN_CHANGED, out_change_time is set to the
+// time the notification arrived, which is just after the change reached the
+// screen. Must only be called from one thread.
+screen_change_result wait_for_screen_change(uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int64_t timeout_nanoseconds,
+    int64_t *out_change_time);
+
 // Sends key down and key up events to the foreground window for the named key.
 // Returns true on success, false on failure.
 bool send_keystroke_b();
 bool send_keystroke_t();
 bool send_keystroke_w();
 bool send_keystroke_z();
+bool send_keystroke_x();
+bool send_keystroke_c();
+bool send_keystroke_v();
 
 // Warps the mouse to the given point and sends a mousewheel scroll down event.
 // Returns true on success, false on failure.
 bool send_scroll_down(int x, int y);
 
+// How send_keystroke_* and send_scroll_down generate input events.
+typedef enum {
+  // The platform's usual method.
+  INPUT_METHOD_DEFAULT,
+  // The X11 XTest extension, which generates events that go through the X
+  // server's input processing like real ones.
+  INPUT_METHOD_XTEST,
+  // Linux uinput virtual devices, whose events go through the kernel's input
+  // stack and the window system like those of real devices.
+  INPUT_METHOD_UINPUT,
+  INPUT_METHOD_COUNT
+} input_method;
+
+// Selects how input events are sent. Must be called before any are sent.
+// Returns false if the platform doesn't support the method.
+bool set_input_method(input_method method);
+
+// Returns the time at which the last event sent by send_keystroke_* or
+// send_scroll_down was dispatched by the window system, which is a more precise
+// start for its latency than the time the send function returned. Returns 0 if
+// the input method doesn't report dispatch times.
+int64_t get_last_input_dispatch_time();
+
 // Returns the number of nanoseconds elapsed relative to some fixed point in the
 // past. The point to which this duration is relative does not change during the
 // lifetime of the process, but can change between different processes.
@@ -78,6 +160,15 @@ static const int64_t nanoseconds_per_millisecond = 1000000;
 static const int64_t nanoseconds_per_second =
     nanoseconds_per_millisecond * 1000;
 
+// Starts a new thread that calls thread_main with the given argument. Returns
+// an opaque handle to pass to join_thread, or NULL on failure.
+void *start_thread(void (*thread_main)(void *), void *argument);
+// Blocks until the given thread's thread_main returns, then frees the handle.
+void join_thread(void *thread);
+
+// Returns the number of logical processors available to this process.
+int get_processor_count();
+
 // Sends a message to the debug console (which printf doesn't do on Windows...).
 // Accepts printf format strings. Always writes a newline at the end of the
 // message.
@@ -91,16 +182,39 @@ int usleep(unsigned int microseconds);
 bool open_browser(const char *program, const char *args, const char *url);
 bool close_browser();
 
+// How the native reference window schedules its frames.
+typedef enum {
+  // Vsync off. Each frame is drawn as soon as input arrives.
+  NATIVE_REFERENCE_IMMEDIATE,
+  // Vsync on. Each frame is drawn just before the vblank that will show it,
+  // with all the input received up to that point.
+  NATIVE_REFERENCE_LATE_VSYNC,
+  // Vsync off. Frames are drawn continuously without sleeping.
+  NATIVE_REFERENCE_BUSY,
+  // Vsync on, double buffered. Frames are drawn continuously, throttled by
+  // the swap, so the driver may queue several frames.
+  NATIVE_REFERENCE_VSYNC,
+  // As NATIVE_REFERENCE_VSYNC, but glFinish is called after every swap so
+  // that no frames are queued.
+  NATIVE_REFERENCE_VSYNC_FINISH,
+  // Single buffered. Each frame is drawn straight to the front buffer as soon
+  // as input arrives, which may tear.
+  NATIVE_REFERENCE_FRONT_BUFFER,
+  NATIVE_REFERENCE_STRATEGY_COUNT
+} native_reference_strategy;
+
 // Opens a test window that will respond to mouse and keyboard events in the
 // same way as a browser displaying the test page. Running the benchmark with
 // this test window will establish the best possible score achievable on a given
 // system.
-// Returns true on success, false on failure.
-bool open_native_reference_window(uint8_t *test_pattern);
+// Returns true on success, false on failure, including when the platform
+// doesn't support the strategy.
+bool open_native_reference_window(uint8_t *test_pattern,
+    native_reference_strategy strategy);
 bool close_native_reference_window();
 
 // The number of pixels in the pattern that encodes the data from the test window.
-static const int pattern_pixels = 8;
+static const int pattern_pixels = 10;
 static const int pattern_bytes = pattern_pixels * 4;
 // The "magic" part of the pattern uniquely identifies the test window on the screen.
 static const int pattern_magic_pixels = 4;
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "screenshot-pool.h"
+#include <stdlib.h>
+
+typedef struct {
+  // The screenshot handed out to the caller. It must be the first member, so
+  // that a screenshot can be converted back to its slot.
+  screenshot shot;
+  uint8_t *buffer;  // NULL if the slot is empty.
+  uint32_t width, height;
+  // Reserved slots are only used for screenshots of their own size.
+  bool reserved;
+  // Set while the slot is claimed, either by a screenshot or while it's being
+  // resized or reserved.
+  volatile long in_use;
+} pool_slot;
+
+#define SCREENSHOT_POOL_SLOTS 8
+static pool_slot slots[SCREENSHOT_POOL_SLOTS];
+
+#ifndef NDEBUG
+static volatile long allocation_count = 0;
+#endif
+
+
+static void count_allocation() {
+#ifndef NDEBUG
+  __sync_fetch_and_add(&allocation_count, 1);
+#endif
+}
+
+
+static bool claim_slot(pool_slot *slot) {
+  return slot->in_use == 0 &&
+      __sync_val_compare_and_swap(&slot->in_use, 0, 1) == 0;
+}
+
+
+static void unclaim_slot(pool_slot *slot) {
+  // Finish with the slot before another thread can claim it.
+  __sync_synchronize();
+  slot->in_use = 0;
+}
+
+
+// Gives a claimed slot a buffer of the given size.
+static bool resize_slot(pool_slot *slot, uint32_t width, uint32_t height) {
+  if (slot->buffer && slot->width == width && slot->height == height) {
+    return true;
+  }
+  free(slot->buffer);
+  slot->buffer = (uint8_t *)malloc((size_t)width * height * 4);
+  count_allocation();
+  slot->width = slot->buffer ? width : 0;
+  slot->height = slot->buffer ? height : 0;
+  return slot->buffer != NULL;
+}
+
+
+static screenshot *prepare_screenshot(pool_slot *slot) {
+  screenshot *shot = &slot->shot;
+  shot->width = slot->width;
+  shot->height = slot->height;
+  shot->stride = slot->width * 4;
+  shot->pixels = slot->buffer;
+  return shot;
+}
+
+
+static bool in_pool(const pool_slot *slot) {
+  return slot >= slots && slot < slots + SCREENSHOT_POOL_SLOTS;
+}
+
+
+// Claims a free slot that can be resized: an empty one if possible, otherwise
+// any slot that isn't reserved. Returns NULL if there are none.
+static pool_slot *claim_spare_slot() {
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < SCREENSHOT_POOL_SLOTS; i++) {
+      pool_slot *slot = &slots[i];
+      if ((pass == 0 && slot->buffer) || slot->reserved ||
+          !claim_slot(slot)) {
+        continue;
+      }
+      // The slot may have changed before it was claimed.
+      if ((pass == 0 && slot->buffer) || slot->reserved) {
+        unclaim_slot(slot);
+        continue;
+      }
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+
+screenshot *screenshot_pool_acquire(uint32_t width, uint32_t height) {
+  for (int i = 0; i < SCREENSHOT_POOL_SLOTS; i++) {
+    pool_slot *slot = &slots[i];
+    if (!slot->buffer || slot->width != width || slot->height != height ||
+        !claim_slot(slot)) {
+      continue;
+    }
+    if (slot->buffer && slot->width == width && slot->height == height) {
+      return prepare_screenshot(slot);
+    }
+    unclaim_slot(slot);
+  }
+  pool_slot *slot = claim_spare_slot();
+  if (slot) {
+    if (resize_slot(slot, width, height)) {
+      return prepare_screenshot(slot);
+    }
+    unclaim_slot(slot);
+    return NULL;
+  }
+  // Every slot is busy, so this screenshot gets a slot of its own, which is
+  // freed when it's released.
+  slot = (pool_slot *)calloc(1, sizeof(pool_slot));
+  count_allocation();
+  if (!slot) {
+    return NULL;
+  }
+  slot->in_use = 1;
+  if (!resize_slot(slot, width, height)) {
+    free(slot);
+    return NULL;
+  }
+  return prepare_screenshot(slot);
+}
+
+
+void screenshot_pool_release(screenshot *shot) {
+  pool_slot *slot = (pool_slot *)shot;
+  if (in_pool(slot)) {
+    unclaim_slot(slot);
+  } else {
+    free(slot->buffer);
+    free(slot);
+  }
+}
+
+
+bool screenshot_pool_reserve(uint32_t width, uint32_t height, int count) {
+  int reserved = 0;
+  for (int i = 0; i < SCREENSHOT_POOL_SLOTS && reserved < count; i++) {
+    pool_slot *slot = &slots[i];
+    if (slot->reserved && slot->width == width && slot->height == height) {
+      reserved++;
+    }
+  }
+  while (reserved < count) {
+    pool_slot *slot = claim_spare_slot();
+    if (!slot) {
+      return false;
+    }
+    bool resized = resize_slot(slot, width, height);
+    slot->reserved = resized;
+    unclaim_slot(slot);
+    if (!resized) {
+      return false;
+    }
+    reserved++;
+  }
+  return true;
+}
+
+
+void screenshot_pool_unreserve(uint32_t width, uint32_t height) {
+  for (int i = 0; i < SCREENSHOT_POOL_SLOTS; i++) {
+    pool_slot *slot = &slots[i];
+    if (slot->reserved && slot->width == width && slot->height == height) {
+      // The buffer is kept, so the slot can be reused for any size.
+      slot->reserved = false;
+    }
+  }
+}
+
+
+#ifndef NDEBUG
+int64_t screenshot_pool_allocation_count() {
+  return allocation_count;
+}
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A pool of screenshots with pixel buffers, for platforms that copy the screen
+// into memory of their own. Buffers are keyed by size and reused once
+// released, so the test loop, which takes the same small screenshot thousands
+// of times, doesn't allocate once the pool holds a buffer of that size.
+// Acquiring and releasing are lock-free, so screenshots can be taken and freed
+// on any thread.
+
+#ifndef WLB_SCREENSHOT_POOL_H_
+#define WLB_SCREENSHOT_POOL_H_
+
+#include "screenscraper.h"
+
+// Returns a screenshot with width, height and stride filled in and pixels
+// pointing to a buffer of stride * height bytes, which the caller fills in
+// along with the rest of the fields. Allocates only if no free buffer of the
+// right size is pooled. Returns NULL if allocation fails.
+screenshot *screenshot_pool_acquire(uint32_t width, uint32_t height);
+
+// Returns a screenshot from screenshot_pool_acquire to the pool.
+void screenshot_pool_release(screenshot *shot);
+
+// Allocates count buffers of the given size, which are kept for screenshots of
+// that size until screenshot_pool_unreserve. Returns false if the pool doesn't
+// have enough free slots.
+bool screenshot_pool_reserve(uint32_t width, uint32_t height, int count);
+void screenshot_pool_unreserve(uint32_t width, uint32_t height);
+
+#ifndef NDEBUG
+// The number of buffers the pool has allocated.
+int64_t screenshot_pool_allocation_count();
+#endif
+
+#endif  // WLB_SCREENSHOT_POOL_H_
@@ -26,6 +26,7 @@
 #include "../third_party/mongoose/mongoose.h"
 #include "oculus.h"
 #include "clioptions.h"
+#include "trace.h"
 
 //MSVC doesn't hvae snprintf defined, for our use, this works- beware they are not identical
 #ifdef WIN32
@@ -35,24 +36,96 @@
 // Serve files from the ./html directory.
 char *document_root = "html";
 struct mg_context *mongoose = NULL;
+// How many samples each latency test takes, from the command line.
+static measurement_options sampling_options;
+
+// Returns where the refresh rate came from as a JSON value.
+static const char *refresh_rate_source_name(refresh_rate_source source) {
+  switch (source) {
+  case REFRESH_RATE_FROM_OUTPUT:
+    return "\"output\"";
+  case REFRESH_RATE_FROM_VBLANKS:
+    return "\"vblanks\"";
+  case REFRESH_RATE_FROM_FRAME_COUNTER:
+    return "\"frameCounter\"";
+  default:
+    return "null";
+  }
+}
+
+
+// Writes the percentiles of a distribution as a JSON object.
+static void print_percentiles(struct mg_connection *connection,
+    const percentiles *percentiles) {
+  mg_printf(connection, "{ \"p50\": %f, \"p90\": %f, \"p99\": %f, "
+            "\"p99.9\": %f}",
+            percentiles->p50_ms,
+            percentiles->p90_ms,
+            percentiles->p99_ms,
+            percentiles->p99_9_ms);
+}
+
+
+// Writes the non-empty buckets of a histogram as a JSON array of
+// [valueMs, count] pairs.
+static void print_histogram(struct mg_connection *connection,
+    const histogram *histogram) {
+  mg_printf(connection, "[");
+  bool first = true;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (histogram->counts[i] == 0) {
+      continue;
+    }
+    mg_printf(connection, "%s[%f, %u]", first ? "" : ", ",
+              histogram_bucket_value(i) / 1000000.0,
+              (unsigned int)histogram->counts[i]);
+    first = false;
+  }
+  mg_printf(connection, "]");
+}
+
+
+// Writes a confidence interval as a JSON object.
+static void print_confidence_interval(struct mg_connection *connection,
+    const confidence_interval *interval) {
+  mg_printf(connection, "{ \"lowMs\": %f, \"highMs\": %f, "
+            "\"halfWidthMs\": %f, \"measurements\": %d, "
+            "\"targetMet\": %s}",
+            interval->low_ms,
+            interval->high_ms,
+            interval->half_width_ms,
+            interval->measurements,
+            interval->target_met ? "true" : "false");
+}
+
+
+// Writes the frame pacing of the pause time test as a JSON object.
+static void print_frame_pacing(struct mg_connection *connection,
+    const frame_pacing *pacing) {
+  mg_printf(connection, "{ \"frames\": %d, \"droppedFrames\": %d, "
+            "\"longestDroppedRun\": %d, \"jankPercent\": %f, "
+            "\"frameTimeHistogramMs\": ",
+            pacing->frames,
+            pacing->dropped_frames,
+            pacing->longest_dropped_run,
+            pacing->jank_percent);
+  print_histogram(connection, &pacing->frame_times);
+  mg_printf(connection, "}");
+}
+
 
 // Runs a latency test and reports the results as JSON written to the given
 // connection.
 static void report_latency(struct mg_connection *connection,
-    const uint8_t magic_pattern[]) {
-  double key_down_latency_ms = 0;
-  double scroll_latency_ms = 0;
-  double max_js_pause_time_ms = 0;
-  double max_css_pause_time_ms = 0;
-  double max_scroll_pause_time_ms = 0;
+    const uint8_t magic_pattern[], const measurement_options *options) {
+  // The results include several histograms, which are too big for the stack.
+  latency_results *results =
+      (latency_results *)calloc(1, sizeof(latency_results));
   char *error = "Unknown error.";
-  if (!measure_latency(magic_pattern,
-                       &key_down_latency_ms,
-                       &scroll_latency_ms,
-                       &max_js_pause_time_ms,
-                       &max_css_pause_time_ms,
-                       &max_scroll_pause_time_ms,
-                       &error)) {
+  if (!results) {
+    error = "Failed to allocate results.";
+  }
+  if (!results || !measure_latency(magic_pattern, options, results, &error)) {
     // Report generic error.
     debug_log("measure_latency reported error: %s", error);
     mg_printf(connection, "HTTP/1.1 500 Internal Server Error\r\n"
@@ -69,13 +142,84 @@ static void report_latency(struct mg_connection *connection,
               "\"scrollLatencyMs\": %f, "
               "\"maxJSPauseTimeMs\": %f, "
               "\"maxCssPauseTimeMs\": %f, "
-              "\"maxScrollPauseTimeMs\": %f}",
-              key_down_latency_ms,
-              scroll_latency_ms,
-              max_js_pause_time_ms,
-              max_css_pause_time_ms,
-              max_scroll_pause_time_ms);
+              "\"maxScrollPauseTimeMs\": %f",
+              results->key_down_latency_ms,
+              results->scroll_latency_ms,
+              results->max_js_pause_time_ms,
+              results->max_css_pause_time_ms,
+              results->max_scroll_pause_time_ms);
+    mg_printf(connection, ", \"frameTimeMs\": %f, "
+              "\"keyDownLatencyFrames\": %f, "
+              "\"scrollLatencyFrames\": %f, "
+              "\"maxJSPauseTimeFrames\": %f, "
+              "\"maxCssPauseTimeFrames\": %f, "
+              "\"maxScrollPauseTimeFrames\": %f",
+              results->frame_time_ms,
+              results->key_down_latency_frames,
+              results->scroll_latency_frames,
+              results->max_js_pause_time_frames,
+              results->max_css_pause_time_frames,
+              results->max_scroll_pause_time_frames);
+    mg_printf(connection, ", \"jsFramePacing\": ");
+    print_frame_pacing(connection, &results->javascript_pacing);
+    mg_printf(connection, ", \"cssFramePacing\": ");
+    print_frame_pacing(connection, &results->css_pacing);
+    mg_printf(connection, ", \"scrollFramePacing\": ");
+    print_frame_pacing(connection, &results->scroll_pacing);
+    mg_printf(connection, ", \"keyDownLatencyPercentilesMs\": ");
+    print_percentiles(connection, &results->key_down_latency);
+    mg_printf(connection, ", \"scrollLatencyPercentilesMs\": ");
+    print_percentiles(connection, &results->scroll_latency);
+    // The intervals are on the mean unless a percentile was requested.
+    if (options->confidence_percentile > 0) {
+      mg_printf(connection, ", \"confidenceIntervalPercentile\": %f",
+                options->confidence_percentile);
+    } else {
+      mg_printf(connection, ", \"confidenceIntervalPercentile\": null");
+    }
+    mg_printf(connection, ", \"keyDownLatencyConfidenceInterval\": ");
+    print_confidence_interval(connection, &results->key_down_interval);
+    mg_printf(connection, ", \"scrollLatencyConfidenceInterval\": ");
+    print_confidence_interval(connection, &results->scroll_interval);
+    mg_printf(connection, ", \"keyDownLowerBoundHistogramMs\": ");
+    print_histogram(connection, &results->key_down_lower_bounds);
+    mg_printf(connection, ", \"keyDownUpperBoundHistogramMs\": ");
+    print_histogram(connection, &results->key_down_upper_bounds);
+    mg_printf(connection, ", \"scrollLowerBoundHistogramMs\": ");
+    print_histogram(connection, &results->scroll_lower_bounds);
+    mg_printf(connection, ", \"scrollUpperBoundHistogramMs\": ");
+    print_histogram(connection, &results->scroll_upper_bounds);
+    if (options->injection_rate_hz > 0) {
+      mg_printf(connection, ", \"injectionRateHz\": %f",
+                options->injection_rate_hz);
+    } else {
+      mg_printf(connection, ", \"injectionRateHz\": null");
+    }
+    mg_printf(connection, ", \"keyDownEventsPerSecond\": %f",
+              results->key_down_events_per_second);
+    mg_printf(connection, ", \"samplesPerSecond\": %f",
+              results->samples_per_second);
+    if (results->output_index >= 0) {
+      mg_printf(connection, ", \"outputIndex\": %d",
+                results->output_index);
+    } else {
+      mg_printf(connection, ", \"outputIndex\": null");
+    }
+    if (results->refresh_rate_hz > 0) {
+      mg_printf(connection, ", \"refreshRateHz\": %f",
+                results->refresh_rate_hz);
+    } else {
+      mg_printf(connection, ", \"refreshRateHz\": null");
+    }
+    mg_printf(connection, ", \"refreshRateSource\": %s",
+              refresh_rate_source_name(results->refresh_rate_source));
+    mg_printf(connection, ", \"relocks\": %d, \"excludedTimeMs\": %f",
+              results->relocks, results->excluded_time_ms);
+    mg_printf(connection, ", \"rejectedSamples\": %d",
+              results->rejected_samples);
+    mg_printf(connection, "}");
   }
+  free(results);
 }
 
 // If the given request is a latency test request that specifies a valid
@@ -104,6 +248,30 @@ static bool is_latency_test_request(const struct mg_request_info *request_info,
   return false;
 }
 
+// Fills in the options for a test request: the options given on the command
+// line, with the native reference strategy overridden if the request's URL
+// specifies one in the referenceStrategy query variable. Returns false if the
+// strategy isn't recognized.
+static bool get_request_options(const struct mg_request_info *request_info,
+    measurement_options *out_options) {
+  *out_options = sampling_options;
+  const char *query = request_info->query_string;
+  if (!query) {
+    return true;
+  }
+  char value[64];
+  if (mg_get_var(query, strlen(query), "injectionRateHz", value,
+                 sizeof(value)) >= 0) {
+    out_options->injection_rate_hz = atof(value);
+  }
+  if (mg_get_var(query, strlen(query), "referenceStrategy", value,
+                 sizeof(value)) < 0) {
+    return true;
+  }
+  return parse_native_reference_strategy(value,
+      &out_options->native_reference_strategy);
+}
+
 // This function is defined in the file generated by files-to-c-arrays.py
 const char *get_file(const char *path, size_t *out_size);
 
@@ -160,11 +328,22 @@ volatile long keep_alives = 0;
 static int mongoose_begin_request_callback(struct mg_connection *connection) {
   const struct mg_request_info *request_info = mg_get_request_info(connection);
   uint8_t magic_pattern[pattern_magic_bytes];
-  if (is_latency_test_request(request_info, magic_pattern)) {
+  bool is_test = is_latency_test_request(request_info, magic_pattern);
+  bool is_control_test = strcmp(request_info->uri, "/runControlTest") == 0;
+  measurement_options options;
+  if ((is_test || is_control_test) &&
+      !get_request_options(request_info, &options)) {
+    mg_printf(connection, "HTTP/1.1 500 Internal Server Error\r\n"
+              "Access-Control-Allow-Origin: *\r\n"
+              "Content-Type: text/plain\r\n\r\n"
+              "Unknown native reference strategy.");
+    return 1;
+  }
+  if (is_test) {
     // This is an XMLHTTPRequest made by JavaScript to measure latency in a
     // browser window. magic_pattern has been filled in with a pixel pattern to
     // look for.
-    report_latency(connection, magic_pattern);
+    report_latency(connection, magic_pattern, &options);
     return 1;  // Mark as processed
   } else if (strcmp(request_info->uri, "/keepServerAlive") == 0) {
     __sync_fetch_and_add(&keep_alives, 1);
@@ -188,14 +367,15 @@ static int mongoose_begin_request_callback(struct mg_connection *connection) {
     }
     __sync_fetch_and_add(&keep_alives, -1);
     return 1;
-  } else if(strcmp(request_info->uri, "/runControlTest") == 0) {
+  } else if (is_control_test) {
     uint8_t *test_pattern = (uint8_t *)malloc(pattern_bytes);
     memset(test_pattern, 0, pattern_bytes);
     for (int i = 0; i < pattern_magic_bytes; i++) {
       test_pattern[i] = rand();
     }
-    open_native_reference_window(test_pattern);
-    report_latency(connection, test_pattern);
+    open_native_reference_window(test_pattern,
+        options.native_reference_strategy);
+    report_latency(connection, test_pattern, &options);
     close_native_reference_window();
     return 1;
   } else if (strcmp(request_info->uri, "/oculusLatencyTester") == 0) {
@@ -236,6 +416,24 @@ void run_server(clioptions *opts) {
   assert(mongoose == NULL);
   srand((unsigned int)time(NULL));
   init_oculus();
+  if (opts->trace_file) {
+    start_tracing();
+  }
+  if (!set_input_method(opts->input_method)) {
+    debug_log("Input method %s is not available.",
+              input_method_name(opts->input_method));
+    exit(1);
+  }
+  memset(&sampling_options, 0, sizeof(sampling_options));
+  sampling_options.target_confidence_interval_ms = opts->confidence_interval_ms;
+  sampling_options.confidence_percentile = opts->confidence_percentile;
+  sampling_options.min_measurements = opts->min_measurements;
+  sampling_options.max_measurements = opts->max_measurements;
+  sampling_options.snap_to_vblank = opts->snap_to_vblank;
+  sampling_options.wait_for_screen_changes = opts->wait_for_damage;
+  sampling_options.keystrokes_in_flight = opts->keystrokes_in_flight;
+  sampling_options.injection_rate_hz = opts->injection_rate_hz;
+  sampling_options.native_reference_strategy = opts->reference_strategy;
   const char *options[] = {
     "listening_ports", "5578",
     "document_root", document_root,
@@ -297,6 +495,10 @@ void run_server(clioptions *opts) {
   }
   mg_stop(mongoose);
 
+  if (opts->trace_file && !write_trace(opts->trace_file)) {
+    fprintf(stderr, "Failed to write trace to %s\n", opts->trace_file);
+  }
+
   if (opts->automated) {
     // NOTE: this only will work in automated mode where we fork and get the pid of the child process
     close_browser();
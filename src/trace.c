@@ -0,0 +1,183 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "screenscraper.h"
+#include "trace.h"
+
+typedef struct {
+  char phase;  // 'i' (instant), 'X' (complete) or 'C' (counter).
+  trace_track track;
+  const char *name;
+  int64_t time;
+  int64_t duration;
+  int arg_count;
+  trace_arg args[TRACE_MAX_ARGS];
+} trace_event;
+
+static volatile long tracing = 0;
+// Tests can run on several server threads at once, so the event log is
+// protected by a spin lock. Recording an event only takes a few instructions.
+static volatile long trace_lock = 0;
+static trace_event *events = NULL;
+static size_t event_count = 0;
+static size_t event_capacity = 0;
+
+
+void start_tracing() {
+  tracing = 1;
+}
+
+
+bool tracing_enabled() {
+  return tracing != 0;
+}
+
+
+static void lock_trace() {
+  while (__sync_val_compare_and_swap(&trace_lock, 0, 1) != 0) {
+    usleep(0);
+  }
+}
+
+
+static void unlock_trace() {
+  __sync_synchronize();
+  trace_lock = 0;
+}
+
+
+static void record_event(char phase, trace_track track, const char *name,
+    int64_t time, int64_t duration, int arg_count, const trace_arg args[]) {
+  if (!tracing) {
+    return;
+  }
+  assert(arg_count >= 0 && arg_count <= TRACE_MAX_ARGS);
+  lock_trace();
+  if (event_count == event_capacity) {
+    size_t capacity = event_capacity ? event_capacity * 2 : 4096;
+    trace_event *grown =
+        (trace_event *)realloc(events, capacity * sizeof(trace_event));
+    if (!grown) {
+      unlock_trace();
+      debug_log("Out of memory for trace events; dropping event.");
+      return;
+    }
+    events = grown;
+    event_capacity = capacity;
+  }
+  trace_event *event = &events[event_count++];
+  event->phase = phase;
+  event->track = track;
+  event->name = name;
+  event->time = time;
+  event->duration = duration;
+  event->arg_count = arg_count;
+  for (int i = 0; i < arg_count; i++) {
+    event->args[i] = args[i];
+  }
+  unlock_trace();
+}
+
+
+void trace_instant(trace_track track, const char *name, int64_t time,
+    int arg_count, const trace_arg args[]) {
+  record_event('i', track, name, time, 0, arg_count, args);
+}
+
+
+void trace_span(trace_track track, const char *name, int64_t start_time,
+    int64_t end_time, int arg_count, const trace_arg args[]) {
+  record_event('X', track, name, start_time, end_time - start_time, arg_count,
+      args);
+}
+
+
+void trace_counter(const char *name, int64_t time, double value) {
+  trace_arg arg = { "value", value };
+  record_event('C', TRACE_TRACK_INPUT, name, time, 0, 1, &arg);
+}
+
+
+static const char *track_name(trace_track track) {
+  switch (track) {
+  case TRACE_TRACK_INPUT:
+    return "Input events";
+  case TRACE_TRACK_SCREENSHOTS:
+    return "Screenshots";
+  case TRACE_TRACK_JAVASCRIPT_FRAMES:
+    return "JavaScript frames";
+  case TRACE_TRACK_KEY_DOWN_EVENTS:
+    return "Key down events";
+  case TRACE_TRACK_CSS_FRAMES:
+    return "CSS frames";
+  case TRACE_TRACK_SCROLL:
+    return "Scroll";
+  default:
+    return "Unknown";
+  }
+}
+
+
+bool write_trace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    debug_log("Failed to open trace file %s", path);
+    return false;
+  }
+  lock_trace();
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(file, "{\"ph\": \"M\", \"pid\": 1, \"name\": \"process_name\", "
+          "\"args\": {\"name\": \"latency-benchmark\"}}");
+  for (int track = TRACE_TRACK_INPUT; track <= TRACE_TRACK_SCROLL; track++) {
+    fprintf(file, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+            track, track_name((trace_track)track));
+    fprintf(file, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"name\": \"thread_sort_index\", \"args\": {\"sort_index\": %d}}",
+            track, track);
+  }
+  for (size_t i = 0; i < event_count; i++) {
+    const trace_event *event = &events[i];
+    // Trace event timestamps are in microseconds.
+    fprintf(file, ",\n{\"ph\": \"%c\", \"pid\": 1, \"tid\": %d, "
+            "\"name\": \"%s\", \"ts\": %.3f",
+            event->phase, event->track, event->name, event->time / 1000.0);
+    if (event->phase == 'X') {
+      fprintf(file, ", \"dur\": %.3f", event->duration / 1000.0);
+    } else if (event->phase == 'i') {
+      fprintf(file, ", \"s\": \"t\"");
+    }
+    fprintf(file, ", \"args\": {");
+    for (int j = 0; j < event->arg_count; j++) {
+      fprintf(file, "%s\"%s\": %f", j ? ", " : "", event->args[j].name,
+              event->args[j].value);
+    }
+    fprintf(file, "}}");
+  }
+  fprintf(file, "\n]}\n");
+  size_t written = event_count;
+  unlock_trace();
+  bool success = !ferror(file);
+  if (fclose(file) != 0) {
+    success = false;
+  }
+  debug_log("Wrote %d trace events to %s", (int)written, path);
+  return success;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// An optional recorder for the individual samples taken during latency tests.
+// Events are kept in memory while the server runs and written out as a Chrome
+// trace-event JSON file, which can be opened in Perfetto (ui.perfetto.dev) or
+// chrome://tracing to see every input event, screenshot and counter change on
+// one timeline.
+
+#ifndef WLB_TRACE_H_
+#define WLB_TRACE_H_
+
+#include <stdint.h>
+#if __STDC_VERSION__ >= 199901L  // C99
+#include <stdbool.h>
+#endif
+
+// Each kind of event is drawn on its own track (a "thread" in the trace).
+typedef enum {
+  TRACE_TRACK_INPUT = 1,
+  TRACE_TRACK_SCREENSHOTS,
+  TRACE_TRACK_JAVASCRIPT_FRAMES,
+  TRACE_TRACK_KEY_DOWN_EVENTS,
+  TRACE_TRACK_CSS_FRAMES,
+  TRACE_TRACK_SCROLL,
+} trace_track;
+
+#define TRACE_MAX_ARGS 5
+
+// A numeric argument attached to an event, shown when the event is selected.
+// The name must be a string literal, since it's not copied.
+typedef struct {
+  const char *name;
+  double value;
+} trace_arg;
+
+// Starts recording events. Until this is called, all the other trace functions
+// do nothing, so tracing costs nothing when it isn't enabled.
+void start_tracing();
+
+// Returns true if start_tracing has been called.
+bool tracing_enabled();
+
+// Records an instant event, e.g. an input event being sent. Times are in
+// nanoseconds from get_nanoseconds. The name must be a string literal.
+void trace_instant(trace_track track, const char *name, int64_t time,
+    int arg_count, const trace_arg args[]);
+
+// Records an event with a duration, e.g. the interval during which a counter
+// in the test pattern is known to have changed.
+void trace_span(trace_track track, const char *name, int64_t start_time,
+    int64_t end_time, int arg_count, const trace_arg args[]);
+
+// Records the value of a counter, drawn as a graph in its own track.
+void trace_counter(const char *name, int64_t time, double value);
+
+// Writes all events recorded so far to the given file as trace-event JSON.
+// Returns false if the file couldn't be written.
+bool write_trace(const char *path);
+
+#endif  // WLB_TRACE_H_
@@ -0,0 +1,274 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../screenscraper.h"
+#include "portal.h"
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *portal_bus_name = "org.freedesktop.portal.Desktop";
+static const char *portal_object_path = "/org/freedesktop/portal/desktop";
+static const char *remote_desktop_interface =
+    "org.freedesktop.portal.RemoteDesktop";
+static const char *screen_cast_interface = "org.freedesktop.portal.ScreenCast";
+
+// Device and source types from the portal specification.
+static const uint32_t device_type_keyboard = 1;
+static const uint32_t device_type_pointer = 2;
+static const uint32_t source_type_monitor = 1;
+static const uint32_t cursor_mode_hidden = 1;
+
+// The user may have to respond to a dialog, so wait a long time.
+static const int portal_timeout_ms = 5 * 60 * 1000;
+
+typedef struct {
+  bool done;
+  uint32_t response;
+  GVariant *results;
+} portal_response;
+
+
+static void on_response(GDBusConnection *connection, const gchar *sender,
+    const gchar *object_path, const gchar *interface_name,
+    const gchar *signal_name, GVariant *parameters, gpointer user_data) {
+  portal_response *response = (portal_response *)user_data;
+  g_variant_get(parameters, "(u@a{sv})", &response->response,
+                &response->results);
+  response->done = true;
+}
+
+
+// Calls a portal method that answers through a Request object, and waits for
+// the Response signal. The method's options must include handle_token set to
+// token. Returns the results on success, or NULL.
+static GVariant *call_request(GDBusConnection *connection,
+    const char *interface, const char *method, GVariant *parameters,
+    const char *token) {
+  // The request's path is derived from our unique name and the token, so the
+  // signal can be subscribed to before the call, without a race.
+  char *sender = g_strdup(g_dbus_connection_get_unique_name(connection) + 1);
+  for (char *c = sender; *c; c++) {
+    if (*c == '.') {
+      *c = '_';
+    }
+  }
+  char request_path[512];
+  snprintf(request_path, sizeof(request_path),
+           "/org/freedesktop/portal/desktop/request/%s/%s", sender, token);
+  g_free(sender);
+
+  portal_response response = { false, 0, NULL };
+  guint subscription = g_dbus_connection_signal_subscribe(connection,
+      portal_bus_name, "org.freedesktop.portal.Request", "Response",
+      request_path, NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_response, &response,
+      NULL);
+
+  GError *error = NULL;
+  GVariant *reply = g_dbus_connection_call_sync(connection, portal_bus_name,
+      portal_object_path, interface, method, parameters, NULL,
+      G_DBUS_CALL_FLAGS_NONE, portal_timeout_ms, NULL, &error);
+  if (!reply) {
+    debug_log("%s.%s failed: %s", interface, method, error->message);
+    g_error_free(error);
+  } else {
+    g_variant_unref(reply);
+    while (!response.done) {
+      g_main_context_iteration(g_main_context_get_thread_default(), TRUE);
+    }
+  }
+  g_dbus_connection_signal_unsubscribe(connection, subscription);
+  if (response.done && response.response != 0) {
+    debug_log("%s.%s was denied (response %u)", interface, method,
+              response.response);
+    g_variant_unref(response.results);
+    return NULL;
+  }
+  return response.results;
+}
+
+
+// Calls a portal method that returns a file descriptor.
+static int call_for_fd(GDBusConnection *connection, const char *interface,
+    const char *method, const char *session_handle) {
+  GVariantBuilder options;
+  g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+  GUnixFDList *fd_list = NULL;
+  GError *error = NULL;
+  GVariant *reply = g_dbus_connection_call_with_unix_fd_list_sync(connection,
+      portal_bus_name, portal_object_path, interface, method,
+      g_variant_new("(oa{sv})", session_handle, &options),
+      G_VARIANT_TYPE("(h)"), G_DBUS_CALL_FLAGS_NONE, portal_timeout_ms, NULL,
+      &fd_list, NULL, &error);
+  if (!reply) {
+    debug_log("%s.%s failed: %s", interface, method, error->message);
+    g_error_free(error);
+    return -1;
+  }
+  gint32 index;
+  g_variant_get(reply, "(h)", &index);
+  int fd = g_unix_fd_list_get(fd_list, index, NULL);
+  g_variant_unref(reply);
+  g_object_unref(fd_list);
+  return fd;
+}
+
+
+static GVariant *options_with_token(const char *token) {
+  GVariantBuilder options;
+  g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&options, "{sv}", "handle_token",
+                        g_variant_new_string(token));
+  return g_variant_builder_end(&options);
+}
+
+
+// Reads the first stream out of the results of Start.
+static bool read_stream(GVariant *results, portal_session *session) {
+  GVariant *streams = g_variant_lookup_value(results, "streams",
+                                             G_VARIANT_TYPE("a(ua{sv})"));
+  if (!streams) {
+    return false;
+  }
+  GVariantIter iter;
+  g_variant_iter_init(&iter, streams);
+  GVariant *properties = NULL;
+  bool found = g_variant_iter_next(&iter, "(u@a{sv})", &session->node_id,
+                                   &properties);
+  if (found) {
+    g_variant_lookup(properties, "position", "(ii)", &session->logical_x,
+                     &session->logical_y);
+    g_variant_lookup(properties, "size", "(ii)", &session->logical_width,
+                     &session->logical_height);
+    g_variant_unref(properties);
+  }
+  g_variant_unref(streams);
+  return found;
+}
+
+
+// Configures and starts a session that has been created.
+static bool start_session(GDBusConnection *connection,
+    const char *session_handle, portal_session *session, char **error) {
+  GVariantBuilder options;
+  g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&options, "{sv}", "handle_token",
+                        g_variant_new_string("wlb_devices"));
+  g_variant_builder_add(&options, "{sv}", "types",
+      g_variant_new_uint32(device_type_keyboard | device_type_pointer));
+  GVariant *results = call_request(connection, remote_desktop_interface,
+      "SelectDevices", g_variant_new("(oa{sv})", session_handle, &options),
+      "wlb_devices");
+  if (!results) {
+    *error = "Failed to select input devices.";
+    return false;
+  }
+  g_variant_unref(results);
+
+  g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&options, "{sv}", "handle_token",
+                        g_variant_new_string("wlb_sources"));
+  g_variant_builder_add(&options, "{sv}", "types",
+                        g_variant_new_uint32(source_type_monitor));
+  g_variant_builder_add(&options, "{sv}", "multiple",
+                        g_variant_new_boolean(FALSE));
+  // The cursor would hide the test pattern if it was over it.
+  g_variant_builder_add(&options, "{sv}", "cursor_mode",
+                        g_variant_new_uint32(cursor_mode_hidden));
+  results = call_request(connection, screen_cast_interface, "SelectSources",
+      g_variant_new("(oa{sv})", session_handle, &options), "wlb_sources");
+  if (!results) {
+    *error = "Failed to select a monitor to capture.";
+    return false;
+  }
+  g_variant_unref(results);
+
+  results = call_request(connection, remote_desktop_interface, "Start",
+      g_variant_new("(os@a{sv})", session_handle, "",
+                    options_with_token("wlb_start")),
+      "wlb_start");
+  bool started = results && read_stream(results, session);
+  if (results) {
+    g_variant_unref(results);
+  }
+  if (!started) {
+    *error = "Failed to start the remote desktop session.";
+    return false;
+  }
+
+  session->pipewire_fd = call_for_fd(connection, screen_cast_interface,
+                                     "OpenPipeWireRemote", session_handle);
+  if (session->pipewire_fd < 0) {
+    *error = "Failed to connect to PipeWire.";
+    return false;
+  }
+  session->eis_fd = call_for_fd(connection, remote_desktop_interface,
+                                "ConnectToEIS", session_handle);
+  return true;
+}
+
+
+static bool open_session(GDBusConnection *connection,
+    portal_session *session, char **error) {
+  GVariantBuilder options;
+  g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&options, "{sv}", "handle_token",
+                        g_variant_new_string("wlb_create"));
+  g_variant_builder_add(&options, "{sv}", "session_handle_token",
+                        g_variant_new_string("wlb_session"));
+  GVariant *results = call_request(connection, remote_desktop_interface,
+      "CreateSession", g_variant_new("(a{sv})", &options), "wlb_create");
+  char *session_handle = NULL;
+  bool created = results &&
+      g_variant_lookup(results, "session_handle", "s", &session_handle);
+  if (results) {
+    g_variant_unref(results);
+  }
+  if (!created) {
+    *error = "Failed to create a remote desktop session.";
+    return false;
+  }
+  bool success = start_session(connection, session_handle, session, error);
+  g_free(session_handle);
+  return success;
+}
+
+
+bool portal_open_session(portal_session *out_session, char **error) {
+  memset(out_session, 0, sizeof(*out_session));
+  out_session->pipewire_fd = -1;
+  out_session->eis_fd = -1;
+  GError *dbus_error = NULL;
+  GDBusConnection *connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL,
+                                               &dbus_error);
+  if (!connection) {
+    debug_log("Couldn't connect to the session bus: %s", dbus_error->message);
+    g_error_free(dbus_error);
+    *error = "Couldn't connect to the session bus.";
+    return false;
+  }
+  // Signals are dispatched to the thread-default context at the time they are
+  // subscribed, so give this thread its own context to iterate.
+  GMainContext *context = g_main_context_new();
+  g_main_context_push_thread_default(context);
+  bool success = open_session(connection, out_session, error);
+  g_main_context_pop_thread_default(context);
+  g_main_context_unref(context);
+  // The session ends when the connection that created it closes, so the
+  // connection is deliberately kept open for the life of the process.
+  return success;
+}
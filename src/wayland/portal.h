@@ -0,0 +1,49 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Wayland compositors don't let clients read the screen or inject input
+// directly. Instead, a RemoteDesktop session from xdg-desktop-portal hands out
+// a PipeWire stream of a monitor and a libei connection for input, after the
+// user (or the portal's configuration) approves it.
+
+#ifndef WLB_WAYLAND_PORTAL_H_
+#define WLB_WAYLAND_PORTAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  // A connection to the PipeWire daemon that can see the stream.
+  int pipewire_fd;
+  // The PipeWire node of the monitor's screencast stream.
+  uint32_t node_id;
+  // The monitor's position and size in the compositor's logical coordinates,
+  // which are what absolute pointer motion is given in. The size is 0 if the
+  // portal didn't report it.
+  int32_t logical_x, logical_y;
+  int32_t logical_width, logical_height;
+  // A connection to the compositor's EIS server for libei, or -1 if the portal
+  // doesn't support it (RemoteDesktop before version 2).
+  int eis_fd;
+} portal_session;
+
+// Starts a RemoteDesktop session with a keyboard and pointer and a screencast
+// of one monitor, without the cursor. Blocks until the session starts, which
+// may involve the user approving it in a dialog. On failure, returns false and
+// sets error to a message.
+bool portal_open_session(portal_session *out_session, char **error);
+
+#endif  // WLB_WAYLAND_PORTAL_H_
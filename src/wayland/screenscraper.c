@@ -0,0 +1,772 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The Wayland implementation of screenscraper.h. The screen is captured from
+// a PipeWire screencast stream of one monitor, and input is injected through
+// libei. Both normally come from an xdg-desktop-portal RemoteDesktop session,
+// but can be connected directly for testing against a headless compositor:
+// if WLB_PIPEWIRE_TARGET names a PipeWire node, it is captured instead of the
+// portal's stream, and if LIBEI_SOCKET is set, libei connects to that EIS
+// socket instead of the portal's.
+
+#include "../screenscraper.h"
+#include "../screenshot-pool.h"
+#include "../x11/clock.h"
+#include "../x11/uinput.h"
+#include "portal.h"
+#include <pipewire/pipewire.h>
+#include <spa/buffer/meta.h>
+#include <spa/param/video/format-utils.h>
+#include <libei.h>
+#include <linux/dma-buf.h>
+#include <linux/input.h>  // KEY_Z
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wordexp.h>
+
+static pthread_once_t session_once = PTHREAD_ONCE_INIT;
+static bool session_started = false;
+static portal_session portal;
+static input_method current_input_method = INPUT_METHOD_DEFAULT;
+
+// Capture state. Everything below is protected by the thread loop's lock.
+static struct pw_thread_loop *loop = NULL;
+static struct pw_stream *stream = NULL;
+static struct spa_hook stream_listener;
+static struct spa_video_info_raw stream_format;
+// The newest frame is held until the next one arrives, so screenshots can be
+// read from it directly instead of copying every frame.
+static struct pw_buffer *held_buffer = NULL;
+// The time the held frame was presented, and the number of frames received.
+static int64_t held_frame_time = 0;
+static int64_t frame_count = 0;
+// The rectangle that wait_for_screen_change is watching, and the number and
+// time of the frames that changed it.
+static bool watching = false;
+static uint32_t watch_x, watch_y, watch_width, watch_height;
+static int64_t change_count = 0;
+static int64_t change_time = 0;
+
+// How long take_screenshot waits for the stream to produce its first frame.
+static const int64_t first_frame_timeout = 5ll * 1000 * 1000 * 1000;
+
+// Input state, only used from the thread that sends input.
+static struct ei *ei = NULL;
+static struct ei_device *keyboard_device = NULL;
+static struct ei_device *pointer_device = NULL;
+static struct ei_device *scroll_device = NULL;
+static uint32_t emulation_sequence = 0;
+static int64_t last_dispatch_time = 0;
+
+// How long to wait for the EIS server to offer devices.
+static const int64_t device_timeout = 2ll * 1000 * 1000 * 1000;
+
+
+#define min(X, Y) ((X) < (Y) ? (X) : (Y))
+#define max(X, Y) ((X) > (Y) ? (X) : (Y))
+
+
+static int clamp(int value, int minimum, int maximum) {
+  return max(min(value, maximum), minimum);
+}
+
+
+static bool rectangle_damaged(const struct spa_region *region) {
+  return region->position.x < (int64_t)watch_x + watch_width &&
+      region->position.x + (int64_t)region->size.width > watch_x &&
+      region->position.y < (int64_t)watch_y + watch_height &&
+      region->position.y + (int64_t)region->size.height > watch_y;
+}
+
+
+// Returns true if the frame may have changed the watched rectangle. Frames
+// without damage information are assumed to have changed everything.
+static bool frame_changes_watched_rectangle(struct spa_buffer *buffer) {
+  if (!watching) {
+    return false;
+  }
+  struct spa_meta *damage = spa_buffer_find_meta(buffer, SPA_META_VideoDamage);
+  if (!damage) {
+    return true;
+  }
+  bool any_damage = false;
+  struct spa_meta_region *region;
+  spa_meta_for_each(region, damage) {
+    if (!spa_meta_region_is_valid(region)) {
+      break;
+    }
+    any_damage = true;
+    if (rectangle_damaged(&region->region)) {
+      return true;
+    }
+  }
+  return !any_damage;
+}
+
+
+static void on_process(void *user_data) {
+  // Skip to the newest frame if several are queued.
+  struct pw_buffer *newest = NULL;
+  struct pw_buffer *next;
+  while ((next = pw_stream_dequeue_buffer(stream))) {
+    if (newest) {
+      pw_stream_queue_buffer(stream, newest);
+    }
+    newest = next;
+  }
+  if (!newest) {
+    return;
+  }
+  struct spa_buffer *buffer = newest->buffer;
+  struct spa_data *data = &buffer->datas[0];
+  struct spa_meta_header *header = (struct spa_meta_header *)
+      spa_buffer_find_meta_data(buffer, SPA_META_Header, sizeof(*header));
+  if (!data->data || !data->chunk->size ||
+      (data->chunk->flags & SPA_CHUNK_FLAG_CORRUPTED) ||
+      (header && (header->flags & SPA_META_HEADER_FLAG_CORRUPTED))) {
+    pw_stream_queue_buffer(stream, newest);
+    return;
+  }
+  // The presentation timestamp is CLOCK_MONOTONIC, from the compositor's
+  // frame clock. Frames without one are timed by their arrival.
+  int64_t now = get_nanoseconds();
+  int64_t frame_time = now;
+  if (header && header->pts > 0) {
+    frame_time = clock_nanoseconds_from_monotonic(header->pts);
+    if (frame_time > now) {
+      frame_time = now;
+    }
+  }
+  if (frame_changes_watched_rectangle(buffer)) {
+    change_count++;
+    change_time = frame_time;
+  }
+  if (held_buffer) {
+    pw_stream_queue_buffer(stream, held_buffer);
+  }
+  held_buffer = newest;
+  held_frame_time = frame_time;
+  frame_count++;
+  pw_thread_loop_signal(loop, false);
+}
+
+
+static void on_param_changed(void *user_data, uint32_t id,
+    const struct spa_pod *param) {
+  if (!param || id != SPA_PARAM_Format) {
+    return;
+  }
+  uint32_t media_type, media_subtype;
+  if (spa_format_parse(param, &media_type, &media_subtype) < 0 ||
+      media_type != SPA_MEDIA_TYPE_video ||
+      media_subtype != SPA_MEDIA_SUBTYPE_raw) {
+    return;
+  }
+  spa_format_video_raw_parse(param, &stream_format);
+  debug_log("Capturing %ux%u", stream_format.size.width,
+            stream_format.size.height);
+  // Ask for shared memory or linear DMA-BUFs, which can both be mapped, and
+  // for the metadata with each frame's timestamp and damage.
+  uint8_t pod_buffer[1024];
+  struct spa_pod_builder builder =
+      SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+  const struct spa_pod *params[3];
+  params[0] = (const struct spa_pod *)spa_pod_builder_add_object(&builder,
+      SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+      SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(
+          (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd) |
+          (1 << SPA_DATA_DmaBuf)));
+  params[1] = (const struct spa_pod *)spa_pod_builder_add_object(&builder,
+      SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+      SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+      SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+  params[2] = (const struct spa_pod *)spa_pod_builder_add_object(&builder,
+      SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+      SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+      SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+          sizeof(struct spa_meta_region) * 16,
+          sizeof(struct spa_meta_region) * 1,
+          sizeof(struct spa_meta_region) * 16));
+  pw_stream_update_params(stream, params, 3);
+}
+
+
+static void on_state_changed(void *user_data, enum pw_stream_state old,
+    enum pw_stream_state state, const char *error) {
+  if (state == PW_STREAM_STATE_ERROR) {
+    debug_log("PipeWire stream error: %s", error ? error : "unknown");
+  }
+}
+
+
+static const struct pw_stream_events stream_events = {
+  PW_VERSION_STREAM_EVENTS,
+  .state_changed = on_state_changed,
+  .param_changed = on_param_changed,
+  .process = on_process,
+};
+
+
+// Connects to the portal's screencast stream, or to the given node on the
+// default PipeWire daemon if target isn't NULL.
+static bool start_capture(const char *target) {
+  pw_init(NULL, NULL);
+  loop = pw_thread_loop_new("wlb-capture", NULL);
+  struct pw_context *context =
+      pw_context_new(pw_thread_loop_get_loop(loop), NULL, 0);
+  if (!loop || !context || pw_thread_loop_start(loop) < 0) {
+    debug_log("Failed to start the PipeWire loop");
+    return false;
+  }
+  pw_thread_loop_lock(loop);
+  struct pw_core *core = target ?
+      pw_context_connect(context, NULL, 0) :
+      pw_context_connect_fd(context, portal.pipewire_fd, NULL, 0);
+  if (!core) {
+    pw_thread_loop_unlock(loop);
+    debug_log("Failed to connect to PipeWire");
+    return false;
+  }
+  struct pw_properties *properties = pw_properties_new(
+      PW_KEY_MEDIA_TYPE, "Video",
+      PW_KEY_MEDIA_CATEGORY, "Capture",
+      PW_KEY_MEDIA_ROLE, "Screen",
+      NULL);
+  if (target) {
+    pw_properties_set(properties, PW_KEY_TARGET_OBJECT, target);
+  }
+  stream = pw_stream_new(core, "Web Latency Benchmark", properties);
+  pw_stream_add_listener(stream, &stream_listener, &stream_events, NULL);
+  uint8_t pod_buffer[1024];
+  struct spa_pod_builder builder =
+      SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+  // Only formats that match the screenshot's BGRA layout are accepted.
+  const struct spa_pod *format = (const struct spa_pod *)
+      spa_pod_builder_add_object(&builder,
+          SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+          SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+          SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+          SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(3,
+              SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRx,
+              SPA_VIDEO_FORMAT_BGRA),
+          SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
+              &SPA_RECTANGLE(1920, 1080), &SPA_RECTANGLE(1, 1),
+              &SPA_RECTANGLE(16384, 16384)),
+          SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
+              &SPA_FRACTION(0, 1), &SPA_FRACTION(0, 1),
+              &SPA_FRACTION(1000, 1)));
+  int result = pw_stream_connect(stream, PW_DIRECTION_INPUT,
+      target ? PW_ID_ANY : portal.node_id,
+      (enum pw_stream_flags)(PW_STREAM_FLAG_AUTOCONNECT |
+                             PW_STREAM_FLAG_MAP_BUFFERS),
+      &format, 1);
+  pw_thread_loop_unlock(loop);
+  if (result < 0) {
+    debug_log("Failed to connect the PipeWire stream: %s", strerror(-result));
+    return false;
+  }
+  return true;
+}
+
+
+static void forget_device(struct ei_device *device) {
+  if (device == keyboard_device) {
+    keyboard_device = NULL;
+    ei_device_unref(device);
+  }
+  if (device == pointer_device) {
+    pointer_device = NULL;
+    ei_device_unref(device);
+  }
+  if (device == scroll_device) {
+    scroll_device = NULL;
+    ei_device_unref(device);
+  }
+}
+
+
+// Handles the EIS server's events: binds to the seat, and starts emulating on
+// each device as it becomes available.
+static void process_ei_events() {
+  ei_dispatch(ei);
+  struct ei_event *event;
+  while ((event = ei_get_event(ei))) {
+    struct ei_device *device = ei_event_get_device(event);
+    switch (ei_event_get_type(event)) {
+    case EI_EVENT_SEAT_ADDED:
+      ei_seat_bind_capabilities(ei_event_get_seat(event),
+          EI_DEVICE_CAP_KEYBOARD, EI_DEVICE_CAP_POINTER_ABSOLUTE,
+          EI_DEVICE_CAP_SCROLL, NULL);
+      break;
+    case EI_EVENT_DEVICE_RESUMED:
+      if (!keyboard_device &&
+          ei_device_has_capability(device, EI_DEVICE_CAP_KEYBOARD)) {
+        keyboard_device = ei_device_ref(device);
+      }
+      if (!pointer_device &&
+          ei_device_has_capability(device, EI_DEVICE_CAP_POINTER_ABSOLUTE)) {
+        pointer_device = ei_device_ref(device);
+      }
+      if (!scroll_device &&
+          ei_device_has_capability(device, EI_DEVICE_CAP_SCROLL)) {
+        scroll_device = ei_device_ref(device);
+      }
+      ei_device_start_emulating(device, ++emulation_sequence);
+      break;
+    case EI_EVENT_DEVICE_PAUSED:
+    case EI_EVENT_DEVICE_REMOVED:
+      forget_device(device);
+      break;
+    case EI_EVENT_DISCONNECT:
+      debug_log("Disconnected from the EIS server");
+      break;
+    default:
+      break;
+    }
+    ei_event_unref(event);
+  }
+}
+
+
+static bool start_input(bool use_socket) {
+  ei = ei_new_sender(NULL);
+  ei_configure_name(ei, "Web Latency Benchmark");
+  int result = -ENOTSUP;
+  if (use_socket) {
+    result = ei_setup_backend_socket(ei, NULL);
+  } else if (portal.eis_fd >= 0) {
+    result = ei_setup_backend_fd(ei, portal.eis_fd);
+  }
+  if (result < 0) {
+    debug_log("Failed to connect to the EIS server: %s", strerror(-result));
+    return false;
+  }
+  struct pollfd connection = { ei_get_fd(ei), POLLIN, 0 };
+  int64_t deadline = get_nanoseconds() + device_timeout;
+  while (!keyboard_device || !pointer_device || !scroll_device) {
+    int64_t remaining = deadline - get_nanoseconds();
+    if (remaining <= 0) {
+      debug_log("The EIS server didn't provide a keyboard, absolute pointer "
+                "and scroll wheel");
+      return false;
+    }
+    poll(&connection, 1, (int)(remaining / nanoseconds_per_millisecond) + 1);
+    process_ei_events();
+  }
+  return true;
+}
+
+
+static void start_session() {
+  const char *target = getenv("WLB_PIPEWIRE_TARGET");
+  bool use_ei_socket = getenv("LIBEI_SOCKET") != NULL;
+  bool need_input = current_input_method == INPUT_METHOD_DEFAULT;
+  memset(&portal, 0, sizeof(portal));
+  portal.pipewire_fd = -1;
+  portal.eis_fd = -1;
+  if (!target || (need_input && !use_ei_socket)) {
+    char *error = "Unknown error.";
+    if (!portal_open_session(&portal, &error)) {
+      debug_log("%s", error);
+      return;
+    }
+  }
+  if (!start_capture(target)) {
+    return;
+  }
+  if (need_input && !start_input(use_ei_socket)) {
+    return;
+  }
+  session_started = true;
+}
+
+
+static bool open_session() {
+  pthread_once(&session_once, start_session);
+  return session_started;
+}
+
+
+// Makes the CPU's view of a DMA-BUF coherent while it's read.
+static void sync_dma_buf(const struct spa_data *data, uint64_t flags) {
+  if (data->type != SPA_DATA_DmaBuf) {
+    return;
+  }
+  struct dma_buf_sync sync = { flags | DMA_BUF_SYNC_READ };
+  ioctl(data->fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+
+screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
+    uint32_t height) {
+  if (!open_session()) {
+    return NULL;
+  }
+  pw_thread_loop_lock(loop);
+  if (!held_buffer) {
+    struct timespec deadline;
+    pw_thread_loop_get_time(loop, &deadline, first_frame_timeout);
+    while (!held_buffer &&
+           pw_thread_loop_timed_wait_full(loop, &deadline) == 0) {
+    }
+  }
+  if (!held_buffer) {
+    pw_thread_loop_unlock(loop);
+    debug_log("No frames received from PipeWire");
+    return NULL;
+  }
+  uint32_t frame_width = stream_format.size.width;
+  uint32_t frame_height = stream_format.size.height;
+  x = clamp(x, 0, frame_width);
+  y = clamp(y, 0, frame_height);
+  int clamped_width = clamp(min(width, INT_MAX), 0, frame_width - x);
+  int clamped_height = clamp(min(height, INT_MAX), 0, frame_height - y);
+  if (clamped_width == 0 || clamped_height == 0) {
+    pw_thread_loop_unlock(loop);
+    debug_log("screenshot rect empty");
+    return NULL;
+  }
+  const struct spa_data *data = &held_buffer->buffer->datas[0];
+  uint32_t source_stride = data->chunk->stride ?
+      (uint32_t)data->chunk->stride : frame_width * 4;
+  const uint8_t *source = (const uint8_t *)data->data + data->chunk->offset +
+      y * source_stride + x * 4;
+  // The held frame goes back to the compositor when the next one arrives, so
+  // the rectangle is copied out.
+  screenshot *shot = screenshot_pool_acquire(clamped_width, clamped_height);
+  if (!shot) {
+    pw_thread_loop_unlock(loop);
+    return NULL;
+  }
+  uint8_t *pixels = (uint8_t *)shot->pixels;
+  sync_dma_buf(data, DMA_BUF_SYNC_START);
+  for (int row = 0; row < clamped_height; row++) {
+    memcpy(pixels + row * shot->stride, source + row * source_stride,
+           shot->stride);
+  }
+  sync_dma_buf(data, DMA_BUF_SYNC_END);
+  shot->time_nanoseconds = get_nanoseconds();
+  // Each frame from the stream is a frame the compositor presented, so the
+  // frame's timestamp is the vblank at which these pixels reached the screen.
+  shot->vblank_time_nanoseconds = held_frame_time;
+  shot->frame_counter = frame_count;
+  shot->platform_specific_data = NULL;
+  pw_thread_loop_unlock(loop);
+  return shot;
+}
+
+
+void free_screenshot(screenshot *shot) {
+  screenshot_pool_release(shot);
+}
+
+
+bool reserve_screenshot_buffers(uint32_t width, uint32_t height, int count) {
+  return screenshot_pool_reserve(width, height, count);
+}
+
+
+void release_screenshot_buffers(uint32_t width, uint32_t height) {
+  screenshot_pool_unreserve(width, height);
+}
+
+
+#ifndef NDEBUG
+int64_t get_screenshot_allocation_count() {
+  return screenshot_pool_allocation_count();
+}
+#endif
+
+
+// The screencast is of a single monitor, which is the whole screen as far as
+// take_screenshot is concerned, and the compositor's frame timing is already
+// that monitor's.
+int get_screen_outputs(screen_output *out_outputs, int max_outputs) {
+  return 0;
+}
+
+
+void select_screen_output(const screen_output *output) {
+}
+
+
+screen_change_result wait_for_screen_change(uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int64_t timeout_nanoseconds,
+    int64_t *out_change_time) {
+  static int64_t seen_change_count = 0;
+  if (!open_session()) {
+    return SCREEN_CHANGE_UNSUPPORTED;
+  }
+  pw_thread_loop_lock(loop);
+  if (!watching || x != watch_x || y != watch_y || width != watch_width ||
+      height != watch_height) {
+    watching = true;
+    watch_x = x;
+    watch_y = y;
+    watch_width = width;
+    watch_height = height;
+    seen_change_count = change_count;
+  }
+  struct timespec deadline;
+  pw_thread_loop_get_time(loop, &deadline, timeout_nanoseconds);
+  while (change_count == seen_change_count &&
+         pw_thread_loop_timed_wait_full(loop, &deadline) == 0) {
+  }
+  bool changed = change_count != seen_change_count;
+  if (changed) {
+    seen_change_count = change_count;
+    *out_change_time = change_time;
+  }
+  pw_thread_loop_unlock(loop);
+  return changed ? SCREEN_CHANGED : SCREEN_CHANGE_TIMEOUT;
+}
+
+
+bool set_input_method(input_method method) {
+  if (method == INPUT_METHOD_UINPUT) {
+    if (!uinput_open()) {
+      return false;
+    }
+  } else if (method != INPUT_METHOD_DEFAULT) {
+    return false;
+  }
+  current_input_method = method;
+  return true;
+}
+
+
+int64_t get_last_input_dispatch_time() {
+  return last_dispatch_time;
+}
+
+
+static bool send_key(int key) {
+  if (current_input_method == INPUT_METHOD_UINPUT) {
+    return uinput_send_key(key, &last_dispatch_time);
+  }
+  if (!open_session()) {
+    return false;
+  }
+  process_ei_events();
+  if (!keyboard_device) {
+    debug_log("No keyboard available");
+    return false;
+  }
+  // The frame's timestamp is the time the compositor gives the event, so it's
+  // the event's dispatch time.
+  uint64_t now = ei_now(ei);
+  ei_device_keyboard_key(keyboard_device, key, true);
+  ei_device_frame(keyboard_device, now);
+  ei_device_keyboard_key(keyboard_device, key, false);
+  ei_device_frame(keyboard_device, ei_now(ei));
+  last_dispatch_time = clock_nanoseconds_from_monotonic((int64_t)now * 1000);
+  return true;
+}
+
+
+bool send_keystroke_b() { return send_key(KEY_B); }
+bool send_keystroke_t() { return send_key(KEY_T); }
+bool send_keystroke_w() { return send_key(KEY_W); }
+bool send_keystroke_z() { return send_key(KEY_Z); }
+bool send_keystroke_x() { return send_key(KEY_X); }
+bool send_keystroke_c() { return send_key(KEY_C); }
+bool send_keystroke_v() { return send_key(KEY_V); }
+
+
+// Converts a position in the captured frame to the compositor's logical
+// coordinates, which absolute pointer motion is given in. The portal reports
+// where the monitor is; otherwise the pointer's first region is assumed to be
+// the captured output.
+static void logical_position(int x, int y, double *out_x, double *out_y) {
+  pw_thread_loop_lock(loop);
+  uint32_t frame_width = stream_format.size.width;
+  uint32_t frame_height = stream_format.size.height;
+  pw_thread_loop_unlock(loop);
+  double origin_x = 0, origin_y = 0, scale_x = 1, scale_y = 1;
+  struct ei_region *region = ei_device_get_region(pointer_device, 0);
+  if (portal.logical_width > 0 && frame_width > 0) {
+    origin_x = portal.logical_x;
+    origin_y = portal.logical_y;
+    scale_x = portal.logical_width / (double)frame_width;
+    scale_y = portal.logical_height / (double)frame_height;
+  } else if (region) {
+    origin_x = ei_region_get_x(region);
+    origin_y = ei_region_get_y(region);
+    scale_x = scale_y = 1 / ei_region_get_physical_scale(region);
+  }
+  *out_x = origin_x + x * scale_x;
+  *out_y = origin_y + y * scale_y;
+}
+
+
+bool send_scroll_down(int x, int y) {
+  if (current_input_method == INPUT_METHOD_UINPUT) {
+    if (!open_session()) {
+      return false;
+    }
+    // The virtual pointer spans the whole desktop, which is assumed to be the
+    // captured monitor.
+    pw_thread_loop_lock(loop);
+    double width = stream_format.size.width;
+    double height = stream_format.size.height;
+    pw_thread_loop_unlock(loop);
+    return uinput_send_scroll_down(x / (width - 1), y / (height - 1),
+                                   &last_dispatch_time);
+  }
+  if (!open_session()) {
+    return false;
+  }
+  process_ei_events();
+  if (!pointer_device || !scroll_device) {
+    debug_log("No pointer available");
+    return false;
+  }
+  double logical_x, logical_y;
+  logical_position(x, y, &logical_x, &logical_y);
+  ei_device_pointer_motion_absolute(pointer_device, logical_x, logical_y);
+  ei_device_frame(pointer_device, ei_now(ei));
+  uint64_t now = ei_now(ei);
+  // 120 is one detent of the wheel.
+  ei_device_scroll_discrete(scroll_device, 0, 120);
+  ei_device_frame(scroll_device, now);
+  last_dispatch_time = clock_nanoseconds_from_monotonic((int64_t)now * 1000);
+  return true;
+}
+
+
+typedef struct {
+  pthread_t thread;
+  void (*thread_main)(void *);
+  void *argument;
+} wayland_thread;
+
+
+static void *run_thread(void *thread) {
+  wayland_thread *t = (wayland_thread *)thread;
+  t->thread_main(t->argument);
+  return NULL;
+}
+
+
+void *start_thread(void (*thread_main)(void *), void *argument) {
+  wayland_thread *thread = (wayland_thread *)malloc(sizeof(wayland_thread));
+  thread->thread_main = thread_main;
+  thread->argument = argument;
+  if (pthread_create(&thread->thread, NULL, run_thread, thread)) {
+    debug_log("pthread_create failed");
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+
+void join_thread(void *thread) {
+  pthread_join(((wayland_thread *)thread)->thread, NULL);
+  free(thread);
+}
+
+
+int get_processor_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
+
+void debug_log(const char *message, ...) {
+#ifndef NDEBUG
+  va_list list;
+  va_start(list, message);
+  vprintf(message, list);
+  va_end(list);
+  putchar('\n');
+  fflush(stdout);
+#endif
+}
+
+static pid_t browser_process_pid = 0;
+
+bool open_browser(const char *program, const char *args, const char *url) {
+  assert(url);
+  if (browser_process_pid) {
+    debug_log("Warning: calling open_browser, but browser already open.");
+  }
+  if (program == NULL) {
+    program = "xdg-open";
+  }
+  if (args == NULL) {
+    args = "";
+  }
+
+  char command_line[4096];
+  snprintf(command_line, sizeof(command_line), "'%s' %s '%s'", program, args,
+           url);
+  command_line[sizeof(command_line) - 1] = '\0';
+
+  wordexp_t expanded_args;
+  int result = wordexp(command_line, &expanded_args, 0);
+  if (result) {
+    debug_log("Failed to parse command line: %s", command_line);
+    return false;
+  }
+  browser_process_pid = fork();
+  if (!browser_process_pid) {
+    // child process, launch the browser!
+    execvp(expanded_args.we_wordv[0], expanded_args.we_wordv);
+    debug_log("Failed to execute browser!");
+    exit(1);
+  }
+  wordfree(&expanded_args);
+  return true;
+}
+
+bool close_browser() {
+  if (browser_process_pid == 0) {
+    debug_log("Browser not open");
+    return false;
+  }
+  int r = kill(browser_process_pid, SIGKILL);
+  browser_process_pid = 0;
+  if (r) {
+    debug_log("Failed to close browser window");
+    return false;
+  }
+  return true;
+}
+
+
+// The native reference window isn't supported on Wayland.
+bool open_native_reference_window(uint8_t *test_pattern,
+    native_reference_strategy strategy) {
+  debug_log("The native reference window isn't supported on Wayland.");
+  return false;
+}
+
+
+bool close_native_reference_window() {
+  return false;
+}
@@ -26,6 +26,7 @@ static HGLRC context = NULL;
 static uint8_t pattern[pattern_bytes];
 static int scrolls = 0;
 static int key_downs = 0;
+static int last_key_id = 0;
 static int esc_presses = 0;
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
@@ -40,8 +41,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
     InvalidateRect(hwnd, NULL, false);
     break;
   case WM_KEYDOWN:
-    if (wParam == VK_ESCAPE) {
-      esc_presses++;
+    switch (wParam) {
+    case VK_ESCAPE: esc_presses++; break;
+    case 'Z': last_key_id = 1; break;
+    case 'X': last_key_id = 2; break;
+    case 'C': last_key_id = 3; break;
+    case 'V': last_key_id = 4; break;
     }
     key_downs++;
     InvalidateRect(hwnd, NULL, false);
@@ -50,7 +55,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
     PAINTSTRUCT ps;
     BeginPaint(hwnd, &ps);
     wglMakeCurrent(ps.hdc, context);
-    draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
+    draw_pattern_with_opengl(pattern, scrolls, key_downs, last_key_id,
+        esc_presses);
     SwapBuffers(ps.hdc);
     EndPaint(hwnd, &ps);
     break;
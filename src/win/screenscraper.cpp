@@ -197,6 +197,8 @@ static screenshot *take_screenshot_with_dxgi(uint32_t x, uint32_t y,
   screen->stride = screenshot_mapped.RowPitch;
   screen->pixels = (uint8_t *)screenshot_mapped.pData;
   screen->time_nanoseconds = last_screenshot_time;
+  screen->vblank_time_nanoseconds = 0;
+  screen->frame_counter = 0;
   screen->platform_specific_data = screenshot_texture;
   framebuffer->Release();
   screen_resource->Release();
@@ -264,6 +266,8 @@ static screenshot *take_screenshot_with_gdi(uint32_t x, uint32_t y,
   shot->stride = width * 4;
   shot->platform_specific_data = hbitmap;
   shot->time_nanoseconds = get_nanoseconds();
+  shot->vblank_time_nanoseconds = 0;
+  shot->frame_counter = 0;
   return shot;
 }
 
@@ -280,8 +284,16 @@ static bool use_dxgi() {
 }
 
 
+#ifndef NDEBUG
+static volatile long screenshot_allocation_count = 0;
+#endif
+
 screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
     uint32_t height) {
+#ifndef NDEBUG
+  // Both methods allocate a texture or bitmap and a screenshot every time.
+  __sync_fetch_and_add(&screenshot_allocation_count, 1);
+#endif
   if (use_dxgi()) {
     // On Windows 8+ we use the DXGI 1.2 Desktop Duplication API.
     return take_screenshot_with_dxgi(x, y, width, height);
@@ -307,6 +319,42 @@ void free_screenshot(screenshot *shot) {
 }
 
 
+// Screenshots are copied into new textures or bitmaps, so there's nothing to
+// reserve.
+bool reserve_screenshot_buffers(uint32_t width, uint32_t height, int count) {
+  return false;
+}
+
+
+void release_screenshot_buffers(uint32_t width, uint32_t height) {
+}
+
+
+#ifndef NDEBUG
+int64_t get_screenshot_allocation_count() {
+  return screenshot_allocation_count;
+}
+#endif
+
+
+// TODO: enumerate monitors. Desktop Duplication only captures the primary
+// output.
+int get_screen_outputs(screen_output *out_outputs, int max_outputs) {
+  return 0;
+}
+
+
+void select_screen_output(const screen_output *output) {
+}
+
+
+screen_change_result wait_for_screen_change(uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int64_t timeout_nanoseconds,
+    int64_t *out_change_time) {
+  return SCREEN_CHANGE_UNSUPPORTED;
+}
+
+
 // Sends a keydown+keyup event for the given key to the foreground window.
 static bool send_keystroke(WORD key_code) {
   INPUT input[2];
@@ -324,6 +372,9 @@ bool send_keystroke_b() { return send_keystroke(0x42); }
 bool send_keystroke_t() { return send_keystroke(0x54); }
 bool send_keystroke_w() { return send_keystroke(0x57); }
 bool send_keystroke_z() { return send_keystroke(0x5A); }
+bool send_keystroke_x() { return send_keystroke(0x58); }
+bool send_keystroke_c() { return send_keystroke(0x43); }
+bool send_keystroke_v() { return send_keystroke(0x56); }
 
 bool send_scroll_down(int x, int y) {
   SetCursorPos(x, y);
@@ -336,6 +387,57 @@ bool send_scroll_down(int x, int y) {
   return true;
 }
 
+bool set_input_method(input_method method) {
+  return method == INPUT_METHOD_DEFAULT;
+}
+
+int64_t get_last_input_dispatch_time() {
+  return 0;
+}
+
+
+struct win_thread {
+  HANDLE handle;
+  void (*thread_main)(void *);
+  void *argument;
+};
+
+
+static DWORD WINAPI run_thread(LPVOID thread) {
+  win_thread *t = (win_thread *)thread;
+  t->thread_main(t->argument);
+  return 0;
+}
+
+
+void *start_thread(void (*thread_main)(void *), void *argument) {
+  win_thread *thread = (win_thread *)malloc(sizeof(win_thread));
+  thread->thread_main = thread_main;
+  thread->argument = argument;
+  thread->handle = CreateThread(NULL, 0, run_thread, thread, 0, NULL);
+  if (!thread->handle) {
+    debug_log("CreateThread failed");
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+
+void join_thread(void *thread) {
+  win_thread *t = (win_thread *)thread;
+  WaitForSingleObject(t->handle, INFINITE);
+  CloseHandle(t->handle);
+  free(t);
+}
+
+
+int get_processor_count() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
 
 static const int log_buffer_size = 1000;
 void debug_log(const char *message, ...) {
@@ -416,7 +518,8 @@ bool close_browser() {
 
 HANDLE window_process_handle = NULL;
 
-bool open_native_reference_window(uint8_t *test_pattern_for_window) {
+bool open_native_reference_window(uint8_t *test_pattern_for_window,
+    native_reference_strategy strategy) {
   // The native reference window is opened in a new child process to make the
   // test more fair. Unfortunately Visual Studio can't automatically attach to
   // child processes. WinDbg can, so you can use WinDbg to debug the native
@@ -425,6 +528,10 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
   // window code in isolation. Here are some sample arguments that will work:
   // -p 2923BEE16CD6529049F1BBE9 -h 0
 
+  if (strategy != NATIVE_REFERENCE_IMMEDIATE) {
+    debug_log("Only the immediate native reference strategy is supported");
+    return false;
+  }
   if (window_process_handle != NULL) {
     debug_log("native window already open");
     return false;
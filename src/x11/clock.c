@@ -0,0 +1,142 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../screenscraper.h"
+#include "clock.h"
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define WLB_HAVE_TSC 1
+#include <cpuid.h>
+#include <x86intrin.h>  // __rdtsc
+#endif
+
+// Kernels older than 2.6.28 don't have CLOCK_MONOTONIC_RAW.
+static clockid_t clock_id = CLOCK_MONOTONIC_RAW;
+static pthread_once_t clock_once = PTHREAD_ONCE_INIT;
+static int64_t start_nanoseconds = 0;
+#ifdef WLB_HAVE_TSC
+static bool use_tsc = false;
+static uint64_t start_ticks = 0;
+static double nanoseconds_per_tick = 0;
+#endif
+
+
+static int64_t read_clock(clockid_t id) {
+  struct timespec now;
+  clock_gettime(id, &now);
+  return (int64_t)now.tv_sec * nanoseconds_per_second + now.tv_nsec;
+}
+
+
+static void init_default_clock() {
+  struct timespec now;
+  if (clock_gettime(clock_id, &now) != 0) {
+    clock_id = CLOCK_MONOTONIC;
+  }
+  start_nanoseconds = read_clock(clock_id);
+}
+
+
+int64_t get_nanoseconds() {
+#ifdef WLB_HAVE_TSC
+  if (use_tsc) {
+    return (int64_t)((__rdtsc() - start_ticks) * nanoseconds_per_tick);
+  }
+#endif
+  pthread_once(&clock_once, init_default_clock);
+  return read_clock(clock_id) - start_nanoseconds;
+}
+
+
+#ifdef WLB_HAVE_TSC
+// An invariant TSC runs at a constant rate in all power states and is
+// synchronized between cores, so it can be used as a wall clock.
+static bool has_invariant_tsc() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return edx & (1u << 8);
+}
+
+
+// Measures the TSC frequency against the default clock over a short interval.
+static double calibrate_tsc() {
+  static const int64_t calibration_nanoseconds = 100 * 1000 * 1000;
+  int64_t start_time = read_clock(clock_id);
+  uint64_t start = __rdtsc();
+  int64_t end_time;
+  do {
+    end_time = read_clock(clock_id);
+  } while (end_time - start_time < calibration_nanoseconds);
+  uint64_t end = __rdtsc();
+  return (end_time - start_time) / (double)(end - start);
+}
+#endif
+
+
+void init_clock(bool use_cycle_counter) {
+  pthread_once(&clock_once, init_default_clock);
+  const char *name = clock_id == CLOCK_MONOTONIC_RAW ?
+      "CLOCK_MONOTONIC_RAW" : "CLOCK_MONOTONIC";
+  struct timespec resolution;
+  clock_getres(clock_id, &resolution);
+  double resolution_nanoseconds =
+      resolution.tv_sec * (double)nanoseconds_per_second + resolution.tv_nsec;
+  if (use_cycle_counter) {
+#ifdef WLB_HAVE_TSC
+    if (has_invariant_tsc()) {
+      nanoseconds_per_tick = calibrate_tsc();
+      // Keep the same timebase as the default clock.
+      int64_t now = get_nanoseconds();
+      start_ticks = __rdtsc() - (uint64_t)(now / nanoseconds_per_tick);
+      use_tsc = true;
+      name = "TSC";
+      resolution_nanoseconds = nanoseconds_per_tick;
+    } else {
+      fprintf(stderr, "The CPU doesn't have an invariant TSC; using %s.\n",
+              name);
+    }
+#else
+    fprintf(stderr, "The TSC is only available on x86; using %s.\n", name);
+#endif
+  }
+  // Time a batch of reads to find the overhead of each one.
+  static const int reads = 100000;
+  int64_t start = get_nanoseconds();
+  volatile int64_t sink = 0;
+  for (int i = 0; i < reads; i++) {
+    sink += get_nanoseconds();
+  }
+  double read_cost = (get_nanoseconds() - start) / (double)reads;
+  fprintf(stderr, "Clock: %s, resolution %.3f ns, %.1f ns per read.\n", name,
+          resolution_nanoseconds, read_cost);
+}
+
+
+int64_t clock_nanoseconds_from_monotonic(int64_t monotonic_nanoseconds) {
+  // Find the current offset between the two clocks by reading ours on either
+  // side of CLOCK_MONOTONIC. They run at slightly different rates when NTP is
+  // slewing CLOCK_MONOTONIC, so the offset is measured on every call.
+  int64_t before = get_nanoseconds();
+  int64_t monotonic = read_clock(CLOCK_MONOTONIC);
+  int64_t after = get_nanoseconds();
+  int64_t offset = before + (after - before) / 2 - monotonic;
+  return monotonic_nanoseconds + offset;
+}
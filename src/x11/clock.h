@@ -0,0 +1,39 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The clock behind get_nanoseconds on Linux. By default it reads
+// CLOCK_MONOTONIC_RAW, which has nanosecond resolution and, unlike
+// gettimeofday, never jumps or gets slewed by NTP. On x86 CPUs with an
+// invariant TSC it can instead read the cycle counter directly, which is
+// cheaper still, after calibrating it against CLOCK_MONOTONIC_RAW.
+
+#ifndef WLB_X11_CLOCK_H_
+#define WLB_X11_CLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Selects the clock source and prints its resolution and the cost of reading
+// it. If use_cycle_counter is true the TSC is used when it's invariant, and
+// otherwise the default clock is used. Must be called before any other thread
+// calls get_nanoseconds; if it's never called, the default clock is used.
+void init_clock(bool use_cycle_counter);
+
+// Converts a CLOCK_MONOTONIC timestamp, as used by the kernel for input events
+// and by the X server, to the timebase of get_nanoseconds.
+int64_t clock_nanoseconds_from_monotonic(int64_t monotonic_nanoseconds);
+
+#endif  // WLB_X11_CLOCK_H_
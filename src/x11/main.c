@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include "../clioptions.h"
+#include "clock.h"
 
 void run_server(clioptions *opts);
 
@@ -23,6 +24,7 @@ int main(int argc, const char **argv)
 {
   clioptions opts;
   parse_commandline(argc, argv, &opts);
+  init_clock(opts.use_cycle_counter);
   run_server(&opts);
   return 0;
 }
@@ -16,14 +16,21 @@
 
 #include "../screenscraper.h"
 #include "../latency-benchmark.h"
+#include "clock.h"
+#include "uinput.h"
+#include "vblank.h"
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>  // XGetPixel, XDestroyImage
 #include <X11/keysym.h> // XK_Z
 #include <X11/XKBlib.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/Xrandr.h>
 #include <GL/glx.h>
+#include <linux/input.h>  // KEY_Z
 #include <stddef.h>
-#include <sys/time.h>   // gettimeofday
 #include <string.h>     // memset
 #include <math.h>
 #include <assert.h>
@@ -34,7 +41,12 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
 #include <wordexp.h>
 
 
@@ -50,35 +62,327 @@ static int clamp(int value, int minimum, int maximum) {
 }
 
 
-screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
-    uint32_t height) {
+// Opens the shared display connection if it isn't open already. The test
+// takes screenshots and sends input events from different threads, so Xlib's
+// locking must be enabled before the connection is opened.
+static bool open_display() {
+  static bool threads_initialized = false;
+  if (!threads_initialized) {
+    XInitThreads();
+    threads_initialized = true;
+  }
   if (!display) {
     display = XOpenDisplay(NULL);
-    if (!display) {
-      return false;
+  }
+  return display != NULL;
+}
+
+
+// Xlib reports some failures, such as XShmAttach on a remote display, through
+// an asynchronous error callback instead of a return value. While
+// x_error_trapped is set, errors are recorded here instead of killing the
+// process.
+static bool x_error_trapped = false;
+static bool x_error_occurred = false;
+static XErrorHandler previous_x_error_handler = NULL;
+static int trap_x_error(Display *display, XErrorEvent *event) {
+  x_error_occurred = true;
+  return 0;
+}
+
+static void begin_trapping_x_errors() {
+  assert(!x_error_trapped);
+  XSync(display, False);
+  x_error_trapped = true;
+  x_error_occurred = false;
+  previous_x_error_handler = XSetErrorHandler(trap_x_error);
+}
+
+// Returns true if an X error occurred since begin_trapping_x_errors.
+static bool end_trapping_x_errors() {
+  assert(x_error_trapped);
+  XSync(display, False);
+  XSetErrorHandler(previous_x_error_handler);
+  x_error_trapped = false;
+  return x_error_occurred;
+}
+
+
+// XGetImage sends the pixels through the X socket and allocates a new XImage
+// for every call, which adds milliseconds of jitter to each screenshot. When
+// the MIT-SHM extension is available we use XShmGetImage instead, which has the
+// X server write the pixels directly into a shared memory segment. Setting up a
+// segment is expensive, so we keep one around for each of the most recently
+// used screenshot sizes. The small screenshots taken in the test loop always
+// reuse the same segment, and the screenshot struct lives in the slot too, so
+// the test loop doesn't allocate at all.
+typedef struct {
+  XImage *image;  // NULL if this slot is empty.
+  XShmSegmentInfo segment;
+  screenshot shot;
+  bool in_use;    // True while a screenshot is using the segment's pixels.
+  // Reserved segments are never replaced by segments of other sizes.
+  bool reserved;
+  uint64_t last_used;
+} shm_capture;
+
+#define MAX_SHM_CAPTURES 4
+// Screenshots of several monitors may be taken at once from different threads,
+// so the segments are protected by capture_mutex.
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shm_capture shm_captures[MAX_SHM_CAPTURES];
+static uint64_t shm_capture_use_count = 0;
+// -1 if we haven't checked for MIT-SHM support yet.
+static int shm_supported = -1;
+
+#ifndef NDEBUG
+static volatile long screenshot_allocation_count = 0;
+#endif
+
+
+static void count_screenshot_allocation() {
+#ifndef NDEBUG
+  __sync_fetch_and_add(&screenshot_allocation_count, 1);
+#endif
+}
+
+
+static void destroy_shm_capture(shm_capture *capture) {
+  assert(!capture->in_use);
+  if (!capture->image) {
+    return;
+  }
+  XShmDetach(display, &capture->segment);
+  shmdt(capture->segment.shmaddr);
+  // The pixels belong to the shared memory segment, so don't let
+  // XDestroyImage free them.
+  capture->image->data = NULL;
+  XDestroyImage(capture->image);
+  memset(capture, 0, sizeof(shm_capture));
+}
+
+
+static bool create_shm_capture(shm_capture *capture, int width, int height) {
+  assert(!capture->image);
+  XImage *image = XShmCreateImage(display, DefaultVisual(display, 0),
+      DefaultDepth(display, 0), ZPixmap, NULL, &capture->segment, width,
+      height);
+  if (!image) {
+    debug_log("XShmCreateImage failed");
+    return false;
+  }
+  capture->segment.shmid = shmget(IPC_PRIVATE,
+      image->bytes_per_line * image->height, IPC_CREAT | 0600);
+  if (capture->segment.shmid < 0) {
+    debug_log("shmget failed");
+    XDestroyImage(image);
+    return false;
+  }
+  capture->segment.shmaddr = image->data =
+      (char *)shmat(capture->segment.shmid, NULL, 0);
+  // Mark the segment for deletion right away. It stays alive until both we and
+  // the X server detach, and this way it can't leak if we crash.
+  shmctl(capture->segment.shmid, IPC_RMID, NULL);
+  if (capture->segment.shmaddr == (char *)-1) {
+    debug_log("shmat failed");
+    image->data = NULL;
+    XDestroyImage(image);
+    return false;
+  }
+  capture->segment.readOnly = False;
+  begin_trapping_x_errors();
+  XShmAttach(display, &capture->segment);
+  if (end_trapping_x_errors()) {
+    // This happens when the X server is on a different machine, so there's no
+    // point trying again.
+    debug_log("XShmAttach failed, falling back to XGetImage");
+    shm_supported = false;
+    shmdt(capture->segment.shmaddr);
+    image->data = NULL;
+    XDestroyImage(image);
+    return false;
+  }
+  capture->image = image;
+  count_screenshot_allocation();
+  return true;
+}
+
+
+// Returns a shared memory capture of the given size, or NULL if MIT-SHM is
+// unavailable. Must be called with capture_mutex held.
+static shm_capture *find_free_shm_capture(int width, int height) {
+  if (shm_supported == -1) {
+    shm_supported = XShmQueryExtension(display);
+    if (!shm_supported) {
+      debug_log("MIT-SHM extension not available, falling back to XGetImage");
     }
   }
-  // Make sure width and height can be safely converted to signed integers.
-  width = min(width, INT_MAX);
-  height = min(height, INT_MAX);
+  if (!shm_supported) {
+    return NULL;
+  }
+  // Look for an existing segment of the right size. Otherwise replace the
+  // least recently used segment that isn't in use.
+  shm_capture *replace = NULL;
+  for (int i = 0; i < MAX_SHM_CAPTURES; i++) {
+    shm_capture *capture = &shm_captures[i];
+    if (capture->in_use) {
+      continue;
+    }
+    if (capture->image && capture->image->width == width &&
+        capture->image->height == height) {
+      replace = capture;
+      break;
+    }
+    if (capture->reserved) {
+      continue;
+    }
+    if (!replace || !capture->image ||
+        (replace->image && capture->last_used < replace->last_used)) {
+      replace = capture;
+    }
+  }
+  if (!replace) {
+    // All segments are in use or reserved.
+    return NULL;
+  }
+  if (!replace->image || replace->image->width != width ||
+      replace->image->height != height) {
+    destroy_shm_capture(replace);
+    if (!create_shm_capture(replace, width, height)) {
+      return NULL;
+    }
+  }
+  return replace;
+}
+
+
+// Returns a shared memory capture of the given size, marked as in use, or NULL
+// if MIT-SHM is unavailable.
+static shm_capture *acquire_shm_capture(int width, int height) {
+  pthread_mutex_lock(&capture_mutex);
+  shm_capture *capture = find_free_shm_capture(width, height);
+  if (capture) {
+    capture->in_use = true;
+    capture->last_used = ++shm_capture_use_count;
+  }
+  pthread_mutex_unlock(&capture_mutex);
+  return capture;
+}
+
+
+static void release_shm_capture(shm_capture *capture) {
+  pthread_mutex_lock(&capture_mutex);
+  assert(capture->in_use);
+  capture->in_use = false;
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+
+// Returns the shared memory capture that owns the given image, or NULL if the
+// image came from XGetImage. Must be called with capture_mutex held.
+static shm_capture *find_shm_capture(XImage *image) {
+  for (int i = 0; i < MAX_SHM_CAPTURES; i++) {
+    if (shm_captures[i].image == image) {
+      return &shm_captures[i];
+    }
+  }
+  return NULL;
+}
+
+
+// The size of the root window. XGetGeometry is a round trip to the X server,
+// which would add to the cost of every screenshot in the test loop, so the
+// size is cached, and refreshed when RandR reports that it changed. Protected
+// by capture_mutex.
+static unsigned int screen_width = 0;
+static unsigned int screen_height = 0;
+// -1 if RandR isn't available, in which case the size can't change.
+static int randr_event_base = -1;
+
+
+static void update_screen_size() {
+  if (screen_width == 0) {
+    int error_base;
+    if (XRRQueryExtension(display, &randr_event_base, &error_base)) {
+      XRRSelectInput(display, RootWindow(display, 0), RRScreenChangeNotifyMask);
+    } else {
+      randr_event_base = -1;
+    }
+  } else if (randr_event_base >= 0) {
+    // Only the change notifications are selected on this connection. Reading
+    // the ones that have already arrived doesn't need a round trip.
+    bool changed = false;
+    while (XEventsQueued(display, QueuedAfterReading)) {
+      XEvent event;
+      XNextEvent(display, &event);
+      if (event.type == randr_event_base + RRScreenChangeNotify) {
+        XRRUpdateConfiguration(&event);
+        changed = true;
+      }
+    }
+    if (!changed) {
+      return;
+    }
+  } else {
+    return;
+  }
   int display_x, display_y;
-  unsigned int display_width, display_height, border_width, display_depth;
+  unsigned int border_width, display_depth;
   Window root;
   XGetGeometry(display, RootWindow(display, 0), &root, &display_x, &display_y,
-      &display_width, &display_height, &border_width, &display_depth);
+      &screen_width, &screen_height, &border_width, &display_depth);
   // TODO: can these be non-zero?
   assert(display_x == 0);
   assert(display_y == 0);
+  debug_log("Screen size is %ux%u", screen_width, screen_height);
+}
+
+
+screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
+    uint32_t height) {
+  if (!open_display()) {
+    return NULL;
+  }
+  start_vblank_tracking();
+  // Make sure width and height can be safely converted to signed integers.
+  width = min(width, INT_MAX);
+  height = min(height, INT_MAX);
+  pthread_mutex_lock(&capture_mutex);
+  update_screen_size();
+  unsigned int display_width = screen_width;
+  unsigned int display_height = screen_height;
+  pthread_mutex_unlock(&capture_mutex);
   x = clamp(x, 0, display_width);
-  y = clamp(y, 0, display_width);
+  y = clamp(y, 0, display_height);
   int clamped_width = clamp(width, 0, display_width - x);
   int clamped_height = clamp(height, 0, display_height - y);
   if (clamped_width == 0 || clamped_height == 0) {
     debug_log("screenshot rect empty");
     return NULL;
   }
-  XImage *image = XGetImage(display, RootWindow(display, 0), x, y,
-      clamped_width, clamped_height, AllPlanes, ZPixmap);
+  XImage *image = NULL;
+  shm_capture *capture = acquire_shm_capture(clamped_width, clamped_height);
+  if (capture) {
+    if (XShmGetImage(display, RootWindow(display, 0), capture->image, x, y,
+                     AllPlanes)) {
+      image = capture->image;
+    } else {
+      debug_log("XShmGetImage failed");
+      release_shm_capture(capture);
+    }
+  }
+  screenshot *shot = NULL;
+  if (image) {
+    shot = &capture->shot;
+  } else {
+    image = XGetImage(display, RootWindow(display, 0), x, y, clamped_width,
+        clamped_height, AllPlanes, ZPixmap);
+    // Xlib allocates the image and its pixels.
+    count_screenshot_allocation();
+    shot = (screenshot *)malloc(sizeof(screenshot));
+    // The screenshot struct itself.
+    count_screenshot_allocation();
+  }
   assert(image);
   assert(image->width == clamped_width);
   assert(image->height == clamped_height);
@@ -87,31 +391,414 @@ screenshot *take_screenshot(uint32_t x, uint32_t y, uint32_t width,
   assert(image->red_mask == 0x00FF0000);
   assert(image->green_mask == 0x0000FF00);
   assert(image->blue_mask == 0x000000FF);
-  screenshot *shot = (screenshot *) malloc(sizeof(screenshot));
   shot->width = image->width;
   shot->height = image->height;
   shot->stride = image->bytes_per_line;
   shot->pixels = (uint8_t *)image->data;
   shot->time_nanoseconds = get_nanoseconds();
+  if (!find_vblank(shot->time_nanoseconds, &shot->vblank_time_nanoseconds,
+                   &shot->frame_counter)) {
+    shot->vblank_time_nanoseconds = 0;
+    shot->frame_counter = 0;
+  }
   shot->platform_specific_data = image;
   return shot;
 }
 
 
 void free_screenshot(screenshot *shot) {
-  XDestroyImage((XImage *)shot->platform_specific_data);
-  free(shot);
+  XImage *image = (XImage *)shot->platform_specific_data;
+  pthread_mutex_lock(&capture_mutex);
+  shm_capture *capture = find_shm_capture(image);
+  pthread_mutex_unlock(&capture_mutex);
+  if (capture) {
+    // Keep the segment around for the next screenshot of the same size.
+    release_shm_capture(capture);
+  } else {
+    XDestroyImage(image);
+    free(shot);
+  }
 }
 
 
-static bool send_keystroke(int keysym) {
-  if (!display) {
-    display = XOpenDisplay(NULL);
-    if (!display) {
+bool reserve_screenshot_buffers(uint32_t width, uint32_t height, int count) {
+  // Leave a segment for other sizes, such as the full screen screenshot that
+  // finds the pattern.
+  if (!open_display() || count <= 0 || count >= MAX_SHM_CAPTURES) {
+    return false;
+  }
+  shm_capture *captures[MAX_SHM_CAPTURES];
+  int acquired = 0;
+  while (acquired < count) {
+    captures[acquired] = acquire_shm_capture(width, height);
+    if (!captures[acquired]) {
+      break;
+    }
+    acquired++;
+  }
+  pthread_mutex_lock(&capture_mutex);
+  for (int i = 0; i < acquired; i++) {
+    captures[i]->reserved = acquired == count;
+    captures[i]->in_use = false;
+  }
+  pthread_mutex_unlock(&capture_mutex);
+  return acquired == count;
+}
+
+
+void release_screenshot_buffers(uint32_t width, uint32_t height) {
+  pthread_mutex_lock(&capture_mutex);
+  for (int i = 0; i < MAX_SHM_CAPTURES; i++) {
+    shm_capture *capture = &shm_captures[i];
+    if (capture->reserved && capture->image->width == width &&
+        capture->image->height == height) {
+      // The segment is kept until it's the least recently used.
+      capture->reserved = false;
+    }
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+
+// Computes a mode's refresh rate from its timings, or returns 0 if the mode
+// isn't found.
+static double mode_refresh_rate(const XRRScreenResources *resources,
+    RRMode mode) {
+  for (int i = 0; i < resources->nmode; i++) {
+    const XRRModeInfo *info = &resources->modes[i];
+    if (info->id != mode || !info->hTotal || !info->vTotal) {
+      continue;
+    }
+    double lines = info->vTotal;
+    if (info->modeFlags & RR_DoubleScan) {
+      lines *= 2;
+    }
+    if (info->modeFlags & RR_Interlace) {
+      lines /= 2;
+    }
+    return info->dotClock / (info->hTotal * lines);
+  }
+  return 0;
+}
+
+
+// Each RandR CRTC that is driving at least one output is a monitor.
+int get_screen_outputs(screen_output *out_outputs, int max_outputs) {
+  int event_base, error_base;
+  if (!open_display() ||
+      !XRRQueryExtension(display, &event_base, &error_base)) {
+    return 0;
+  }
+  XRRScreenResources *resources =
+      XRRGetScreenResourcesCurrent(display, RootWindow(display, 0));
+  if (!resources) {
+    return 0;
+  }
+  int count = 0;
+  for (int i = 0; i < resources->ncrtc && count < max_outputs; i++) {
+    XRRCrtcInfo *crtc = XRRGetCrtcInfo(display, resources, resources->crtcs[i]);
+    if (!crtc) {
+      continue;
+    }
+    if (crtc->mode != None && crtc->noutput > 0 && crtc->width > 0 &&
+        crtc->height > 0) {
+      screen_output *output = &out_outputs[count++];
+      output->x = max(crtc->x, 0);
+      output->y = max(crtc->y, 0);
+      output->width = crtc->width;
+      output->height = crtc->height;
+      output->refresh_rate_hz = mode_refresh_rate(resources, crtc->mode);
+    }
+    XRRFreeCrtcInfo(crtc);
+  }
+  XRRFreeScreenResources(resources);
+  return count;
+}
+
+
+void select_screen_output(const screen_output *output) {
+  set_vblank_output(output->x, output->y, output->width, output->height);
+}
+
+
+#ifndef NDEBUG
+int64_t get_screenshot_allocation_count() {
+  return screenshot_allocation_count;
+}
+#endif
+
+
+// Converts a server timestamp, which is CLOCK_MONOTONIC in milliseconds
+// truncated to 32 bits on Linux, to get_nanoseconds() time.
+static int64_t nanoseconds_from_server_time(Time server_time) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t now_milliseconds = (int64_t)now.tv_sec * 1000 +
+      now.tv_nsec / nanoseconds_per_millisecond;
+  uint32_t age = (uint32_t)now_milliseconds - (uint32_t)server_time;
+  return clock_nanoseconds_from_monotonic(
+      (now_milliseconds - age) * nanoseconds_per_millisecond);
+}
+
+
+// Damage notifications are read on a separate connection, which is only used
+// by the thread calling wait_for_screen_change, so waiting for them doesn't
+// hold the lock on the main connection.
+static Display *damage_display = NULL;
+static int damage_event_base = 0;
+// -1 if we haven't tried to set up damage reporting yet.
+static int damage_supported = -1;
+
+
+static bool init_damage() {
+  if (damage_supported != -1) {
+    return damage_supported;
+  }
+  damage_supported = false;
+  if (!open_display()) {
+    return false;
+  }
+  damage_display = XOpenDisplay(NULL);
+  if (!damage_display) {
+    return false;
+  }
+  int error_base;
+  if (!XDamageQueryExtension(damage_display, &damage_event_base,
+                             &error_base)) {
+    debug_log("DAMAGE extension not available; polling for screenshots.");
+    XCloseDisplay(damage_display);
+    damage_display = NULL;
+    return false;
+  }
+  // Raw rectangles let us ignore damage outside the area we're watching,
+  // without having to acknowledge each report.
+  XDamageCreate(damage_display, DefaultRootWindow(damage_display),
+                XDamageReportRawRectangles);
+  XFlush(damage_display);
+  damage_supported = true;
+  return true;
+}
+
+
+static bool rectangles_intersect(const XRectangle *area, uint32_t x,
+    uint32_t y, uint32_t width, uint32_t height) {
+  return area->x < (int64_t)x + width && x < area->x + area->width &&
+      area->y < (int64_t)y + height && y < area->y + area->height;
+}
+
+
+screen_change_result wait_for_screen_change(uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int64_t timeout_nanoseconds,
+    int64_t *out_change_time) {
+  if (!init_damage()) {
+    return SCREEN_CHANGE_UNSUPPORTED;
+  }
+  int64_t deadline = get_nanoseconds() + timeout_nanoseconds;
+  struct pollfd connection = { ConnectionNumber(damage_display), POLLIN, 0 };
+  // Events that were already queued may have arrived any time since the
+  // caller's last screenshot, so they're stamped with the server's time, which
+  // truncates to the millisecond before the damage. Events read after poll
+  // wakes us are stamped with the time they're read.
+  int queued_events = XPending(damage_display);
+  while (true) {
+    while (XPending(damage_display)) {
+      XEvent event;
+      XNextEvent(damage_display, &event);
+      bool queued = queued_events > 0;
+      queued_events--;
+      if (event.type != damage_event_base + XDamageNotify) {
+        continue;
+      }
+      XDamageNotifyEvent *damage = (XDamageNotifyEvent *)&event;
+      if (!rectangles_intersect(&damage->area, x, y, width, height)) {
+        continue;
+      }
+      int64_t now = get_nanoseconds();
+      *out_change_time = now;
+      if (queued) {
+        int64_t server_time = nanoseconds_from_server_time(damage->timestamp);
+        if (server_time < now) {
+          *out_change_time = server_time;
+        }
+      }
+      // Skip the rest of the same update, which has the same timestamp, but
+      // leave any later damage for the next call.
+      while (XPending(damage_display)) {
+        XEvent next;
+        XPeekEvent(damage_display, &next);
+        if (next.type == damage_event_base + XDamageNotify &&
+            ((XDamageNotifyEvent *)&next)->timestamp != damage->timestamp) {
+          break;
+        }
+        XNextEvent(damage_display, &next);
+      }
+      return SCREEN_CHANGED;
+    }
+    int64_t remaining = deadline - get_nanoseconds();
+    if (remaining <= 0) {
+      return SCREEN_CHANGE_TIMEOUT;
+    }
+    // Round up so we don't spin on a zero millisecond timeout.
+    poll(&connection, 1,
+         (int)((remaining + nanoseconds_per_millisecond - 1) /
+               nanoseconds_per_millisecond));
+  }
+}
+
+
+// With INPUT_METHOD_UINPUT, events come from virtual devices created with
+// uinput, and the dispatch time is the kernel's timestamp of the event.
+// With INPUT_METHOD_XTEST, events are generated with XTest on their own
+// connection, which also listens for the XInput2 raw events the server emits
+// as it processes each one. Raw events carry the server's timestamp, which is
+// the time the event was dispatched.
+static input_method current_input_method = INPUT_METHOD_DEFAULT;
+static Display *input_display = NULL;
+static int xi_opcode = 0;
+static int64_t last_dispatch_time = 0;
+// How long to wait for the raw event after the XTest request has been
+// processed.
+static const int64_t raw_event_timeout = 10 * 1000 * 1000;
+
+
+bool set_input_method(input_method method) {
+  if (method == INPUT_METHOD_DEFAULT) {
+    current_input_method = method;
+    return true;
+  }
+  if (method == INPUT_METHOD_UINPUT) {
+    // The screen size is needed to position the pointer.
+    if (!open_display() || !uinput_open()) {
       return false;
     }
+    current_input_method = method;
+    return true;
+  }
+  if (method != INPUT_METHOD_XTEST) {
+    return false;
+  }
+  if (!open_display()) {
+    return false;
+  }
+  if (!input_display) {
+    input_display = XOpenDisplay(NULL);
+    if (!input_display) {
+      debug_log("Couldn't open a display connection for input.");
+      return false;
+    }
+  }
+  int ignored;
+  if (!XTestQueryExtension(input_display, &ignored, &ignored, &ignored,
+                           &ignored)) {
+    debug_log("XTest extension not available.");
+    return false;
+  }
+  // Dispatch times are optional; without XInput 2 the time after the round
+  // trip is used instead.
+  int major = 2, minor = 0;
+  if (XQueryExtension(input_display, "XInputExtension", &xi_opcode, &ignored,
+                      &ignored) &&
+      XIQueryVersion(input_display, &major, &minor) == Success) {
+    unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)];
+    memset(mask_bits, 0, sizeof(mask_bits));
+    XISetMask(mask_bits, XI_RawKeyPress);
+    XISetMask(mask_bits, XI_RawButtonPress);
+    XIEventMask mask = { XIAllDevices, sizeof(mask_bits), mask_bits };
+    XISelectEvents(input_display, DefaultRootWindow(input_display), &mask, 1);
+  } else {
+    debug_log("XInput 2 not available; input dispatch times are estimated.");
+    xi_opcode = 0;
+  }
+  current_input_method = method;
+  return true;
+}
+
+
+int64_t get_last_input_dispatch_time() {
+  return current_input_method == INPUT_METHOD_DEFAULT ? 0 : last_dispatch_time;
+}
+
+
+// Sends the XTest request queued on input_display and records when the server
+// dispatched it. The event was dispatched between sending the request and
+// receiving the reply to the round trip, and the raw event's timestamp narrows
+// that down to the millisecond, so it's clamped to that window.
+static void flush_xtest_event(int raw_event_type) {
+  int64_t sent = get_nanoseconds();
+  XSync(input_display, False);
+  int64_t processed = get_nanoseconds();
+  last_dispatch_time = processed;
+  if (!xi_opcode) {
+    return;
+  }
+  struct pollfd connection = { ConnectionNumber(input_display), POLLIN, 0 };
+  int64_t deadline = processed + raw_event_timeout;
+  while (true) {
+    while (XPending(input_display)) {
+      XEvent event;
+      XNextEvent(input_display, &event);
+      XGenericEventCookie *cookie = &event.xcookie;
+      if (cookie->type != GenericEvent || cookie->extension != xi_opcode ||
+          !XGetEventData(input_display, cookie)) {
+        continue;
+      }
+      bool found = cookie->evtype == raw_event_type;
+      if (found) {
+        int64_t dispatched = nanoseconds_from_server_time(
+            ((XIRawEvent *)cookie->data)->time);
+        last_dispatch_time = dispatched < sent ? sent :
+            (dispatched > processed ? processed : dispatched);
+      }
+      XFreeEventData(input_display, cookie);
+      if (found) {
+        // Drop the rest, such as the raw events for the release.
+        while (XPending(input_display)) {
+          XNextEvent(input_display, &event);
+        }
+        return;
+      }
+    }
+    int64_t remaining = deadline - get_nanoseconds();
+    if (remaining <= 0) {
+      debug_log("No raw input event received for XTest event.");
+      return;
+    }
+    poll(&connection, 1,
+         (int)((remaining + nanoseconds_per_millisecond - 1) /
+               nanoseconds_per_millisecond));
+  }
+}
+
+
+// Returns the evdev key code for the keys the tests send.
+static int linux_key_for_keysym(int keysym) {
+  switch (keysym) {
+  case XK_B: return KEY_B;
+  case XK_T: return KEY_T;
+  case XK_W: return KEY_W;
+  case XK_X: return KEY_X;
+  case XK_C: return KEY_C;
+  case XK_V: return KEY_V;
+  default: return KEY_Z;
+  }
+}
+
+
+static bool send_keystroke(int keysym) {
+  if (current_input_method == INPUT_METHOD_UINPUT) {
+    return uinput_send_key(linux_key_for_keysym(keysym), &last_dispatch_time);
+  }
+  if (current_input_method == INPUT_METHOD_XTEST) {
+    unsigned int keycode = XKeysymToKeycode(input_display, keysym);
+    XTestFakeKeyEvent(input_display, keycode, True, CurrentTime);
+    XTestFakeKeyEvent(input_display, keycode, False, CurrentTime);
+    flush_xtest_event(XI_RawKeyPress);
+    return true;
+  }
+  if (!open_display()) {
+    return false;
   }
-  // Send a keydown event for the 'Z' key, followed immediately by keyup.
+  // Send a keydown event for the key, followed immediately by keyup.
   XKeyEvent event;
   memset(&event, 0, sizeof(XKeyEvent));
   Window focused;
@@ -137,14 +824,28 @@ bool send_keystroke_b() { return send_keystroke(XK_B); }
 bool send_keystroke_t() { return send_keystroke(XK_T); }
 bool send_keystroke_w() { return send_keystroke(XK_W); }
 bool send_keystroke_z() { return send_keystroke(XK_Z); }
+bool send_keystroke_x() { return send_keystroke(XK_X); }
+bool send_keystroke_c() { return send_keystroke(XK_C); }
+bool send_keystroke_v() { return send_keystroke(XK_V); }
 
 
 bool send_scroll_down(int x, int y) {
-  if (!display) {
-    display = XOpenDisplay(NULL);
-    if (!display) {
-      return false;
-    }
+  if (current_input_method == INPUT_METHOD_UINPUT) {
+    // The pointer's axes span the whole root window.
+    Screen *screen = DefaultScreenOfDisplay(display);
+    return uinput_send_scroll_down(x / (double)(WidthOfScreen(screen) - 1),
+        y / (double)(HeightOfScreen(screen) - 1), &last_dispatch_time);
+  }
+  if (current_input_method == INPUT_METHOD_XTEST) {
+    XWarpPointer(input_display, None, DefaultRootWindow(input_display), 0, 0,
+                 0, 0, x, y);
+    XTestFakeButtonEvent(input_display, Button5, True, CurrentTime);
+    XTestFakeButtonEvent(input_display, Button5, False, CurrentTime);
+    flush_xtest_event(XI_RawButtonPress);
+    return true;
+  }
+  if (!open_display()) {
+    return false;
   }
   XWarpPointer(display, None, RootWindow(display, 0), 0, 0, 0, 0, x, y);
   static bool x_test_extension_queried = false;
@@ -191,19 +892,42 @@ bool send_scroll_down(int x, int y) {
 }
 
 
-static bool start_time_initialized = false;
-static struct timeval start_time;
-static const int64_t nanoseconds_per_microsecond = 1000;
-int64_t get_nanoseconds() {
-  if (!start_time_initialized) {
-    gettimeofday(&start_time, NULL);
-    start_time_initialized = true;
+typedef struct {
+  pthread_t thread;
+  void (*thread_main)(void *);
+  void *argument;
+} x11_thread;
+
+
+static void *run_thread(void *thread) {
+  x11_thread *t = (x11_thread *)thread;
+  t->thread_main(t->argument);
+  return NULL;
+}
+
+
+void *start_thread(void (*thread_main)(void *), void *argument) {
+  x11_thread *thread = (x11_thread *)malloc(sizeof(x11_thread));
+  thread->thread_main = thread_main;
+  thread->argument = argument;
+  if (pthread_create(&thread->thread, NULL, run_thread, thread)) {
+    debug_log("pthread_create failed");
+    free(thread);
+    return NULL;
   }
-  struct timeval current_time, difference;
-  gettimeofday(&current_time, NULL);
-  timersub(&current_time, &start_time, &difference);
-  return ((int64_t)difference.tv_sec) * nanoseconds_per_second +
-      ((int64_t)difference.tv_usec) * nanoseconds_per_microsecond;
+  return thread;
+}
+
+
+void join_thread(void *thread) {
+  pthread_join(((x11_thread *)thread)->thread, NULL);
+  free(thread);
+}
+
+
+int get_processor_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
 }
 
 
@@ -286,6 +1010,12 @@ typedef int (*glXSwapIntervalMESA_t)(int);
 static glXSwapIntervalMESA_t p_glXSwapIntervalMESA = NULL;
 typedef void (*glXSwapIntervalEXT_t)(Display *, GLXDrawable, int);
 static glXSwapIntervalEXT_t p_glXSwapIntervalEXT = NULL;
+typedef Bool (*glXGetSyncValuesOML_t)(Display *, GLXDrawable, int64_t *,
+                                      int64_t *, int64_t *);
+static glXGetSyncValuesOML_t p_glXGetSyncValuesOML = NULL;
+typedef Bool (*glXGetMscRateOML_t)(Display *, GLXDrawable, int32_t *,
+                                   int32_t *);
+static glXGetMscRateOML_t p_glXGetMscRateOML = NULL;
 
 
 static void initialize_gl_extensions() {
@@ -297,10 +1027,229 @@ static void initialize_gl_extensions() {
     // This one is supported by NVIDIA, but not Intel or AMD
     p_glXSwapIntervalEXT = (glXSwapIntervalEXT_t)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalEXT");
   }
+  if (extension_supported("GLX_OML_sync_control")) {
+    p_glXGetSyncValuesOML = (glXGetSyncValuesOML_t)glXGetProcAddressARB((const GLubyte *)"glXGetSyncValuesOML");
+    p_glXGetMscRateOML = (glXGetMscRateOML_t)glXGetProcAddressARB((const GLubyte *)"glXGetMscRateOML");
+  }
+}
+
+
+// Sets the number of vblanks each swap waits for; 0 disables vsync.
+static bool set_swap_interval(Window window, int interval) {
+  if (p_glXSwapIntervalMESA) {
+    int ret = p_glXSwapIntervalMESA(interval);
+    if (ret) {
+      debug_log("glXSwapIntervalMESA failed %d", ret);
+      return false;
+    }
+    return true;
+  }
+  if (p_glXSwapIntervalEXT) {
+    p_glXSwapIntervalEXT(display, window, interval);
+    return true;
+  }
+  debug_log("No method of setting the swap interval available.");
+  return false;
+}
+
+
+// Returns the display's refresh period, or 60 Hz if it isn't known.
+static int64_t refresh_period(Window window) {
+  int32_t numerator, denominator;
+  if (p_glXGetMscRateOML &&
+      p_glXGetMscRateOML(display, window, &numerator, &denominator) &&
+      numerator > 0 && denominator > 0) {
+    return nanoseconds_per_second * denominator / numerator;
+  }
+  return nanoseconds_per_second / 60;
 }
 
 
-static void native_reference_window_event_loop(uint8_t pattern[]) {
+// Predicts the time of the first vblank after now from the last vblank
+// reported by GLX_OML_sync_control. Returns false if it isn't supported.
+static bool predict_next_vblank(Window window, int64_t period,
+    int64_t *out_vblank) {
+  int64_t ust, msc, sbc;
+  if (!p_glXGetSyncValuesOML ||
+      !p_glXGetSyncValuesOML(display, window, &ust, &msc, &sbc) || !ust) {
+    return false;
+  }
+  // UST is CLOCK_MONOTONIC in microseconds on Linux.
+  int64_t vblank = clock_nanoseconds_from_monotonic(ust * 1000);
+  int64_t now = get_nanoseconds();
+  if (vblank <= now) {
+    vblank += ((now - vblank) / period + 1) * period;
+  }
+  *out_vblank = vblank;
+  return true;
+}
+
+
+// Sleeps until an event is waiting on the display connection or the deadline
+// passes, without spinning. Returns true if there are events to process.
+static bool wait_for_x_events(int64_t deadline) {
+  struct pollfd connection = { ConnectionNumber(display), POLLIN, 0 };
+  while (!XPending(display)) {
+    int64_t remaining = deadline - get_nanoseconds();
+    if (remaining <= 0) {
+      return false;
+    }
+    if (remaining >= nanoseconds_per_millisecond) {
+      poll(&connection, 1, (int)(remaining / nanoseconds_per_millisecond));
+    } else {
+      // poll can't sleep for less than a millisecond.
+      usleep((unsigned int)(remaining / 1000));
+    }
+  }
+  return true;
+}
+
+
+typedef struct {
+  int scrolls;
+  int key_downs;
+  int last_key_id;
+  int esc_presses;
+} reference_window_input;
+
+
+// Handles all pending events. Returns true if any of them was input that
+// changes the pattern.
+static bool process_reference_window_events(reference_window_input *input) {
+  bool changed = false;
+  while (XPending(display)) {
+    XEvent event;
+    XNextEvent(display, &event);
+    if (event.type == ButtonPress) {
+      // This is probably a mousewheel event.
+      input->scrolls++;
+      changed = true;
+    } else if (event.type == KeyPress) {
+      KeySym keysym = XkbKeycodeToKeysym(display, event.xkey.keycode, 0, 0);
+      if (keysym == XK_Escape) {
+        input->esc_presses++;
+      }
+      switch (keysym) {
+      case XK_z: input->last_key_id = 1; break;
+      case XK_x: input->last_key_id = 2; break;
+      case XK_c: input->last_key_id = 3; break;
+      case XK_v: input->last_key_id = 4; break;
+      }
+      input->key_downs++;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+
+// Draws a frame and presents it. Swapping has no effect on a single-buffered
+// window, so the drawing is flushed to the front buffer instead.
+static void draw_reference_frame(Window window, uint8_t pattern[],
+    const reference_window_input *input) {
+  draw_pattern_with_opengl(pattern, input->scrolls, input->key_downs,
+      input->last_key_id, input->esc_presses);
+  glXSwapBuffers(display, window);
+  glFlush();
+}
+
+
+// Draws as soon as input arrives, and once per refresh otherwise to keep the
+// frame counters moving. Sleeps on the X connection in between. Used with vsync
+// off, or with a single-buffered window where frames go straight to the front
+// buffer.
+static void run_render_on_input_loop(Window window, uint8_t pattern[],
+    reference_window_input *input) {
+  int64_t period = refresh_period(window);
+  int64_t next_frame = get_nanoseconds() + period;
+  while (getppid() != 1) {
+    wait_for_x_events(next_frame);
+    process_reference_window_events(input);
+    draw_reference_frame(window, pattern, input);
+    int64_t now = get_nanoseconds();
+    if (now >= next_frame) {
+      next_frame = now + period;
+    }
+  }
+}
+
+
+static void run_immediate_loop(Window window, uint8_t pattern[],
+    reference_window_input *input) {
+  if (!set_swap_interval(window, 0)) {
+    exit(1);
+  }
+  run_render_on_input_loop(window, pattern, input);
+}
+
+
+// Draws frames back to back without ever sleeping, reading input between
+// frames. With vsync off this is the classic game loop; with vsync on the swap
+// blocks once the driver's queue of frames is full, and finish makes it wait
+// for each frame to complete before reading input for the next, so frames
+// can't queue up.
+static void run_continuous_loop(Window window, uint8_t pattern[],
+    reference_window_input *input, int swap_interval, bool finish) {
+  if (!set_swap_interval(window, swap_interval)) {
+    exit(1);
+  }
+  while (getppid() != 1) {
+    process_reference_window_events(input);
+    draw_reference_frame(window, pattern, input);
+    if (finish) {
+      glFinish();
+    }
+  }
+}
+
+
+// Time reserved before each vblank to draw and submit a frame. Starts at 2 ms
+// and grows if drawing takes longer.
+static const int64_t initial_late_render_margin = 2 * 1000 * 1000;
+
+// Vsync on. Sleeps until just before the next vblank, then draws one frame with
+// all the input received so far, so input waits as little as possible for the
+// frame that shows it.
+static void run_late_vsync_loop(Window window, uint8_t pattern[],
+    reference_window_input *input) {
+  int64_t period = refresh_period(window);
+  int64_t vblank;
+  if (!predict_next_vblank(window, period, &vblank)) {
+    debug_log("GLX_OML_sync_control is unavailable, rendering immediately.");
+    run_immediate_loop(window, pattern, input);
+    return;
+  }
+  if (!set_swap_interval(window, 1)) {
+    exit(1);
+  }
+  int64_t margin = initial_late_render_margin;
+  while (getppid() != 1) {
+    if (!predict_next_vblank(window, period, &vblank)) {
+      debug_log("glXGetSyncValuesOML failed");
+      exit(1);
+    }
+    // If we're already inside the margin, target the vblank after.
+    if (vblank - margin < get_nanoseconds()) {
+      vblank += period;
+    }
+    while (wait_for_x_events(vblank - margin)) {
+      process_reference_window_events(input);
+    }
+    int64_t start = get_nanoseconds();
+    draw_reference_frame(window, pattern, input);
+    glFlush();
+    int64_t render_time = get_nanoseconds() - start;
+    if (render_time + 500 * 1000 > margin) {
+      margin = render_time + 500 * 1000;
+      debug_log("late vsync render margin now %f ms",
+          margin / (double)nanoseconds_per_millisecond);
+    }
+  }
+}
+
+
+static void native_reference_window_event_loop(uint8_t pattern[],
+    native_reference_strategy strategy) {
   // This function should only be called from a child process that isn't yet
   // connected to the X server.
   assert(!display);
@@ -308,12 +1257,16 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
   assert(display);
   // Initialize GLX.
   int visual_attributes[] = { GLX_RGBA,
-                              GLX_DOUBLEBUFFER,
                               GLX_RED_SIZE, 1,
                               GLX_GREEN_SIZE, 1,
                               GLX_BLUE_SIZE, 1,
+                              GLX_DOUBLEBUFFER,
                               None,
                             };
+  if (strategy == NATIVE_REFERENCE_FRONT_BUFFER) {
+    // Drop GLX_DOUBLEBUFFER to get a single-buffered visual.
+    visual_attributes[7] = None;
+  }
   XVisualInfo *xvi = glXChooseVisual(display, DefaultScreen(display),
                                      visual_attributes);
   assert(xvi);
@@ -348,37 +1301,11 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
   assert(success);
   initialize_gl_extensions();
 
-  // Disable vsync to avoid blocking on swaps. Ideally we would sync to the
-  // display's refresh rate and render at the best possible time to achieve low
-  // latency and low CPU use while still avoiding tearing. That should be
-  // possible, but will be difficult to implement and will depend on driver/
-  // compositor support. For now we'll just render as fast as possible to
-  // achieve low latency.
-  bool disabled_vsync = false;
-  if (p_glXSwapIntervalMESA) {
-    int ret = p_glXSwapIntervalMESA(0);
-    if (ret) {
-      debug_log("glXSwapIntervalMESA failed %d", ret);
-      exit(1);
-    }
-    disabled_vsync = true;
-  }
-  if (!disabled_vsync && p_glXSwapIntervalEXT) {
-    p_glXSwapIntervalEXT(display, window, 0);
-    disabled_vsync = true;
-  }
-  if (!disabled_vsync) {
-    debug_log("No method of disabling vsync available.");
-    exit(1);
-  }
-
   // Draw the pattern on the window before showing it.
-  int scrolls = 0;
-  int key_downs = 0;
-  int esc_presses = 0;
-  draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
-  glXSwapBuffers(display, window);
- 
+  reference_window_input input;
+  memset(&input, 0, sizeof(input));
+  draw_reference_frame(window, pattern, &input);
+
   // Show the window.
   XMapRaised(display, window);
   // Override-redirect windows don't automatically gain focus when mapped, so we
@@ -386,24 +1313,25 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
   XSetInputFocus(display, window, RevertToParent, CurrentTime);
 
   // Process X11 events in a loop forever unless the parent process dies.
-  while (getppid() != 1) {
-    while (XPending(display)) {
-      XEvent event;
-      XNextEvent(display, &event);
-      if (event.type == ButtonPress) {
-        // This is probably a mousewheel event.
-        scrolls++;
-      } else if (event.type == KeyPress) {
-        if (XkbKeycodeToKeysym(display, event.xkey.keycode, 0, 0) ==
-            XK_Escape) {
-          esc_presses++;
-        }
-        key_downs++;
-      }
-    }
-    draw_pattern_with_opengl(pattern, scrolls, key_downs, esc_presses);
-    glXSwapBuffers(display, window);
-    usleep(1000 * 5);
+  switch (strategy) {
+  case NATIVE_REFERENCE_LATE_VSYNC:
+    run_late_vsync_loop(window, pattern, &input);
+    break;
+  case NATIVE_REFERENCE_BUSY:
+    run_continuous_loop(window, pattern, &input, 0, false);
+    break;
+  case NATIVE_REFERENCE_VSYNC:
+    run_continuous_loop(window, pattern, &input, 1, false);
+    break;
+  case NATIVE_REFERENCE_VSYNC_FINISH:
+    run_continuous_loop(window, pattern, &input, 1, true);
+    break;
+  case NATIVE_REFERENCE_FRONT_BUFFER:
+    run_render_on_input_loop(window, pattern, &input);
+    break;
+  default:
+    run_immediate_loop(window, pattern, &input);
+    break;
   }
   XCloseDisplay(display);
 }
@@ -412,7 +1340,8 @@ static void native_reference_window_event_loop(uint8_t pattern[]) {
 static pid_t window_process_pid = 0;
 
 
-bool open_native_reference_window(uint8_t *test_pattern_for_window) {
+bool open_native_reference_window(uint8_t *test_pattern_for_window,
+    native_reference_strategy strategy) {
   if (window_process_pid != 0) {
     debug_log("Native reference window already open");
     return false;
@@ -422,7 +1351,7 @@ bool open_native_reference_window(uint8_t *test_pattern_for_window) {
     // Child process. Throw away the X11 display connection from the parent
     // process; we will create a new one for the child.
     display = NULL;
-    native_reference_window_event_loop(test_pattern_for_window);
+    native_reference_window_event_loop(test_pattern_for_window, strategy);
     exit(0);
   }
   // Parent process. Wait for the child to launch and show its window before
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../screenscraper.h"
+#include "clock.h"
+#include "uinput.h"
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Older kernel headers only have the timeval.
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+typedef struct {
+  // The uinput file that events are written to.
+  int fd;
+  // The device's evdev node, which events are read back from to get the
+  // kernel's timestamps, or -1 if it couldn't be opened. Containers often
+  // don't have device nodes for new devices.
+  int events_fd;
+} virtual_device;
+
+static virtual_device keyboard = { -1, -1 };
+static virtual_device pointer = { -1, -1 };
+
+// The range of the pointer's absolute axes. The window system scales it to
+// the screen.
+static const int pointer_axis_max = 65535;
+// How long to wait for a written event to be readable from the evdev node.
+static const int64_t event_read_timeout = 10 * 1000 * 1000;
+// How long to give the window system to find a new device before sending
+// events from it.
+static const int64_t device_settle_time = 1000 * 1000 * 1000;
+
+
+static bool emit(int fd, int type, int code, int value) {
+  struct input_event event;
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.code = code;
+  event.value = value;
+  return write(fd, &event, sizeof(event)) == sizeof(event);
+}
+
+
+// Opens the evdev node that the kernel created for a uinput device.
+static int open_event_node(int uinput_fd) {
+  char sysname[64];
+  if (ioctl(uinput_fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+    return -1;
+  }
+  char path[256];
+  snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+  DIR *directory = opendir(path);
+  if (!directory) {
+    return -1;
+  }
+  int fd = -1;
+  struct dirent *entry;
+  while ((entry = readdir(directory))) {
+    if (strncmp(entry->d_name, "event", 5) == 0) {
+      snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+      fd = open(path, O_RDONLY | O_NONBLOCK);
+      break;
+    }
+  }
+  closedir(directory);
+  if (fd >= 0) {
+    // evdev timestamps default to CLOCK_REALTIME.
+    int clock = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clock) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  return fd;
+}
+
+
+static bool create_device(virtual_device *device,
+    struct uinput_user_dev *setup) {
+  setup->id.bustype = BUS_VIRTUAL;
+  setup->id.vendor = 0x18d1;
+  setup->id.version = 1;
+  if (write(device->fd, setup, sizeof(*setup)) != sizeof(*setup) ||
+      ioctl(device->fd, UI_DEV_CREATE) < 0) {
+    debug_log("Failed to create uinput device %s", setup->name);
+    return false;
+  }
+  return true;
+}
+
+
+static bool create_keyboard() {
+  keyboard.fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (keyboard.fd < 0) {
+    return false;
+  }
+  ioctl(keyboard.fd, UI_SET_EVBIT, EV_KEY);
+  ioctl(keyboard.fd, UI_SET_EVBIT, EV_SYN);
+  // Advertise a full keyboard so it isn't mistaken for some other device.
+  for (int key = KEY_ESC; key <= KEY_MICMUTE; key++) {
+    ioctl(keyboard.fd, UI_SET_KEYBIT, key);
+  }
+  struct uinput_user_dev setup;
+  memset(&setup, 0, sizeof(setup));
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE,
+           "Web Latency Benchmark keyboard");
+  setup.id.product = 1;
+  return create_device(&keyboard, &setup);
+}
+
+
+// The pointer has absolute axes, like the tablet that VMs emulate, so it can be
+// moved straight to the test window.
+static bool create_pointer() {
+  pointer.fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (pointer.fd < 0) {
+    return false;
+  }
+  ioctl(pointer.fd, UI_SET_EVBIT, EV_KEY);
+  ioctl(pointer.fd, UI_SET_EVBIT, EV_ABS);
+  ioctl(pointer.fd, UI_SET_EVBIT, EV_REL);
+  ioctl(pointer.fd, UI_SET_EVBIT, EV_SYN);
+  ioctl(pointer.fd, UI_SET_KEYBIT, BTN_LEFT);
+  ioctl(pointer.fd, UI_SET_KEYBIT, BTN_RIGHT);
+  ioctl(pointer.fd, UI_SET_KEYBIT, BTN_MIDDLE);
+  ioctl(pointer.fd, UI_SET_ABSBIT, ABS_X);
+  ioctl(pointer.fd, UI_SET_ABSBIT, ABS_Y);
+  ioctl(pointer.fd, UI_SET_RELBIT, REL_WHEEL);
+  struct uinput_user_dev setup;
+  memset(&setup, 0, sizeof(setup));
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE,
+           "Web Latency Benchmark pointer");
+  setup.id.product = 2;
+  setup.absmax[ABS_X] = pointer_axis_max;
+  setup.absmax[ABS_Y] = pointer_axis_max;
+  return create_device(&pointer, &setup);
+}
+
+
+bool uinput_open() {
+  if (keyboard.fd >= 0) {
+    return true;
+  }
+  if (!create_keyboard() || !create_pointer()) {
+    debug_log("Couldn't create uinput devices. Is the uinput module loaded, "
+              "and is /dev/uinput writable?");
+    if (keyboard.fd >= 0) {
+      close(keyboard.fd);
+      keyboard.fd = -1;
+    }
+    if (pointer.fd >= 0) {
+      close(pointer.fd);
+      pointer.fd = -1;
+    }
+    return false;
+  }
+  // The device nodes are created asynchronously, and the window system needs
+  // time to open the devices, so wait before sending anything.
+  int64_t deadline = get_nanoseconds() + device_settle_time;
+  while (get_nanoseconds() < deadline) {
+    if (keyboard.events_fd < 0) {
+      keyboard.events_fd = open_event_node(keyboard.fd);
+    }
+    if (pointer.events_fd < 0) {
+      pointer.events_fd = open_event_node(pointer.fd);
+    }
+    usleep(10 * 1000);
+  }
+  if (keyboard.events_fd < 0 || pointer.events_fd < 0) {
+    debug_log("Couldn't open uinput device nodes; input times are estimated.");
+  }
+  return true;
+}
+
+
+// Returns the kernel's timestamp of the given event, which was written between
+// the times before and after. The timestamp is read back from the device's
+// evdev node and clamped to that window; if it can't be read, after is used.
+static int64_t read_event_time(virtual_device *device, int type, int code,
+    int value, int64_t before, int64_t after) {
+  if (device->events_fd < 0) {
+    return after;
+  }
+  int64_t time = after;
+  bool found = false;
+  struct pollfd events = { device->events_fd, POLLIN, 0 };
+  int64_t deadline = after + event_read_timeout;
+  while (true) {
+    struct input_event event;
+    // Read everything that's queued, so old events never build up.
+    while (read(device->events_fd, &event, sizeof(event)) == sizeof(event)) {
+      if (!found && event.type == type && event.code == code &&
+          event.value == value) {
+        found = true;
+        time = clock_nanoseconds_from_monotonic(
+            (int64_t)event.input_event_sec * nanoseconds_per_second +
+            (int64_t)event.input_event_usec * 1000);
+      }
+    }
+    if (found) {
+      break;
+    }
+    int64_t remaining = deadline - get_nanoseconds();
+    if (remaining <= 0) {
+      debug_log("Didn't read back uinput event.");
+      break;
+    }
+    poll(&events, 1,
+         (int)((remaining + nanoseconds_per_millisecond - 1) /
+               nanoseconds_per_millisecond));
+  }
+  return time < before ? before : (time > after ? after : time);
+}
+
+
+bool uinput_send_key(int key, int64_t *out_time) {
+  if (keyboard.fd < 0) {
+    return false;
+  }
+  int64_t before = get_nanoseconds();
+  bool success = emit(keyboard.fd, EV_KEY, key, 1) &&
+      emit(keyboard.fd, EV_SYN, SYN_REPORT, 0);
+  int64_t after = get_nanoseconds();
+  success = emit(keyboard.fd, EV_KEY, key, 0) &&
+      emit(keyboard.fd, EV_SYN, SYN_REPORT, 0) && success;
+  if (!success) {
+    debug_log("Failed to write uinput key event");
+    return false;
+  }
+  *out_time = read_event_time(&keyboard, EV_KEY, key, 1, before, after);
+  return true;
+}
+
+
+bool uinput_send_scroll_down(double x, double y, int64_t *out_time) {
+  if (pointer.fd < 0) {
+    return false;
+  }
+  bool success =
+      emit(pointer.fd, EV_ABS, ABS_X, (int)(x * pointer_axis_max)) &&
+      emit(pointer.fd, EV_ABS, ABS_Y, (int)(y * pointer_axis_max)) &&
+      emit(pointer.fd, EV_SYN, SYN_REPORT, 0);
+  int64_t before = get_nanoseconds();
+  success = success && emit(pointer.fd, EV_REL, REL_WHEEL, -1) &&
+      emit(pointer.fd, EV_SYN, SYN_REPORT, 0);
+  int64_t after = get_nanoseconds();
+  if (!success) {
+    debug_log("Failed to write uinput scroll event");
+    return false;
+  }
+  *out_time = read_event_time(&pointer, EV_REL, REL_WHEEL, -1, before, after);
+  return true;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Input injection through the kernel's uinput module. Events from these
+// virtual devices go through the whole input stack, including evdev, libinput
+// and the X server or Wayland compositor, exactly like events from a real
+// keyboard and mouse. Only /dev/uinput is needed, so this also works in VMs and
+// containers without an input device of their own.
+
+#ifndef WLB_X11_UINPUT_H_
+#define WLB_X11_UINPUT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Creates the virtual keyboard and pointer. Returns false if /dev/uinput can't
+// be opened, usually because the uinput module isn't loaded or the user
+// doesn't have permission to write to it.
+bool uinput_open();
+
+// Presses and releases the given key (a KEY_* code from linux/input.h). On
+// success out_time is set to the kernel's timestamp of the key press.
+bool uinput_send_key(int key, int64_t *out_time);
+
+// Moves the pointer to the given fraction (0-1) of the screen's width and
+// height, then scrolls the wheel down one click. On success out_time is set to
+// the kernel's timestamp of the wheel event.
+bool uinput_send_scroll_down(double x, double y, int64_t *out_time);
+
+#endif  // WLB_X11_UINPUT_H_
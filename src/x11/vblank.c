@@ -0,0 +1,189 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../screenscraper.h"
+#include "clock.h"
+#include "vblank.h"
+#include <X11/Xlib.h>
+#include <X11/extensions/Xpresent.h>
+#include <pthread.h>
+
+// The last vblank reported by the X server, and an estimate of the refresh
+// period, protected by vblank_mutex.
+static pthread_mutex_t vblank_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t last_vblank_time = 0;
+static int64_t last_frame_counter = 0;
+static double refresh_period = 0;
+static pthread_once_t vblank_once = PTHREAD_ONCE_INIT;
+// The area of the screen covered by the monitor whose vblanks are tracked, set
+// by set_vblank_output and picked up by the tracking thread. Also protected by
+// vblank_mutex.
+static bool output_changed = false;
+static int output_x, output_y, output_width, output_height;
+
+// If no vblank has been reported for this long, the display has probably been
+// turned off and the extrapolated times can't be trusted.
+static const int64_t stale_vblank_nanoseconds = 1000 * 1000 * 1000;
+
+
+static void record_vblank(int64_t time, int64_t frame_counter) {
+  pthread_mutex_lock(&vblank_mutex);
+  if (last_frame_counter && frame_counter > last_frame_counter) {
+    double period = (time - last_vblank_time) /
+        (double)(frame_counter - last_frame_counter);
+    // Smooth out jitter in the reported times.
+    refresh_period = refresh_period ?
+        refresh_period * 0.9 + period * 0.1 : period;
+  }
+  last_vblank_time = time;
+  last_frame_counter = frame_counter;
+  pthread_mutex_unlock(&vblank_mutex);
+}
+
+
+// Present reports the vblanks of the CRTC that covers most of the given
+// window. The root window spans every monitor, so to follow a particular
+// monitor an unmapped window is created over it. Returns the window to track,
+// or root if the monitor hasn't been chosen.
+static Window create_output_window(Display *display, Window root) {
+  pthread_mutex_lock(&vblank_mutex);
+  output_changed = false;
+  int x = output_x, y = output_y, width = output_width, height = output_height;
+  // The frame counters of different CRTCs are unrelated.
+  last_vblank_time = 0;
+  last_frame_counter = 0;
+  refresh_period = 0;
+  pthread_mutex_unlock(&vblank_mutex);
+  if (width <= 0 || height <= 0) {
+    return root;
+  }
+  XSetWindowAttributes attributes;
+  attributes.override_redirect = True;
+  return XCreateWindow(display, root, x, y, width, height, 0, CopyFromParent,
+      InputOutput, CopyFromParent, CWOverrideRedirect, &attributes);
+}
+
+
+static void *vblank_thread_main(void *unused) {
+  // This thread has its own connection so that waiting for events doesn't
+  // block screenshots.
+  Display *display = XOpenDisplay(NULL);
+  if (!display) {
+    return NULL;
+  }
+  int opcode, event_base, error_base;
+  if (!XPresentQueryExtension(display, &opcode, &event_base, &error_base)) {
+    debug_log("Present extension not available; screenshots won't have "
+        "vblank times.");
+    XCloseDisplay(display);
+    return NULL;
+  }
+  Window root = DefaultRootWindow(display);
+  Window window = create_output_window(display, root);
+  XPresentSelectInput(display, window, PresentCompleteNotifyMask);
+  uint32_t serial = 0;
+  // Ask to be notified at the next vblank. Each notification asks for the one
+  // after it.
+  XPresentNotifyMSC(display, window, ++serial, 0, 1, 0);
+  XFlush(display);
+  while (true) {
+    XEvent event;
+    XNextEvent(display, &event);
+    if (event.type != GenericEvent || event.xcookie.extension != opcode ||
+        !XGetEventData(display, &event.xcookie)) {
+      continue;
+    }
+    if (event.xcookie.evtype == PresentCompleteNotify) {
+      XPresentCompleteNotifyEvent *complete =
+          (XPresentCompleteNotifyEvent *)event.xcookie.data;
+      pthread_mutex_lock(&vblank_mutex);
+      bool switch_output = output_changed;
+      pthread_mutex_unlock(&vblank_mutex);
+      // Notifications for a window that is no longer tracked are ignored.
+      if (complete->kind == PresentCompleteKindNotifyMSC &&
+          complete->window == window) {
+        if (switch_output) {
+          if (window != root) {
+            XDestroyWindow(display, window);
+          }
+          window = create_output_window(display, root);
+          XPresentSelectInput(display, window, PresentCompleteNotifyMask);
+          XPresentNotifyMSC(display, window, ++serial, 0, 1, 0);
+        } else {
+          // UST is CLOCK_MONOTONIC in microseconds.
+          record_vblank(
+              clock_nanoseconds_from_monotonic((int64_t)complete->ust * 1000),
+              (int64_t)complete->msc);
+          XPresentNotifyMSC(display, window, ++serial, complete->msc + 1, 0,
+                            0);
+        }
+        XFlush(display);
+      }
+    }
+    XFreeEventData(display, &event.xcookie);
+  }
+  return NULL;
+}
+
+
+static void start_vblank_thread() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, vblank_thread_main, NULL) == 0) {
+    pthread_detach(thread);
+  }
+}
+
+
+void start_vblank_tracking() {
+  pthread_once(&vblank_once, start_vblank_thread);
+}
+
+
+void set_vblank_output(int x, int y, int width, int height) {
+  pthread_mutex_lock(&vblank_mutex);
+  output_changed = output_x != x || output_y != y || output_width != width ||
+      output_height != height;
+  output_x = x;
+  output_y = y;
+  output_width = width;
+  output_height = height;
+  pthread_mutex_unlock(&vblank_mutex);
+}
+
+
+bool find_vblank(int64_t time, int64_t *out_vblank_time,
+    int64_t *out_frame_counter) {
+  pthread_mutex_lock(&vblank_mutex);
+  int64_t vblank_time = last_vblank_time;
+  int64_t frame_counter = last_frame_counter;
+  double period = refresh_period;
+  pthread_mutex_unlock(&vblank_mutex);
+  if (!frame_counter || period <= 0 ||
+      time - vblank_time > stale_vblank_nanoseconds) {
+    return false;
+  }
+  // The notification for a vblank arrives shortly after it, so the given time
+  // is usually a little after the last reported vblank, but it may be before
+  // it if the notification raced with the screenshot.
+  double frames = (time - vblank_time) / period;
+  int64_t whole_frames = (int64_t)frames;
+  if (whole_frames > frames) {
+    whole_frames--;  // Round towards negative infinity.
+  }
+  *out_vblank_time = vblank_time + (int64_t)(whole_frames * period);
+  *out_frame_counter = frame_counter + whole_frames;
+  return true;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2013 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tracks the display's vertical blanking intervals using the Present
+// extension, so screenshots can be tagged with the refresh in which their
+// pixels were scanned out. A background thread asks the X server to notify it
+// of every vblank and records the time (UST) and frame counter (MSC) it
+// reports.
+
+#ifndef WLB_X11_VBLANK_H_
+#define WLB_X11_VBLANK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Starts the vblank tracking thread if it isn't running already. Does nothing
+// if the X server doesn't support the Present extension.
+void start_vblank_tracking();
+
+// Tracks the vblanks of the monitor covering the given area of the screen,
+// instead of the one the X server picks for the whole screen. Takes effect at
+// the next vblank.
+void set_vblank_output(int x, int y, int width, int height);
+
+// Finds the most recent vblank at or before the given time, which is in the
+// timebase of get_nanoseconds. Returns false if vblank times aren't known, e.g.
+// because Present isn't supported or the display is off.
+bool find_vblank(int64_t time, int64_t *out_vblank_time,
+    int64_t *out_frame_counter);
+
+#endif  // WLB_X11_VBLANK_H_